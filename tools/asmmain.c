@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <getopt.h>
+#include "assembler.h"
+
+#define NDEBUG
+
+/*
+  $ asm code.s                 // creates code.o and code.txt
+  $ asm -o a.o code.s          // creates a.o and code.txt
+  $ asm -t b.txt code.s        // creates code.o and b.txt
+  $ asm -o a.o -t b.txt code.s // creates a.o and b.txt
+  $ asm -r code.s              // creates relocatable code.o for lnk
+  $ asm -e code.s              // creates code.o as an ELF32 executable, emu
+                               // loads it at its own addresses and starts at
+                               // _start, readelf and objdump can read it
+  $ asm -e -b 1000 os.s        // assembles os.s for address 0x1000
+  $ asm -O code.s              // runs the peephole and if-conversion pass,
+                               // reporting every change
+  $ asm -p code.prof code.s    // lays out the blocks of code.s by the profile
+                               // emu wrote with pr code.prof
+  $ asm -g code.s              // also creates code.dbg, the symbols and source
+                               // lines emu shows when it loads code.o
+  $ asm -l code.lst code.s     // also writes a listing of code.s with the
+                               // estimated cycles of every instruction, block
+                               // and loop
+  $ asm -l code.lst -c arm.costs code.s // takes the cycles of the classes
+                               // listed in arm.costs, such as "multiply 4"
+  NOTE: The following creates a obj file named -t
+  $ asm -o -t code.s // creates -t and code.txt
+ */
+static struct option long_options[] = {
+  {"obj",    no_argument,       0,  'o' },
+  {"txt",    required_argument, 0,  't' },
+  {"reloc",  no_argument,       0,  'r' },
+  {"optimise", no_argument,     0,  'O' },
+  {"profile", required_argument, 0,  'p' },
+  {"debug",  no_argument,       0,  'g' },
+  {"listing", required_argument, 0,  'l' },
+  {"costs",  required_argument, 0,  'c' },
+  {"elf",    no_argument,       0,  'e' },
+  {"base",   required_argument, 0,  'b' },
+  {0,        0,                 0,   0  }
+};
+
+int main(int argc, char **argv) {
+  char *objfilenameptr = NULL, *txtfilenameptr = NULL;
+  char objfilename[128], txtfilename[128], dbgfilename[128];
+  int opt, long_index;
+  int relocatable = 0, debug = 0, elf = 0;
+  uint32_t base = 0;
+  char *listingfilename = NULL;
+  asmOptions options = {false, NULL, NULL, NULL, NULL};
+
+  while ((opt = getopt_long(argc, argv, "o:t:rOp:gl:c:eb:", long_options, &long_index )) != -1) {
+    switch (opt) {
+      case 'o':
+        objfilenameptr = optarg;
+        break;
+      case 't':
+        txtfilenameptr = optarg;
+        break;
+      case 'r':
+        relocatable = 1;
+        break;
+      case 'O':
+        options.optimise = true;
+        options.report = stdout;
+        break;
+      case 'p':
+        options.profile = optarg;
+        options.report = stdout;
+        break;
+      case 'g':
+        debug = 1;
+        break;
+      case 'l':
+        listingfilename = optarg;
+        break;
+      case 'c':
+        options.costs = optarg;
+        break;
+      case 'e':
+        elf = 1;
+        break;
+      case 'b':
+        base = (uint32_t) strtoul(optarg, NULL, 16);
+        break;
+      default:
+        printf("Invalid invocation.\n");
+        exit(EXIT_FAILURE);
+    }
+  }
+  argc -= optind;
+  argv += optind;
+  if(!argv[0]) {
+    fprintf(stderr, "%s optind: %d argc: %d\n", "Wrong number of arguments", optind, argc);
+    return EXIT_FAILURE;
+  }
+  if (relocatable && elf) {
+    fprintf(stderr, "Choose one of -r and -e\n");
+    return EXIT_FAILURE;
+  }
+  if (base % 4) {
+    fprintf(stderr, "The base address 0x%x is not word aligned\n", base);
+    return EXIT_FAILURE;
+  }
+
+  char *srcfilename = argv[0];
+  char *ext = strrchr(srcfilename, '.');
+  if (ext == NULL || strlen(ext) != 2 || (ext != NULL && (ext[0] != '.' || ext[1] != 's'))) {
+    fprintf(stderr, "Assembly file must have .s extension!\n");
+    exit(EXIT_FAILURE);
+  }
+  int dotpos = ext - srcfilename;
+  for (int i = 0; i < dotpos; i++) {
+    objfilename[i] = argv[0][i];
+    txtfilename[i] = argv[0][i];
+  }
+  objfilename[dotpos] = '\0';
+  txtfilename[dotpos] = '\0';
+  strcat(objfilename, ".o");
+  strcat(txtfilename, ".txt");
+  if (objfilenameptr == NULL)
+    objfilenameptr = objfilename;
+  // the sidecar sits next to the object, emu looks for it there
+  strncpy(dbgfilename, objfilenameptr, sizeof(dbgfilename) - 5);
+  dbgfilename[sizeof(dbgfilename) - 5] = '\0';
+  ext = strrchr(dbgfilename, '.');
+  if (ext != NULL && strcmp(ext, ".o") == 0)
+    *ext = '\0';
+  strcat(dbgfilename, ".dbg");
+  if (txtfilenameptr == NULL)
+    txtfilenameptr = txtfilename;
+
+  printf(".s: %s, .o: %s, .txt: %s\n", argv[0], objfilenameptr, txtfilenameptr);
+
+  char *source = readSourceFile(argv[0]);
+  // check file existance throw error if not found
+  if (!source) {
+    fprintf(stderr, "The file %s was not found\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  if (listingfilename) {
+    options.listing = fopen(listingfilename, "w");
+    if (!options.listing) {
+      fprintf(stderr, "Can't write %s\n", listingfilename);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  asmResult result;
+  bool assembled = assembleSource(source, base, NULL, &options, &result);
+  free(source);
+  if (options.listing) {
+    fclose(options.listing);
+  }
+
+  // if we have compile erros stop and print errors
+  if (!assembled) {
+    printAsmErrors(stderr, &result);
+    clearAsmResult(&result);
+    exit(EXIT_FAILURE);
+  }
+
+  FILE *output = fopen(objfilenameptr, "wb");
+  if (relocatable) {
+    writeObject(output, &result);
+  } else if (elf) {
+    writeElf(output, &result);
+  } else {
+    fwrite(result.words, sizeof(uint32_t), result.size, output);
+  }
+  fclose(output);
+  FILE *hex = fopen(txtfilenameptr, "w");
+  for (int i = 0; i < result.size; i++)
+    fprintf(hex, "0x%08x\n", result.words[i]);
+  fclose(hex);
+  if (debug) {
+    FILE *dbg = fopen(dbgfilename, "w");
+    writeDebugInfo(dbg, &result, argv[0]);
+    fclose(dbg);
+  }
+  clearAsmResult(&result);
+  exit(EXIT_SUCCESS);
+}
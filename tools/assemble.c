@@ -5,8 +5,8 @@
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
-#include <getopt.h>
-#include "adts.h"
+#include <elf.h>
+#include "assembler.h"
 
 #define NDEBUG
 
@@ -20,13 +20,126 @@
 #define INSTRUCTION_SIZE 32
 #define ALWAYS_CONDITION ""
 #define BRANCH_OFFSET_SIZE  26
-#define NUMBER_OF_LINES 1000
+#define NUMBER_OF_LINES 1000 // initial capacity of the array of lines
+#define SECTION_TEXT 0
+#define SECTION_DATA 1
+#define FIRST_DATA_DIRECTIVE 4
+#define WORD_DIRECTIVE 4
+#define BYTE_DIRECTIVE 5
+#define ASCII_DIRECTIVE 6
+#define ASCIZ_DIRECTIVE 7
+#define SPACE_DIRECTIVE 8
+#define ALIGN_DIRECTIVE 9
+#define MAX_ALIGNMENT 12
+#define LTORG_DIRECTIVE 10
+#define EQU_DIRECTIVE 11
+#define SET_DIRECTIVE 12
+#define REPT_DIRECTIVE 13
+#define IRP_DIRECTIVE 14
+#define ENDR_DIRECTIVE 15
+#define MAX_REPEAT 0x10000  // largest .rept count
+#define LITERAL_RANGE 0xFFF // largest offset of a pc relative ldr
+#define OFFSET_RANGE 0xFFF  // largest immediate offset of ldr/str
+#define HALF_OFFSET_RANGE 0xFF // largest immediate offset of ldrh/strh
+#define MAX_SHIFT 31        // largest immediate shift amount
+#define MAX_SVC 0xFFFFFF    // largest svc number
+#define BLOCK_LOAD 4        // ldm, bit L of a block data transfer
+#define BLOCK_BEFORE 2      // address changes before each transfer, bit P
+#define BLOCK_UP 1          // addresses go up from the base, bit U
+#define STACK_REGISTER 13   // base register of push and pop
+#define PC_REGISTER 15
+#define OPERATOR_LEVELS 5   // precedence levels of binary operators
+#define NO_USE 0xFFFFFFFF
+#define NOT_CODE -1    // findInstruction reached data or a directive
+#define END_OF_CODE -2 // findInstruction reached the end of the source
+#define FLAG_DEPTH 8   // branches followed looking for a read of the flags
+#define IF_CONVERT_LIMIT 4 // instructions a branch may skip to be if-converted
+#define LAYOUT_KEEP 0      // the block ends as it did
+#define LAYOUT_APPEND 1    // a branch to the block after it is added
+#define LAYOUT_INVERT 2    // the branch goes to the block after it instead
+#define LAYOUT_REMOVE 3    // the branch goes to the next block and is removed
+#define LAYOUT_INDENT "        "
+#define ELF_SECTIONS 6     // null, .text, .data, .symtab, .strtab, .shstrtab
+#define ELF_SHSTRTAB "\0.text\0.data\0.symtab\0.strtab\0.shstrtab"
+#define LISTING_INDENT "                           " // under the cost columns
 
 /**
  * Types of tokens
  */
 typedef enum {INSTRUCTION, LABEL, EXPRESSION_TAG,
-              EXPRESSION_EQUAL, REGISTER, UNDEFINED} typeEnum;
+              EXPRESSION_EQUAL, REGISTER, DIRECTIVE, UNDEFINED} typeEnum;
+
+/**
+ * Kinds of source lines seen by the peephole pass
+ */
+typedef enum {PEEPHOLE_EMPTY, PEEPHOLE_CODE, PEEPHOLE_OTHER} lineKind;
+
+typedef struct literalPool literalPool;
+typedef struct peepholeLine peepholeLine;
+typedef struct layoutBlock layoutBlock;
+typedef struct blockLayout blockLayout;
+typedef struct expressionValue expressionValue;
+typedef struct expressionParser expressionParser;
+typedef struct symbolTable symbolTable;
+typedef struct expandedLines expandedLines;
+
+/**
+ * Literal pool bookkeeping shared by the two passes. The first pass decides
+ * where every pool is placed, the second pass looks the results up by line.
+ * Literals are keyed "=value" for numbers and "=label" for addresses.
+ */
+struct literalPool {
+  map      uses;     // literal -> number of ldr instructions loading it
+  map      keys;     // pending literal -> index in the pending pool
+  map      lines;    // pending ldr line -> index of the literal it loads
+  uint32_t firstUse; // byte offset of the first text ldr of the pending pool
+  map      slots;    // ldr line -> byte offset of its literal
+  map      after;    // line -> bytes of the pool placed after it
+  map      before;   // line -> bytes of the pool placed before the
+                     // instruction of the line, behind a branch over it
+};
+
+/**
+ * The value of an operand expression. symbol names the label or extern the
+ * value is an address relative to, it is "" for absolute values and for
+ * arithmetic the linker can't redo such as label * 2. labelled is set when
+ * any label took part, such values are only known once labels are placed.
+ */
+struct expressionValue {
+  uint32_t value;
+  char     symbol[MAX_LINE_LENGTH];
+  bool     labelled;
+};
+
+/* Position of the recursive descent through an expression */
+struct expressionParser {
+  char *position;
+  char undefined[MAX_LINE_LENGTH]; // first symbol found undefined, or ""
+};
+
+/**
+ * Names an expression may refer to. Every walk over the source defines the
+ * .equ/.set constants in order as it reaches them, so a constant must be
+ * defined before it is used. labels is NULL until the first pass has placed
+ * them, object gives the base address and the .extern names.
+ */
+struct symbolTable {
+  map        equates;
+  map        *labels;
+  objectInfo *object;
+};
+
+/**
+ * The lines of the source with every .rept/.irp block expanded
+ */
+struct expandedLines {
+  char     **lines;
+  uint32_t *numbers;   // line of the source each line came from
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t expansions; // blocks expanded so far, makes their labels unique
+};
+
 
 /**
  * Define map data structures and functions to full them.
@@ -36,20 +149,38 @@ map ALL_INSTRUCTIONS;
 map CONDITIONS;
 map DATA_TYPE;
 map SHIFTS;
+map DIRECTIVES;
+map BLOCK_MODES;
+map COSTS;
+symbolTable SYMBOLS;
+
+/**
+ * Puts name and its flag setting form, name with an s suffix such as adds,
+ * into the map with the same value
+ */
+void putWithFlags(map *m, char *name, uint32_t value) {
+  char flags[MAX_LINE_LENGTH];
+  snprintf(flags, MAX_LINE_LENGTH, "%ss", name);
+  put(m, name, value);
+  put(m, flags, value);
+}
 
 /**
  * Returns a map with all the Data Processing instructions from the assembler
  * and maps them to their respective opcode (bits 24, 23, 22, 21)
+ * Instructions that compute a result may set the flags with an s suffix
  */
 map fillDataToOpcode(void) {
   map m = constructMap();
-  put(&m, "add", 4);
-  put(&m, "sub", 2);
-  put(&m, "rsb", 3);
-  put(&m, "and", 0);
-  put(&m, "eor", 1);
-  put(&m, "orr", 12);
-  put(&m, "mov", 13);
+  putWithFlags(&m, "add", 4);
+  putWithFlags(&m, "sub", 2);
+  putWithFlags(&m, "rsb", 3);
+  putWithFlags(&m, "and", 0);
+  putWithFlags(&m, "eor", 1);
+  putWithFlags(&m, "orr", 12);
+  putWithFlags(&m, "mov", 13);
+  putWithFlags(&m, "bic", 14);
+  putWithFlags(&m, "mvn", 15);
   put(&m, "tst", 8);
   put(&m, "teq", 9);
   put(&m, "cmp", 10);
@@ -63,27 +194,42 @@ map fillDataToOpcode(void) {
  * 2 Single Data Transfer
  * 3 Branch
  * 4 Shifts
- * 5 Special andeq r0, r0, r0
+ * 5 Block Data Transfer
+ * 6 SVC
+ * 7 Divide
+ * 8 Atomic
+ * Instructions other than branches and svc take a condition suffix such as
+ * movlt, andeq r0, r0, r0 (the halt instruction) is such an and
  */
 map fillAllInstructions(void) {
   map m = constructMap();
   // 0 Data Processing
-  put(&m, "add", 0);
-  put(&m, "sub", 0);
-  put(&m, "rsb", 0);
-  put(&m, "and", 0);
-  put(&m, "eor", 0);
-  put(&m, "orr", 0);
-  put(&m, "mov", 0);
+  putWithFlags(&m, "add", 0);
+  putWithFlags(&m, "sub", 0);
+  putWithFlags(&m, "rsb", 0);
+  putWithFlags(&m, "and", 0);
+  putWithFlags(&m, "eor", 0);
+  putWithFlags(&m, "orr", 0);
+  putWithFlags(&m, "mov", 0);
+  putWithFlags(&m, "bic", 0);
+  putWithFlags(&m, "mvn", 0);
   put(&m, "tst", 0);
   put(&m, "teq", 0);
   put(&m, "cmp", 0);
   // 1 Multiply
-  put(&m, "mul", 1);
-  put(&m, "mla", 1);
+  putWithFlags(&m, "mul", 1);
+  putWithFlags(&m, "mla", 1);
+  putWithFlags(&m, "umull", 1);
+  putWithFlags(&m, "smull", 1);
+  putWithFlags(&m, "umlal", 1);
+  putWithFlags(&m, "smlal", 1);
   // 2 Single Data Transfer
   put(&m, "ldr", 2);
   put(&m, "str", 2);
+  put(&m, "ldrb", 2);
+  put(&m, "strb", 2);
+  put(&m, "ldrh", 2);
+  put(&m, "strh", 2);
   // 3 Branch
   put(&m, "beq", 3);
   put(&m, "bne", 3);
@@ -91,6 +237,16 @@ map fillAllInstructions(void) {
   put(&m, "blt", 3);
   put(&m, "bgt", 3);
   put(&m, "ble", 3);
+  put(&m, "bcs", 3);
+  put(&m, "bhs", 3);
+  put(&m, "bcc", 3);
+  put(&m, "blo", 3);
+  put(&m, "bmi", 3);
+  put(&m, "bpl", 3);
+  put(&m, "bvs", 3);
+  put(&m, "bvc", 3);
+  put(&m, "bhi", 3);
+  put(&m, "bls", 3);
   put(&m, "b", 3);
   put(&m, "bl", 3); // gusty
   //put(&m, "bx", 3); // gusty
@@ -99,21 +255,42 @@ map fillAllInstructions(void) {
   put(&m, "lsr", 4);
   put(&m, "asr", 4);
   put(&m, "ror", 4);
-  // 5 Special
-  put(&m, "andeq", 5);
+  // 5 Block Data Transfer
+  for (mapNode *node = BLOCK_MODES.head; node; node = node->next) {
+    put(&m, node->key, 5);
+  }
   // 6 SVC
   put(&m, "svc", 6);
+  // 7 Divide
+  put(&m, "sdiv", 7);
+  put(&m, "udiv", 7);
+  // 8 Atomic
+  put(&m, "swp", 8);
+  put(&m, "swpb", 8);
+  put(&m, "ldrex", 8);
+  put(&m, "strex", 8);
   return m;
 }
 
 /**
  * Returns a map containing all conditions from the cond field of the
- * instruction with their respective code
+ * instruction with their respective code, hs and lo are the unsigned
+ * aliases of cs and cc
  */
 map fillConditions(void) {
   map m = constructMap();
   put(&m, "eq", 0);
   put(&m, "ne", 1);
+  put(&m, "cs", 2);
+  put(&m, "hs", 2);
+  put(&m, "cc", 3);
+  put(&m, "lo", 3);
+  put(&m, "mi", 4);
+  put(&m, "pl", 5);
+  put(&m, "vs", 6);
+  put(&m, "vc", 7);
+  put(&m, "hi", 8);
+  put(&m, "ls", 9);
   put(&m, "ge", 10);
   put(&m, "lt", 11);
   put(&m, "gt", 12);
@@ -125,20 +302,22 @@ map fillConditions(void) {
 /**
  * Returns a map that classifies all Data Processing instructions:
  * 0 Instructions that compute results
- * 1 Mov instruction
+ * 1 Mov and mvn instructions
  * 2 Instructions that set flags
  */
 map fillDataToType(void) {
   map m = constructMap();
-  // instructions that compute results and, eor, sub, rsb, add, orr
-  put(&m, "and", 0);
-  put(&m, "eor", 0);
-  put(&m, "sub", 0);
-  put(&m, "rsb", 0);
-  put(&m, "add", 0);
-  put(&m, "orr", 0);
-  // single operand instruction mov
-  put(&m, "mov", 1);
+  // instructions that compute results and, eor, sub, rsb, add, orr, bic
+  putWithFlags(&m, "and", 0);
+  putWithFlags(&m, "eor", 0);
+  putWithFlags(&m, "sub", 0);
+  putWithFlags(&m, "rsb", 0);
+  putWithFlags(&m, "add", 0);
+  putWithFlags(&m, "orr", 0);
+  putWithFlags(&m, "bic", 0);
+  // single operand instructions mov, mvn
+  putWithFlags(&m, "mov", 1);
+  putWithFlags(&m, "mvn", 1);
   // Instructions that do not compute results,
   // but do set the CPSR flags: tst, teq, cmp
   put(&m, "tst", 2);
@@ -147,6 +326,37 @@ map fillDataToType(void) {
   return m;
 }
 
+/**
+ * Returns a map of the block data transfers to their BLOCK_ bits, with the
+ * stack forms full/empty descending/ascending such as stmfd next to the
+ * increment/decrement after/before forms such as stmdb. ldm and stm are
+ * ldmia and stmia, push is stmdb r13! and pop is ldmia r13!
+ */
+map fillBlockModes(void) {
+  map m = constructMap();
+  put(&m, "ldm", BLOCK_LOAD | BLOCK_UP);
+  put(&m, "ldmia", BLOCK_LOAD | BLOCK_UP);
+  put(&m, "ldmfd", BLOCK_LOAD | BLOCK_UP);
+  put(&m, "pop", BLOCK_LOAD | BLOCK_UP);
+  put(&m, "ldmib", BLOCK_LOAD | BLOCK_BEFORE | BLOCK_UP);
+  put(&m, "ldmed", BLOCK_LOAD | BLOCK_BEFORE | BLOCK_UP);
+  put(&m, "ldmda", BLOCK_LOAD);
+  put(&m, "ldmfa", BLOCK_LOAD);
+  put(&m, "ldmdb", BLOCK_LOAD | BLOCK_BEFORE);
+  put(&m, "ldmea", BLOCK_LOAD | BLOCK_BEFORE);
+  put(&m, "stm", BLOCK_UP);
+  put(&m, "stmia", BLOCK_UP);
+  put(&m, "stmea", BLOCK_UP);
+  put(&m, "stmib", BLOCK_BEFORE | BLOCK_UP);
+  put(&m, "stmfa", BLOCK_BEFORE | BLOCK_UP);
+  put(&m, "stmda", 0);
+  put(&m, "stmed", 0);
+  put(&m, "stmdb", BLOCK_BEFORE);
+  put(&m, "stmfd", BLOCK_BEFORE);
+  put(&m, "push", BLOCK_BEFORE);
+  return m;
+}
+
 /**
  * Returns a map with all 4 shifts mapped to their respective code
  */
@@ -159,20 +369,98 @@ map fillShifts(void) {
   return m;
 }
 
+/**
+ * Returns a map with all assembler directives:
+ * 0 .text    switch to the text section
+ * 1 .data    switch to the data section
+ * 2 .global  export labels to other objects (.globl is an alias)
+ * 3 .extern  import symbols defined in other objects
+ * 4 .word    32-bit values or label addresses, word aligned
+ * 5 .byte    8-bit values
+ * 6 .ascii   string
+ * 7 .asciz   null terminated string
+ * 8 .space   a number of bytes of fill, zero by default (.skip is an alias)
+ * 9 .align   pads to a multiple of 2 to the power of the operand
+ * 10 .ltorg  places the pending literal pool here
+ * 11 .equ    defines a constant: .equ name, expression
+ * 12 .set    like .equ but may redefine the constant
+ * 13 .rept   repeats the lines up to the matching .endr: .rept count
+ * 14 .irp    repeats them once for each value: .irp name, value, ...
+ * 15 .endr   ends the lines of a .rept or .irp
+ */
+map fillDirectives(void) {
+  map m = constructMap();
+  put(&m, ".text", 0);
+  put(&m, ".data", 1);
+  put(&m, ".global", 2);
+  put(&m, ".globl", 2);
+  put(&m, ".extern", 3);
+  put(&m, ".word", WORD_DIRECTIVE);
+  put(&m, ".byte", BYTE_DIRECTIVE);
+  put(&m, ".ascii", ASCII_DIRECTIVE);
+  put(&m, ".asciz", ASCIZ_DIRECTIVE);
+  put(&m, ".space", SPACE_DIRECTIVE);
+  put(&m, ".skip", SPACE_DIRECTIVE);
+  put(&m, ".align", ALIGN_DIRECTIVE);
+  put(&m, ".ltorg", LTORG_DIRECTIVE);
+  put(&m, ".equ", EQU_DIRECTIVE);
+  put(&m, ".set", SET_DIRECTIVE);
+  put(&m, ".rept", REPT_DIRECTIVE);
+  put(&m, ".irp", IRP_DIRECTIVE);
+  put(&m, ".endr", ENDR_DIRECTIVE);
+  return m;
+}
+
+/**
+ * Returns a map of the instruction classes of the cost listing to their
+ * default cycles, a cost table given with asm -c replaces them
+ * data     - data processing instruction
+ * shift    - added when the second operand or the offset is a shifted
+ *            register
+ * multiply - mul, mla and the long multiplies
+ * divide   - sdiv and udiv
+ * transfer - ldr and str, swp, ldrex and strex, and the first register of
+ *            ldm, stm, push and pop
+ * register - each further register of ldm, stm, push and pop
+ * branch   - taken branch, refetching the pipeline. Data processing and ldr
+ *            instructions writing r15 add it too
+ * svc      - supervisor call
+ */
+map fillCosts(void) {
+  map m = constructMap();
+  put(&m, "data", 1);
+  put(&m, "shift", 1);
+  put(&m, "multiply", 3);
+  put(&m, "divide", 12);
+  put(&m, "transfer", 3);
+  put(&m, "register", 1);
+  put(&m, "branch", 3);
+  put(&m, "svc", 3);
+  return m;
+}
+
 void fillAll(void) {
   DATA_OPCODE      = fillDataToOpcode();
+  BLOCK_MODES      = fillBlockModes();
   ALL_INSTRUCTIONS = fillAllInstructions();
   CONDITIONS       = fillConditions();
   DATA_TYPE        = fillDataToType();
   SHIFTS           = fillShifts();
+  DIRECTIVES       = fillDirectives();
+  COSTS            = fillCosts();
+  SYMBOLS.equates  = constructMap();
 }
 
 void freeAll(void) {
   clearMap(&DATA_OPCODE);
+  clearMap(&BLOCK_MODES);
   clearMap(&ALL_INSTRUCTIONS);
   clearMap(&CONDITIONS);
   clearMap(&DATA_TYPE);
   clearMap(&SHIFTS);
+  clearMap(&DIRECTIVES);
+  clearMap(&COSTS);
+  clearMap(&SYMBOLS.equates);
 }
 
 /**
@@ -180,46 +468,470 @@ void freeAll(void) {
  * I will eventually reorder the code so these are not needed
  */
  /**
-* Returns a char array that contains all the program lines
+* Returns a heap array with a copy of every line of source, the number of
+* lines is returned through lineCount
+**/
+char **splitLines(const char *source, uint32_t *lineCount);
+
+/**
+* Removes the blanks inside the expressions of a line, #(N * 4) becomes
+* #(N*4), so that each expression is a single token. Only operands after #
+* or = and the operands of .word/.byte/.space/.align/.equ/.set/.rept are
+* changed.
+**/
+void compactExpressions(char *line);
+
+/**
+* Expands the .rept/.irp blocks of the lines, they are freed and replaced by
+* the lines returned, lineCount is updated. Each copy of a body has \+
+* replaced by its iteration, counted from 0, and .irp's \name by its value.
+* Labels defined in a body are renamed label.block.iteration, along with
+* the references to them in the body, so every copy has its own.
+* *sourceLines is set to a heap array with the line of the source every
+* returned line came from.
+**/
+char **expandRepeats(char **linesFromFile, uint32_t *lineCount,
+                     uint32_t **sourceLines, errorList *errors);
+
+/**
+* Appends lines[0 .. count) to output, expanding the blocks among them
+* numbers gives the source line of each of them
+**/
+void expandLines(char **lines, uint32_t *numbers, uint32_t count,
+                 expandedLines *output, errorList *errors);
+
+/* Appends line, which output takes, to the expanded lines */
+void appendLine(expandedLines *output, char *line, uint32_t number);
+
+/**
+* Returns the type of the directive of the line, after its labels, or
+* NO_USE if it has none
+**/
+uint32_t lineDirective(char *line);
+
+/**
+* Returns a heap copy of line with every occurrence of word replaced, a word
+* starting or ending with a letter, digit, _ or . only matches whole
+**/
+char *replaceWord(char *line, char *word, char *replacement);
+
+ /**
 * Maps all labels with their respective memory location
-* Finds the number of the instructions and returns it through instructionsNumber
-* Finds the number of ldr instructions and returns it through ldrCount
-* Finds the number of lines and returns it through lineNumber
+* Finds the number of words of the text section, literal pools included, and
+* returns it through instructionsNumber
+* Lays out the text and data sections and records .global/.extern symbols
+* in object
+* Places the literal pools and records where they went in pool
+* Maps the line number of every text instruction to its byte offset in
+* locations and to the bytes of the instructions it assembles to in sizes,
+* unless they are NULL
 * Throws any errors occour during the first pass such as multiple definitions
 * of the same label
 **/
-char **firstPass(FILE *input, map *labelMapping, vector *errorVector,
-        uint32_t *instructionsNumber, uint32_t *ldrCount, uint32_t *lineNumber);
+void firstPass(char **linesFromFile, uint32_t lineCount, map *labelMapping,
+        errorList *errors, uint32_t *instructionsNumber, literalPool *pool,
+        objectInfo *object, map *locations, map *sizes);
 
 /**
 * Fills the instrcutions array with all the decode instrcutions
+* Records a relocation in object for every reference the linker must patch
 * Throws any errors encountered during the pass
 **/
 void secondPass(uint32_t *instructionsNumber, uint32_t instructions[],
-              vector *errorVector, map labelMapping,
-              char** linesFromFile, uint32_t lineNumber);
+              errorList *errors, map labelMapping, literalPool *pool,
+              char** linesFromFile, uint32_t lineCount, objectInfo *object);
+
+// ---------------------LITERAL POOLS-------------------------
+/* Counts the ldr instructions loading every literal into pool->uses */
+void countLiterals(char **linesFromFile, uint32_t lineCount,
+                   literalPool *pool);
+
+/**
+* Returns the =expression operand if tokens hold ldr rd, =expression
+* Returns NULL for any other instruction
+**/
+char *getLiteralOperand(vector tokens);
+
+/* Returns the heap allocated pool key of a =expression operand */
+char *literalKey(char *operand);
+
+/**
+* Returns the number of bytes the instruction at the front of tokens takes,
+* ldr rd, =constant may be synthesised into two instructions
+* If key is not NULL it is set to the heap allocated pool key when the
+* instruction loads a literal, to NULL otherwise
+**/
+uint32_t instructionSize(vector tokens, literalPool *pool, char **key);
+
+/**
+* Picks the cheapest encoding of ldr rd, =value that avoids a literal:
+* a mov or mvn of a rotated immediate, or when the literal would not be
+* shared by several loads a mov/orr or mvn/bic pair, which takes the same
+* space as ldr and its literal but needs no memory access
+* Returns the number of instructions written to ins, 0 if a literal is needed
+**/
+uint32_t synthesiseConstant(uint32_t value, uint32_t uses, uint32_t rd,
+                            uint32_t ins[2]);
+
+/**
+* Encodes value as an 8-bit immediate rotated right by an even amount
+* Returns false if value can't be represented
+**/
+bool encodeImmediate(uint32_t value, uint32_t *operand);
+
+/* Returns the data processing instruction opcode rd, rn, #operand */
+uint32_t dataImmediate(char *opcode, uint32_t rd, uint32_t rn,
+                       uint32_t operand);
+
+/**
+* Adds the literal key loaded by the ldr on line ln to the pending pool,
+* location is the byte offset of a text section ldr, NO_USE otherwise
+**/
+void addLiteral(literalPool *pool, char *key, char *ln, uint32_t location);
+
+/**
+* Places the pending pool at *location and advances it, the size of the pool
+* is recorded under ln in placement unless it is NULL
+**/
+void placePool(literalPool *pool, uint32_t *location, map *placement,
+               char *ln);
+
+/* Returns true if execution never falls through the instruction in tokens */
+bool isBarrier(vector tokens);
+
+/* Frees everything held by pool */
+void clearLiteralPool(literalPool *pool);
+
+/* Maps every pending label to location, data labels are also kept in dataLabels */
+void mapLabels(vector *currentLabels, vector *dataLabels, map *labelMapping,
+               uint32_t location, int section);
+
+/* Rounds location up to a multiple of alignment */
+void alignLocation(uint32_t *location, uint32_t alignment);
+
+/* Returns the alignment in bytes the data of a directive starts at */
+uint32_t dataAlignment(uint32_t type);
+
+/**
+* Places the data of a .word/.byte/.ascii/.asciz/.space/.align directive at
+* the byte offset *location and advances it. words is NULL during the first
+* pass, where only the size of the data is needed. line is the source line,
+* strings are read from it as they may contain delimiters.
+**/
+void decodeData(vector *tokens, char *line, uint32_t *location,
+                uint32_t words[], map labelMapping, objectInfo *object,
+                errorList *errors, char *ln);
+
+/* Stores byte at the byte offset *location of words and advances it */
+void emitByte(uint32_t words[], uint32_t *location, uint8_t byte);
+
+/**
+* Gets the value of a data operand, an expression optionally prefixed by #
+* Returns false and throws an error if the operand is invalid
+**/
+bool getDataValue(char *token, expressionValue *value, errorList *errors,
+                  char *ln);
+
+/**
+* Checks that every .global label is defined and that no .extern symbol is
+* also defined locally
+**/
+void checkSymbols(map labelMapping, objectInfo *object, errorList *errors);
+
+/* Appends a relocation of the given type for the word at offset */
+void addRelocation(objectInfo *object, uint32_t offset, uint32_t type,
+                char *symbol);
+
+/* Frees everything held by object */
+void clearObject(objectInfo *object);
+// ------------------------PEEPHOLE-------------------------------
+/**
+ * A source line split up for the peephole pass, only lines of kind
+ * PEEPHOLE_CODE hold an instruction in the text section. Lines of kind
+ * PEEPHOLE_OTHER emit data or change the section, nothing is moved past them.
+ */
+struct peepholeLine {
+  vector   labels; // labels defined on the line
+  vector   tokens; // instruction and operands without the comment
+  lineKind kind;
+};
+
+/**
+* Rewrites the lines of source in place, removing or folding instructions
+* that have no effect or can be done with fewer instructions:
+*   mov rX, rX
+*   branches to the next instruction
+*   cmp rX, #0 after an s suffixed instruction that wrote rX, when only eq
+*   and ne read the flags before they are set again
+*   mov rX, #a followed by orr rX, rX, #b ... becomes ldr rX, =(a|b...)
+*   a conditional branch forward over one to IF_CONVERT_LIMIT instructions
+*   becomes those instructions executed on the inverse condition
+* Labels are resolved to the instructions they name first, a removed
+* instruction leaves its labels to the instruction after it. Every change
+* is reported on report unless it is NULL.
+**/
+void peephole(char **linesFromFile, uint32_t lineCount, FILE *report);
+
+/* Splits every line into lines and returns the line each label is on */
+map parsePeepholeLines(char **linesFromFile, uint32_t lineCount,
+                       peepholeLine *lines);
+
+/* Frees the vectors of lines */
+void clearPeepholeLines(peepholeLine *lines, uint32_t lineCount);
+
+/* Applies the first rule matching line i, returns the number of changes */
+uint32_t peepholeLineAt(peepholeLine *lines, uint32_t lineCount, map labels,
+                        char **linesFromFile, uint32_t i, FILE *report);
+
+/**
+* Rewrites blt skip; mov r2, r5; skip: as movge r2, r5 so the taken branch
+* no longer flushes the pipeline. The skipped instructions must not be
+* labelled, conditional, set the flags or write r15.
+* Returns the number of changes
+**/
+uint32_t ifConvert(peepholeLine *lines, uint32_t lineCount, map labels,
+                   char **linesFromFile, uint32_t i, FILE *report);
+
+/* Returns the condition that holds exactly when cond does not, NULL if none */
+char *invertCondition(char *cond);
+
+/* Inserts cond after the mnemonic of the unlabelled line */
+char *addCondition(char *line, char *cond);
+
+/* Returns true if any line from from to to, inclusive, defines a label */
+bool isLabelled(peepholeLine *lines, uint32_t from, uint32_t to);
+
+/**
+* Returns the index of the first instruction at or after line from, or
+* NOT_CODE/END_OF_CODE if data, a directive or the end comes first
+**/
+int findInstruction(peepholeLine *lines, uint32_t lineCount, uint32_t from);
+
+/**
+* Returns true if the carry or overflow flag may be read before the flags
+* are set again, following at most depth branches from line from
+**/
+bool flagsLive(peepholeLine *lines, uint32_t lineCount, map labels,
+               uint32_t from, int depth);
+
+/* Returns true if the instruction in tokens sets the flags */
+bool setsFlags(vector tokens);
+
+/* Gets the value of a #expression, returns false for any other token */
+bool getImmediateValue(char *token, uint32_t *value);
+
+/* Returns the token at index without removing it, NULL past the end */
+char *tokenAt(vector tokens, int index);
+
+/* Returns the labels as the heap allocated text "label: label: " */
+char *joinLabels(vector labels);
+
+/* Removes the instruction of line i, keeping its labels */
+void removeInstruction(peepholeLine *lines, char **linesFromFile, uint32_t i);
+
+/* Prints "[line] change text" to report unless it is NULL */
+void reportPeephole(FILE *report, uint32_t i, char *change, char *line);
+
+// ------------------------BLOCK LAYOUT---------------------------
+/**
+ * A basic block of a function, lines first to last of the source, inclusive.
+ * Only its last instruction may be a branch or a return.
+ */
+struct layoutBlock {
+  uint32_t first;
+  uint32_t last;
+  int      branch; // line of the branch or return ending it, -1 if none
+  bool     falls;  // control may fall through into the next block
+  uint32_t count;  // times the block was entered
+  uint32_t taken;  // times its branch was taken
+  int      action; // LAYOUT_ fix up of the end of the block
+  char     *name;  // label generated for the block, NULL if not needed
+  bool     placed;
+};
+
+/**
+ * What the layout of every function needs to know about the source and its
+ * profile, addresses are kept as decimal strings like line numbers are
+ */
+struct blockLayout {
+  peepholeLine *lines;
+  char         **linesFromFile;
+  map          labels;    // label -> line
+  map          callees;   // labels branched to with bl
+  map          locations; // line number -> byte offset of its instruction
+  map          counts;    // byte address -> times the word was executed
+  map          taken;     // byte address of a branch -> times taken
+  uint32_t     base;
+  FILE         *report;
+};
+
+/**
+* Reads the profile written by the pr command of emu into counts and taken,
+* see blockLayout. Returns false if the profile can't be read
+**/
+bool readProfile(const char *filename, map *counts, map *taken);
+
+/**
+* Reorders the blocks of every function so that the hottest successor of a
+* block follows it and never executed blocks move to the end, inverting or
+* adding branches where needed. Functions start after a directive or data
+* and at every bl target, their first block stays first. The profile must
+* come from the image of the same source assembled at base.
+* Returns the new lines and updates lineCount, every reordered function is
+* reported on report unless it is NULL
+**/
+char **layoutBlocks(char **linesFromFile, uint32_t *lineCount, uint32_t base,
+                    map counts, map taken, FILE *report);
+
+/**
+* Maps the line number of every text instruction to its byte offset
+* Returns false if the source has errors
+**/
+bool locateLines(char **linesFromFile, uint32_t lineCount, map *locations);
+
+/**
+* Lays out the function of lines from to to, inclusive, and appends its lines
+* to output
+**/
+void layoutFunction(blockLayout *layout, uint32_t from, uint32_t to,
+                    vector *output);
+
+/**
+* Splits the lines from to to into blocks, blocks needs room for one block per
+* line. Returns the number of blocks
+**/
+uint32_t findBlocks(blockLayout *layout, uint32_t from, uint32_t to,
+                    layoutBlock blocks[]);
+
+/**
+* Picks the order of the blocks, greedily following the hottest edge out of
+* the last block placed
+**/
+void orderBlocks(blockLayout *layout, layoutBlock blocks[], uint32_t count,
+                 uint32_t order[]);
+
+/* Returns the index of the block the branch of block goes to, -1 if none */
+int branchTarget(blockLayout *layout, layoutBlock blocks[], uint32_t count,
+                 layoutBlock *block);
+
+/* Returns the profile value of the instruction on line in values */
+uint32_t profileAt(blockLayout *layout, map values, uint32_t line);
+
+/* Returns true if the line defines a label some bl branches to */
+bool isCallee(blockLayout *layout, uint32_t line);
+
+/* Returns the label of the block, generating one if it has none */
+char *blockName(blockLayout *layout, layoutBlock *block);
+
+// ----------------------COST LISTING----------------------------
+/**
+* Sets the classes named by the cost table filename in COSTS, one
+* "class cycles" line each, # starts a comment. Returns false if the table
+* can't be read or names a class that does not exist
+**/
+bool readCosts(const char *filename);
+
+/* Returns the estimated cycles of the instruction word by the costs table */
+uint32_t instructionCost(map costs, uint32_t word);
+
+/**
+* Writes every assembled line with the address, encoding and cycles of its
+* instruction, a line assembled to several instructions has a row for each,
+* the total of every labelled block and the cycles of one iteration of every
+* loop closed by a backward branch. Branches are costed as taken.
+* sourceLines maps the lines back to the source, the lines are numbered as
+* they are if it is NULL. sizes gives the bytes of the instructions of the
+* lines in locations.
+**/
+void writeListing(FILE *output, char **linesFromFile, uint32_t lineCount,
+                  uint32_t *sourceLines, map locations, map sizes,
+                  asmResult *result);
+
+/* Returns the estimated cycles of the size bytes of instructions at location */
+uint32_t instructionsCost(asmResult *result, uint32_t location, uint32_t size);
+
+/* Writes the total of the block named label unless it has no instructions */
+void listBlock(FILE *output, char *label, uint32_t instructions,
+               uint32_t cycles);
+
+/**
+* Returns the label the line starts with in name, "" if it does not start
+* with one
+**/
+void lineLabel(char *line, char *name);
+
 // --------------------DECODING FUNCTIONS-------------------------
 /* Main decode function which returns the decoded instruction */
-uint32_t decode(vector *tokens, vector *addresses, uint32_t instructionNumber,
-  uint32_t instructionsNumber, map labelMapping, vector *errorVector, char *ln);
+uint32_t decode(vector *tokens, uint32_t words[], uint32_t instructionNumber,
+  literalPool *pool, map labelMapping, errorList *errors, char *ln,
+  objectInfo *object);
+
+/**
+ * Processes the directive at the front of tokens and consumes its operands
+ * Switches *section on .text/.data, and when firstPass is set records the
+ * .global/.extern names in object
+ */
+void decodeDirective(vector *tokens, int *section, bool firstPass,
+                objectInfo *object, errorList *errors, char *ln);
+
+/**
+* Defines the constant of the .equ/.set directive at the front of tokens and
+* consumes the directive, errors are only thrown when errors is not NULL
+**/
+void decodeEquate(vector *tokens, errorList *errors, char *ln);
 
 /* Decodes any Data Processing Instruction */
-uint32_t decodeDataProcessing(vector *tokens, vector *errorVector, char *ln);
+uint32_t decodeDataProcessing(vector *tokens, errorList *errors, char *ln);
+
+/* Decodes any Multiply Instruction, the long umull/smull/umlal/smlal too */
+uint32_t decodeMultiply(vector *tokens, errorList *errors, char *ln);
+
+/* Decodes sdiv/udiv rd, rn, rm */
+uint32_t decodeDivide(vector *tokens, errorList *errors, char *ln);
+
+/* Decodes swp/swpb rd, rm, [rn], ldrex rd, [rn] and strex rd, rm, [rn] */
+uint32_t decodeAtomic(vector *tokens, errorList *errors, char *ln);
+
+/**
+* Decodes any Single Data Transfer Instruction, the literal of ldr rd, =value
+* is written to its pool slot in words, as is the second instruction when the
+* value is synthesised by two
+**/
+uint32_t decodeSingleDataTransfer(vector *tokens, uint32_t words[],
+                uint32_t instructionNumber, literalPool *pool,
+                map labelMapping, errorList *errors, char *ln,
+                objectInfo *object);
+
+/**
+* Decodes ldm/stm in all their addressing modes, ldmia r0!, {r1, r4-r6}, and
+* push/pop {r4, r14}
+**/
+uint32_t decodeBlockDataTransfer(vector *tokens, errorList *errors, char *ln);
 
-/* Decodes any Multiply Instruction */
-uint32_t decodeMultiply(vector *tokens, vector *errorVector, char *ln);
+/**
+* Consumes the register list {r1, r4-r6} at the front of tokens and returns
+* its registers as a bit mask, 0 if it has errors
+**/
+uint32_t decodeRegisterList(vector *tokens, char *instruction,
+                            errorList *errors, char *ln);
+
+/**
+* Adds the registers named by one element of a register list, such as {r4,
+* r6-r8 or r14}, to list. Returns false if the element is not a register or
+* a range of registers
+**/
+bool addListRegisters(char *element, uint32_t *list);
 
-/* Decodes any Single Data Transfer Instruction */
-uint32_t decodeSingleDataTransfer(vector *tokens, vector *addresses,
-                uint32_t instructionNumber, uint32_t instructionsNumber,
-                vector *errorVector, char *ln);
+/* Returns true if tokens are a ldm or pop whose register list has r15 */
+bool loadsPc(vector tokens);
 
 /* Decodes any Branch Instruction */
 uint32_t decodeBranch(vector *tokens, uint32_t instructionNumber,
-                map labelMapping, vector *errorVector, char *ln);
+                map labelMapping, errorList *errors, char *ln,
+                objectInfo *object);
 
 /* Decodes any Shift Instruction */
-uint32_t decodeShift(vector *tokens, vector *errorVector, char *ln);
+uint32_t decodeShift(vector *tokens, errorList *errors, char *ln);
 
 /**
 * Creates a vector with all of the tokens of the original string
@@ -233,25 +945,71 @@ typeEnum getType(char *token);
 
 /* Helpers for type */
 bool isInstruction(char *token);
+
+/**
+* Splits a mnemonic such as addseq into the instruction (adds) and its
+* condition (eq, ALWAYS_CONDITION if there is none). name and cond need room
+* for MAX_LINE_LENGTH characters.
+* Returns false if token is not an instruction
+**/
+bool splitMnemonic(char *token, char *name, char *cond);
 bool isLabel(char *token);
 bool isRegister(char *token);
 bool isShift(char *token);
+bool isDirective(char *token);
 typeEnum isExpression(char *token);
 
 /* Gets the shift type and applays the shift rules to the operand parameter */
-void getShift(vector *tokens, uint32_t *operand, vector *errorVector, char *ln);
+void getShift(vector *tokens, uint32_t *operand, errorList *errors, char *ln);
 
 /**
  * Gets expressions of the type [register], [register, register],
  * [register, register, shift] (everything that is related to memory access)
  */
 void getBracketExpr(vector *tokens, int *rn, int32_t *offset, int *i, int *u, int *p, int *w,
-                    vector *errorVector, char *ln);
+                    errorList *errors, char *ln);
 /**
  * Gets expression of type <#expression> or <=expression> and throws errors
  * if the value in the exp can't be represented
  */
-int32_t getExpression(char *exp, vector *errorVector, char *ln);
+int32_t getExpression(char *exp, errorList *errors, char *ln);
+
+/**
+* Gets the value of an expression of type <#expression> that must lie in
+* [min, max], such as a shift amount or an ldr/str offset, kind names it in
+* the error thrown otherwise. Returns 0 on errors.
+**/
+int32_t getBoundedExpression(char *exp, int32_t min, int32_t max, char *kind,
+                             errorList *errors, char *ln);
+
+// ---------------------EXPRESSIONS----------------------------
+/**
+* Evaluates an expression of numbers (decimal or 0x hex), .equ constants,
+* labels and .extern symbols with the operators ( ) unary - ~ +, * /, + -,
+* << >>, & and | from the highest to the lowest precedence.
+* Returns false and throws an error if it is invalid or names an undefined
+* symbol. Before the labels are placed they evaluate as labelled zeros.
+**/
+bool evaluateExpression(char *text, expressionValue *result,
+                        errorList *errors, char *ln);
+
+/* Parses the binary operators of level and every higher precedence */
+bool parseOperators(expressionParser *parser, int level,
+                    expressionValue *left);
+
+/* Parses a number, symbol, unary operator or parenthesised expression */
+bool parseOperand(expressionParser *parser, expressionValue *operand);
+
+/* Gives operand the value of the symbol name */
+void resolveSymbol(expressionParser *parser, char *name,
+                   expressionValue *operand);
+
+/**
+* Applies a binary operator to left and right, leaving the result in left
+* Returns false on a division by zero
+**/
+bool applyOperator(const char *operator, expressionValue *left,
+                   expressionValue *right);
 
 /* Gets hexadecimal value from string */
 int32_t getHex(char *exp);
@@ -268,105 +1026,58 @@ char *uintToString(uint32_t num);
 
 /* Checks format of registers and throws error if the format is invalid */
 bool checkReg(vector *tokens, char *instr,
-                vector *errorVector, char *ln);
+                errorList *errors, char *ln);
 
 /* Sets the cond field of the instruction */
 void setCond(uint32_t *x, char *cond);
 
 /* Frees the matrix of lines */
-void clearLinesFromFile(char **linesFromFile);
+void clearLinesFromFile(char **linesFromFile, uint32_t lineCount);
 
 // ----------------------ERRORS--------------------------------
 /**
-* All of the error functions append an error message to the errorVector
-* which will be printed at the end of the program if there are any errors
+* All of the error functions append an error record to errors which are
+* returned to the caller of assembleSource
 **/
-void throwUndefinedError(char *name, vector *errorVector, char *ln);
-void throwLabelError(char *name, vector *errorVector, char *ln);
-void throwExpressionError(char *expression, vector *errorVector, char *ln);
-void throwRegisterError(char *name, vector *errorVector, char *ln);
-void throwExpressionMissingError(char *ins, vector *errorVector, char *ln);
+void addError(errorList *errors, errorEnum kind, char *ln, char *message);
+void throwUndefinedError(char *name, errorList *errors, char *ln);
+void throwLabelError(char *name, errorList *errors, char *ln);
+void throwExpressionError(char *expression, errorList *errors, char *ln);
+void throwRegisterError(char *name, errorList *errors, char *ln);
+void throwExpressionMissingError(char *ins, errorList *errors, char *ln);
+void throwSymbolError(char *name, char *reason, errorList *errors, char *ln);
+void throwRangeError(char *literal, errorList *errors, char *ln);
+void throwOutOfRangeError(char *kind, char *expression, errorList *errors,
+                          char *ln);
+void throwRepeatError(char *directive, char *reason, errorList *errors,
+                      char *ln);
+void throwProfileError(char *filename, errorList *errors);
+void throwCostError(char *filename, errorList *errors);
 
 // -----------------------DEBUGGING---------------------------
 void printStringArray(int n, char arr[][MAX_LINE_LENGTH]);
 void printBinary(uint32_t nr);
 
-/* Global variable */
-int countDynamicExpansions = 1;
-
-/*
-  $ asm code.s                 // creates code.o and code.txt
-  $ asm -o a.o code.s          // creates a.o and code.txt
-  $ asm -t b.txt code.s        // creates code.o and b.txt
-  $ asm -o a.o -t b.txt code.s // creates a.o and b.txt
-  NOTE: The following creates a obj file named -t
-  $ asm -o -t code.s // creates -t and code.txt
- */
-static struct option long_options[] = {
-  {"obj",    no_argument,       0,  'o' },
-  {"txt",    required_argument, 0,  't' },
-  {0,        0,                 0,   0  }
-};
-
 static int DEBUG = 0;
 
-int main(int argc, char **argv) {
-  char *objfilenameptr = NULL, *txtfilenameptr = NULL;
-  char objfilename[128], txtfilename[128];
-  int opt, long_index;
-  
-  while ((opt = getopt_long(argc, argv, "o:t:", long_options, &long_index )) != -1) {
-    switch (opt) {
-      case 'o': 
-        objfilenameptr = optarg;
-        break;
-      case 't': 
-        txtfilenameptr = optarg; 
-        break;
-      default: 
-        printf("Invalid invocation.\n");
-        exit(EXIT_FAILURE);
-    }
-  }
-  argc -= optind;
-  argv += optind;
-  if(!argv[0]) {
-    fprintf(stderr, "%s optind: %d argc: %d\n", "Wrong number of arguments", optind, argc);
-    return EXIT_FAILURE;
-  }
-
-  char *srcfilename = argv[0];
-  char *ext = strrchr(srcfilename, '.');
-  if (ext == NULL || strlen(ext) != 2 || (ext != NULL && (ext[0] != '.' || ext[1] != 's'))) {
-    fprintf(stderr, "Assembly file must have .s extension!\n");
-    exit(EXIT_FAILURE);
-  }
-  int dotpos = ext - srcfilename;
-  for (int i = 0; i < dotpos; i++) {
-    objfilename[i] = argv[0][i];
-    txtfilename[i] = argv[0][i];
-  }
-  objfilename[dotpos] = '\0';
-  txtfilename[dotpos] = '\0';
-  strcat(objfilename, ".o");
-  strcat(txtfilename, ".txt");
-  if (objfilenameptr == NULL)
-    objfilenameptr = objfilename;
-  if (txtfilenameptr == NULL)
-    txtfilenameptr = txtfilename;
-
-  printf(".s: %s, .o: %s, .txt: %s\n", argv[0], objfilenameptr, txtfilenameptr);
-
-  FILE *input = fopen(argv[0], "r");
-  // check file existance throw error if not found
-  if (!input) {
-    fprintf(stderr, "The file %s was not found\n", argv[1]);
-    exit(EXIT_FAILURE);
-  }
+bool assembleSource(const char *source, uint32_t base, map *predefined,
+                    const asmOptions *options, asmResult *result) {
+  objectInfo object = {constructMap(), constructMap(), NULL, 0, 0, 0, 0, 0,
+                       base};
+  errorList errors = {NULL, 0, 0};
+  result->words   = NULL;
+  result->lines   = NULL;
+  result->size    = 0;
+  result->base    = base;
+  result->symbols = constructMap();
+  result->errors  = errors;
+  result->object  = object;
 
-  vector errorVector = constructVector();
   uint32_t instructionsNumber;
+  uint32_t lineCount;
   map labelMapping = constructMap();
+  map locations = constructMap();
+  map sizes = constructMap();
   /**
   * fill the mappings
   * And after:
@@ -374,92 +1085,540 @@ int main(int argc, char **argv) {
   * memmory addresses (fills labelMapping)
   **/
   fillAll();
-  uint32_t ldrCount = 0;
-  uint32_t lineNumber = 1;
-  char **linesFromFile;
-  linesFromFile = firstPass(input, &labelMapping, &errorVector,
-                  &instructionsNumber, &ldrCount, &lineNumber);
-  // Have checked not NULL condition in firstPass function
+  literalPool pool = {constructMap(), constructMap(), constructMap(), NO_USE,
+                      constructMap(), constructMap(), constructMap()};
+  char **linesFromFile = splitLines(source, &lineCount);
+  for (uint32_t i = 0; i < lineCount; i++) {
+    compactExpressions(linesFromFile[i]);
+  }
+  // labels are only known to expressions once the first pass placed them
+  SYMBOLS.labels = NULL;
+  SYMBOLS.object = &result->object;
+  uint32_t *sourceLines;
+  linesFromFile = expandRepeats(linesFromFile, &lineCount, &sourceLines,
+                                &result->errors);
+  uint32_t expansionErrors = result->errors.size;
+  if (options && options->costs && !readCosts(options->costs)) {
+    throwCostError((char *) options->costs, &result->errors);
+  }
+  if (options && options->optimise) {
+    peephole(linesFromFile, lineCount, options->report);
+  }
+  if (options && options->profile) {
+    map counts = constructMap();
+    map taken = constructMap();
+    if (readProfile(options->profile, &counts, &taken)) {
+      linesFromFile = layoutBlocks(linesFromFile, &lineCount, base, counts,
+                                   taken, options->report);
+      // errors then refer to the laid out lines
+      free(sourceLines);
+      sourceLines = NULL;
+    } else {
+      throwProfileError((char *) options->profile, &result->errors);
+    }
+    clearMap(&counts);
+    clearMap(&taken);
+  }
+  firstPass(linesFromFile, lineCount, &labelMapping, &result->errors,
+            &instructionsNumber, &pool, &result->object, &locations, &sizes);
+  checkSymbols(labelMapping, &result->object, &result->errors);
+
+  // export the labels of the source before the predefined names are added
+  for (mapNode *node = labelMapping.head; node; node = node->next) {
+    put(&result->symbols, node->key, base + node->value);
+  }
+  if (predefined) {
+    for (mapNode *node = predefined->head; node; node = node->next) {
+      if (!get(labelMapping, node->key)) {
+        // byte offset relative to base, may wrap below zero
+        put(&labelMapping, node->key, node->value - base);
+      }
+    }
+  }
+
   /**
   * Make second pass now and replace all labels with their mapping
   * also decode all instructions and throw errors if any
   **/
-  uint32_t instructions[instructionsNumber + ldrCount];
-  rewind(input); // reset file pointer to the beginning of the file
-  secondPass(&instructionsNumber, instructions,
-             &errorVector, labelMapping, linesFromFile, lineNumber);
+  result->words = calloc(instructionsNumber + result->object.dataSize + 1,
+                         sizeof(uint32_t));
+  if (!result->words) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  SYMBOLS.labels = &labelMapping;
+  secondPass(&instructionsNumber, result->words, &result->errors,
+             labelMapping, &pool, linesFromFile, lineCount, &result->object);
+  result->size = instructionsNumber;
+
+  // the source line of every instruction, for debuggers
+  result->lines = calloc(result->size + 1, sizeof(uint32_t));
+  if (!result->lines) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  for (mapNode *node = locations.head; sourceLines && node;
+       node = node->next) {
+    uint32_t line = atoi(node->key);
+    if (node->value / MEMORY_SIZE < result->size && line <= lineCount) {
+      result->lines[node->value / MEMORY_SIZE] = sourceLines[line - 1];
+    }
+  }
+
+  if (options && options->listing && !result->errors.size) {
+    writeListing(options->listing, linesFromFile, lineCount, sourceLines,
+                 locations, sizes, result);
+  }
+
+  // errors of the passes refer to the expanded lines
+  for (uint32_t i = expansionErrors; sourceLines && i < result->errors.size;
+       i++) {
+    asmError *error = &result->errors.errors[i];
+    if (error->line && error->line <= lineCount) {
+      error->line = sourceLines[error->line - 1];
+    }
+  }
 
   // clear
+  free(sourceLines);
+  SYMBOLS.labels = NULL;
+  SYMBOLS.object = NULL;
   freeAll();
+  clearLiteralPool(&pool);
   clearMap(&labelMapping);
-  fclose(input);
-
-  // if we have compile erros stop and print errors
-  if (!isEmptyVector(errorVector)) {
-    while (!isEmptyVector(errorVector)) {
-      char *error = getFront(&errorVector);
-      fprintf(stderr, "%s\n", error);
-      free(error);
-    }
+  clearMap(&locations);
+  clearMap(&sizes);
+  clearLinesFromFile(linesFromFile, lineCount);
 
-    clearVector(&errorVector);
-    exit(EXIT_FAILURE);
-  }
+  return !result->errors.size;
+}
 
-  FILE *output = fopen(objfilenameptr, "wb");
-  fwrite(instructions, sizeof(uint32_t), instructionsNumber, output);
-  fclose(output);
-  FILE *hex = fopen(txtfilenameptr, "w");
-  for (int i = 0; i < instructionsNumber; i++)
-    fprintf(hex, "0x%08x\n", instructions[i]);
-  fclose(hex);
-  clearVector(&errorVector);
-  clearLinesFromFile(linesFromFile);
-  exit(EXIT_SUCCESS);
+void clearAsmResult(asmResult *result) {
+  free(result->words);
+  result->words = NULL;
+  free(result->lines);
+  result->lines = NULL;
+  result->size = 0;
+  clearMap(&result->symbols);
+  free(result->errors.errors);
+  result->errors.errors = NULL;
+  result->errors.size = 0;
+  result->errors.capacity = 0;
+  clearObject(&result->object);
 }
 
-char **firstPass(FILE *input, map *labelMapping, vector *errorVector,
-      uint32_t *instructionsNumber, uint32_t *ldrCount, uint32_t *lineNumber) {
-  uint32_t currentMemoryLocation = 0;
-  *ldrCount = 0;
-  vector currentLabels = constructVector();
-  char buffer[MAX_LINE_LENGTH];
-  /*Allocate memory for the array of lines*/
-  char **linesFromFile = (char **) malloc(NUMBER_OF_LINES * sizeof(char *));
-  for(int i = 0; i < NUMBER_OF_LINES; i++) {
-    linesFromFile[i] = (char *) malloc((MAX_LINE_LENGTH + 1) * sizeof(char));
-    if(!linesFromFile) {
+void printAsmErrors(FILE *stream, asmResult *result) {
+  for (uint32_t i = 0; i < result->errors.size; i++) {
+    asmError *error = &result->errors.errors[i];
+    fprintf(stream, "[%u] %s\n", error->line, error->message);
+  }
+}
+
+char *readSourceFile(const char *filename) {
+  FILE *input = fopen(filename, "r");
+  if (!input) {
+    return NULL;
+  }
+
+  fseek(input, 0, SEEK_END);
+  long length = ftell(input);
+  rewind(input);
+  char *source = malloc(length + 1);
+  if (!source) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  length = fread(source, sizeof(char), length, input);
+  source[length] = '\0';
+  fclose(input);
+  return source;
+}
+
+char **splitLines(const char *source, uint32_t *lineCount) {
+  uint32_t capacity = NUMBER_OF_LINES;
+  char **linesFromFile = (char **) malloc(capacity * sizeof(char *));
+  if (!linesFromFile) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  *lineCount = 0;
+  while (*source) {
+    size_t length = strcspn(source, "\n");
+    if (*lineCount == capacity) {
+      /*Perform dynamic expansion of lines array*/
+      capacity *= 2;
+      char **reallocatedArray =
+      realloc(linesFromFile, capacity * sizeof(char *));
+      if (reallocatedArray) {
+        linesFromFile = reallocatedArray;
+      } else {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+    char *line = malloc(length + 1);
+    if (!line) {
       perror("malloc");
       exit(EXIT_FAILURE);
     }
+    strncpy(line, source, length);
+    line[length] = '\0';
+    linesFromFile[(*lineCount)++] = line;
+    source += length;
+    if (*source == '\n') {
+      source++;
+    }
+  }
+
+  return linesFromFile;
+}
+
+void compactExpressions(char *line) {
+  char *read = line;
+  char *write = line;
+
+  // labels and the mnemonic or directive are kept as they are
+  char *first = NULL;
+  while (*read) {
+    while (isspace(*read)) {
+      *write++ = *read++;
+    }
+    char *word = write;
+    while (*read && !isspace(*read)) {
+      *write++ = *read++;
+    }
+    if (write == word || write[-1] != ':') {
+      first = word;
+      break;
+    }
+  }
+
+  uint32_t *type = NULL;
+  if (first && first[0] == '.') {
+    char directive = *write;
+    *write = '\0';
+    type = get(DIRECTIVES, first);
+    *write = directive;
+  }
+  // every operand of these directives is an expression
+  bool data = type && (*type == WORD_DIRECTIVE || *type == BYTE_DIRECTIVE ||
+                       *type == SPACE_DIRECTIVE || *type == ALIGN_DIRECTIVE ||
+                       *type == EQU_DIRECTIVE || *type == SET_DIRECTIVE ||
+                       *type == REPT_DIRECTIVE);
+  bool expression = false;
+  int depth = 0;
+  while (*read) {
+    char c = *read;
+    if (c == '"') {
+      // strings are kept as they are, blanks and all
+      do {
+        if (*read == '\\' && read[1])
+          *write++ = *read++;
+        *write++ = *read++;
+      } while (*read && *read != '"');
+      if (*read)
+        *write++ = *read++;
+      continue;
+    }
+    if (c == '@' || (c == '/' && read[1] == '/')) {
+      // the comment is kept as it is
+      memmove(write, read, strlen(read) + 1);
+      return;
+    }
+    if (!expression && (c == '#' || c == '=' ||
+                        (data && !isspace(c) && c != ','))) {
+      expression = true;
+      depth = 0;
+    }
+    if (expression) {
+      if (c == '(') {
+        depth++;
+      } else if (c == ')') {
+        depth--;
+      } else if (depth <= 0 && (c == ',' || c == ']')) {
+        expression = false;
+      } else if (isspace(c)) {
+        // blanks in front of a comment still end the expression
+        char *next = read + strspn(read, " \t");
+        if (*next && *next != '@' && !(next[0] == '/' && next[1] == '/')) {
+          read = next;
+          continue;
+        }
+      }
+    }
+    *write++ = *read++;
   }
-  if(!linesFromFile) {
+  *write = '\0';
+}
+
+char **expandRepeats(char **linesFromFile, uint32_t *lineCount,
+                     uint32_t **sourceLines, errorList *errors) {
+  expandedLines output = {NULL, NULL, 0, 0, 0};
+  uint32_t *numbers = malloc((*lineCount ? *lineCount : 1) * sizeof(uint32_t));
+  if (!numbers) {
     perror("malloc");
     exit(EXIT_FAILURE);
   }
-  /*End memory allocation for array of lines*/
-  *instructionsNumber = 0;
+  for (uint32_t i = 0; i < *lineCount; i++) {
+    numbers[i] = i + 1;
+  }
 
-  while(fgets(buffer, MAX_LINE_LENGTH, input)) {
-    /*Perform dynamic expansion of lines array*/
-    if((*lineNumber - 1) >= NUMBER_OF_LINES) {
-     countDynamicExpansions++;
-     //increment global variable countDynamicExpansions
-     char **reallocatedArray =
-     realloc(linesFromFile,
-             countDynamicExpansions * NUMBER_OF_LINES * sizeof(char *));
-             printf("%s\n", "I reallocated");
-     if(reallocatedArray) {
-        linesFromFile = reallocatedArray;
-     } else {
-       perror("realloc");
-       exit(EXIT_FAILURE);
-     }
-    }
-    /*End dynamic expansion*/
-    strcpy(linesFromFile[*lineNumber - 1], buffer);
-    vector tokens = tokenise(buffer, DELIMITERS);
-    char *lineNo = uintToString(*lineNumber);
+  // a count may use the constants defined before it
+  clearMap(&SYMBOLS.equates);
+  expandLines(linesFromFile, numbers, *lineCount, &output, errors);
+  clearLinesFromFile(linesFromFile, *lineCount);
+  free(numbers);
+
+  *lineCount = output.count;
+  *sourceLines = output.numbers;
+  return output.lines;
+}
+
+void expandLines(char **lines, uint32_t *numbers, uint32_t count,
+                 expandedLines *output, errorList *errors) {
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t type = lineDirective(lines[i]);
+    char *lineNo = uintToString(numbers[i]);
+    vector tokens = tokenise(lines[i], DELIMITERS);
+    char labels[MAX_LINE_LENGTH] = "";
+    while (getType(peekFront(tokens)) == LABEL) {
+      char *label = getFront(&tokens);
+      strncat(labels, label, MAX_LINE_LENGTH - strlen(labels) - 2);
+      strcat(labels, " ");
+      free(label);
+    }
+
+    if (type == ENDR_DIRECTIVE) {
+      throwRepeatError(".endr", "has no matching .rept or .irp", errors,
+                       lineNo);
+    } else if (type != REPT_DIRECTIVE && type != IRP_DIRECTIVE) {
+      if (type == EQU_DIRECTIVE || type == SET_DIRECTIVE) {
+        decodeEquate(&tokens, NULL, NULL);
+      }
+      appendLine(output, copy(lines[i]), numbers[i]);
+    } else {
+      // the body runs up to the .endr matching the directive
+      uint32_t first = i + 1;
+      uint32_t depth = 1;
+      for (i = first; i < count; i++) {
+        uint32_t inner = lineDirective(lines[i]);
+        if (inner == REPT_DIRECTIVE || inner == IRP_DIRECTIVE) {
+          depth++;
+        } else if (inner == ENDR_DIRECTIVE && !--depth) {
+          break;
+        }
+      }
+
+      char *directive = getFront(&tokens);
+      getComment(&tokens);
+      char *name = NULL;
+      uint32_t iterations = 0;
+      if (i == count) {
+        throwRepeatError(directive, "has no matching .endr", errors, lineNo);
+      } else if (type == REPT_DIRECTIVE) {
+        expressionValue value;
+        char *token = peekFront(tokens);
+        if (!token) {
+          throwExpressionMissingError(directive, errors, lineNo);
+        } else if (getDataValue(token, &value, errors, lineNo)) {
+          if (value.labelled) {
+            throwExpressionError(token, errors, lineNo);
+          } else if (value.value > MAX_REPEAT) {
+            throwOutOfRangeError("repeat count", token, errors, lineNo);
+          } else {
+            iterations = value.value;
+          }
+        }
+      } else {
+        name = getFront(&tokens);
+        if (!name) {
+          throwExpressionMissingError(directive, errors, lineNo);
+        }
+        // the values end at a comment
+        vector values = constructVector();
+        while (getComment(&tokens), !isEmptyVector(tokens)) {
+          char *value = getFront(&tokens);
+          putBack(&values, value);
+          free(value);
+        }
+        clearVector(&tokens);
+        tokens = values;
+        iterations = name ? tokens.size : 0;
+      }
+      if (labels[0]) {
+        // labels in front of the block name its first line
+        appendLine(output, copy(labels), numbers[first - 1]);
+      }
+
+      // the labels defined by the body itself, not by the blocks inside it
+      vector defined = constructVector();
+      depth = 0;
+      for (uint32_t j = first; j < i; j++) {
+        uint32_t inner = lineDirective(lines[j]);
+        if (inner == ENDR_DIRECTIVE) {
+          depth--;
+        }
+        vector bodyTokens = tokenise(lines[j], DELIMITERS);
+        while (!depth && getType(peekFront(bodyTokens)) == LABEL) {
+          char *label = getFront(&bodyTokens);
+          label[strlen(label) - 1] = '\0';
+          putBack(&defined, label);
+          free(label);
+        }
+        clearVector(&bodyTokens);
+        if (inner == REPT_DIRECTIVE || inner == IRP_DIRECTIVE) {
+          depth++;
+        }
+      }
+
+      uint32_t block = ++output->expansions;
+      uint32_t bodyCount = i - first;
+      char **body = malloc((bodyCount ? bodyCount : 1) * sizeof(char *));
+      if (!body) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+      }
+      for (uint32_t iteration = 0; iteration < iterations; iteration++) {
+        char *counter = uintToString(iteration);
+        char *value = type == IRP_DIRECTIVE ? getFront(&tokens) : NULL;
+        char parameter[MAX_LINE_LENGTH];
+        snprintf(parameter, MAX_LINE_LENGTH, "\\%s", name ? name : "");
+        depth = 0;
+        for (uint32_t j = 0; j < bodyCount; j++) {
+          char *line = copy(lines[first + j]);
+          uint32_t inner = lineDirective(line);
+          if (inner == ENDR_DIRECTIVE) {
+            depth--;
+          }
+          char *next;
+          if (!depth) {
+            // \+ of a nested block counts its own iterations
+            next = replaceWord(line, "\\+", counter);
+            free(line);
+            line = next;
+          }
+          if (value) {
+            next = replaceWord(line, parameter, value);
+            free(line);
+            line = next;
+          }
+          for (vectorNode *node = defined.first; node; node = node->next) {
+            char unique[MAX_LINE_LENGTH];
+            snprintf(unique, MAX_LINE_LENGTH, "%s.%u.%u", node->value, block,
+                     iteration);
+            next = replaceWord(line, node->value, unique);
+            free(line);
+            line = next;
+          }
+          if (inner == REPT_DIRECTIVE || inner == IRP_DIRECTIVE) {
+            depth++;
+          }
+          body[j] = line;
+        }
+        expandLines(body, numbers + first, bodyCount, output, errors);
+        for (uint32_t j = 0; j < bodyCount; j++) {
+          free(body[j]);
+        }
+        free(counter);
+        free(value);
+      }
+
+      free(body);
+      clearVector(&defined);
+      free(directive);
+      free(name);
+    }
+
+    clearVector(&tokens);
+    free(lineNo);
+  }
+}
+
+void appendLine(expandedLines *output, char *line, uint32_t number) {
+  if (output->count == output->capacity) {
+    output->capacity = output->capacity ? 2 * output->capacity
+                                        : NUMBER_OF_LINES;
+    output->lines = realloc(output->lines, output->capacity * sizeof(char *));
+    output->numbers = realloc(output->numbers,
+                              output->capacity * sizeof(uint32_t));
+    if (!output->lines || !output->numbers) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  output->lines[output->count] = line;
+  output->numbers[output->count++] = number;
+}
+
+uint32_t lineDirective(char *line) {
+  vector tokens = tokenise(line, DELIMITERS);
+  while (getType(peekFront(tokens)) == LABEL) {
+    free(getFront(&tokens));
+  }
+
+  uint32_t type = NO_USE;
+  if (getType(peekFront(tokens)) == DIRECTIVE) {
+    type = *get(DIRECTIVES, peekFront(tokens));
+  }
+  clearVector(&tokens);
+  return type;
+}
+
+char *replaceWord(char *line, char *word, char *replacement) {
+  size_t length = strlen(word);
+  bool wholeStart = isalnum(word[0]) || word[0] == '_' || word[0] == '.';
+  bool wholeEnd = isalnum(word[length - 1]) || word[length - 1] == '_' ||
+                  word[length - 1] == '.';
+  size_t matches = 0;
+  for (char *at = strstr(line, word); at; at = strstr(at + 1, word)) {
+    matches++;
+  }
+
+  char *result = malloc(strlen(line) + matches * strlen(replacement) + 1);
+  if (!result) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  char *write = result;
+  char *read = line;
+  while (*read) {
+    bool match = !strncmp(read, word, length);
+    char before = read == line ? ' ' : read[-1];
+    char after = match ? read[length] : ' ';
+    if (match &&
+        !(wholeStart && (isalnum(before) || before == '_' || before == '.')) &&
+        !(wholeEnd && (isalnum(after) || after == '_' || after == '.'))) {
+      strcpy(write, replacement);
+      write += strlen(replacement);
+      read += length;
+    } else {
+      *write++ = *read++;
+    }
+  }
+  *write = '\0';
+  return result;
+}
+
+void firstPass(char **linesFromFile, uint32_t lineCount, map *labelMapping,
+      errorList *errors, uint32_t *instructionsNumber, literalPool *pool,
+      objectInfo *object, map *locations, map *sizes) {
+  // byte offsets of the next free location in the text and data sections
+  uint32_t currentMemoryLocation = 0;
+  uint32_t dataMemoryLocation = 0;
+  int section = SECTION_TEXT;
+  vector currentLabels = constructVector();
+  vector dataLabels = constructVector();
+  *instructionsNumber = 0;
+  countLiterals(linesFromFile, lineCount, pool);
+  clearMap(&SYMBOLS.equates);
+
+  for (uint32_t lineNumber = 1; lineNumber <= lineCount; lineNumber++) {
+    vector tokens = tokenise(linesFromFile[lineNumber - 1], DELIMITERS);
+    char *lineNo = uintToString(lineNumber);
+    uint32_t *location = section == SECTION_DATA ? &dataMemoryLocation
+                                                 : &currentMemoryLocation;
     // check for all tokens see if there are labels
     // if there are labels add all of them to a vector list and
     // map all labels with the memorry address of the next instruction
@@ -472,62 +1631,158 @@ char **firstPass(FILE *input, map *labelMapping, vector *errorVector,
           // if this label already exists in the mapping this means
           // that we have multiple definitions of the same label
           // therefore throw an error message
-          throwLabelError(token, errorVector, lineNo);
+          throwLabelError(token, errors, lineNo);
         } else {
           putBack(&currentLabels, token);
         }
+        free(getFront(&tokens));
+        continue;
+      }
+
+      if (getType(token) == DIRECTIVE) {
+        // the directive consumes the rest of the line
+        uint32_t type = *get(DIRECTIVES, token);
+        if (type == LTORG_DIRECTIVE) {
+          // pools only go in the text section
+          if (section == SECTION_TEXT) {
+            placePool(pool, location, &pool->after, lineNo);
+          }
+          break;
+        }
+        if (type < FIRST_DATA_DIRECTIVE) {
+          decodeDirective(&tokens, &section, true, object, errors, lineNo);
+          break;
+        }
+        if (type == EQU_DIRECTIVE || type == SET_DIRECTIVE) {
+          // errors are reported once during the second pass
+          decodeEquate(&tokens, NULL, lineNo);
+          break;
+        }
+        // labels in front of data name its first byte
+        alignLocation(location, dataAlignment(type));
+        if (type != ALIGN_DIRECTIVE) {
+          mapLabels(&currentLabels, &dataLabels, labelMapping, *location,
+                    section);
+        }
+        decodeData(&tokens, linesFromFile[lineNumber - 1], location, NULL,
+                   *labelMapping, object, errors, lineNo);
+        break;
       }
 
       if (getType(token) == INSTRUCTION) {
-        // if the instruction is a ldr instruction and the <=expression>
-        // is more than 0xFF we need to store the value at the bottom of the
-        // binary file
-        // we will assume that the argument is more than 0xFF and if it is
-        // not then we will just not use the remaining space
-        if (!strcmp(token, "ldr")) {
-          (*ldrCount)++;
+        // ldr rd, =expression needs a literal unless the value can be
+        // synthesised, the literal is placed with the next pool
+        char *key;
+        uint32_t size = instructionSize(tokens, pool, &key);
+
+        alignLocation(location, MEMORY_SIZE);
+        if (section == SECTION_TEXT && pool->firstUse != NO_USE &&
+            *location + size + MEMORY_SIZE - pool->firstUse
+              - PC_OFFSET * MEMORY_SIZE > LITERAL_RANGE) {
+          // the oldest literal would be out of reach of its ldr if the pool
+          // waited for the next instruction, branch over it here instead
+          *location += MEMORY_SIZE;
+          placePool(pool, location, &pool->before, lineNo);
         }
 
         // if we found a valid instruction
         // map all current unmapped labels
         // to this current memmory location
         // and advance memory
-        while (!isEmptyVector(currentLabels)) {
-          // map all labels to current memorry location
-          char *label = getFront(&currentLabels);
-          put(labelMapping, label, currentMemoryLocation);
-          free(label);
+        mapLabels(&currentLabels, &dataLabels, labelMapping, *location,
+                  section);
+        if (locations && section == SECTION_TEXT) {
+          put(locations, lineNo, *location);
+        }
+        if (sizes && section == SECTION_TEXT) {
+          put(sizes, lineNo, size);
+        }
+        if (key) {
+          addLiteral(pool, key, lineNo,
+                     section == SECTION_TEXT ? *location : NO_USE);
+          free(key);
+        }
+        *location += size;
+
+        if (section == SECTION_TEXT && pool->firstUse != NO_USE &&
+            isBarrier(tokens) &&
+            *location - pool->firstUse > LITERAL_RANGE / 2) {
+          // nothing falls through into a pool placed after a branch, use it
+          // before the literals drift out of range
+          placePool(pool, location, &pool->after, lineNo);
         }
-        currentMemoryLocation++;
-        (*instructionsNumber)++;
+        // the remaining tokens are operands, shift names such as lsl
+        // must not be counted as further instructions
+        break;
       }
 
       getComment(&tokens);
 
       free(getFront(&tokens));
     }
+    clearVector(&tokens);
     free(lineNo);
-    (*lineNumber)++;
   }
 
   // map all remaining unmached labels to current memory location
-  while (!isEmptyVector(currentLabels)) {
+  mapLabels(&currentLabels, &dataLabels, labelMapping,
+            section == SECTION_DATA ? dataMemoryLocation
+                                    : currentMemoryLocation, section);
+
+  // the last pool ends the text section, the data section follows it
+  alignLocation(&currentMemoryLocation, MEMORY_SIZE);
+  placePool(pool, &currentMemoryLocation, NULL, NULL);
+  *instructionsNumber = currentMemoryLocation / MEMORY_SIZE;
+  object->dataSize = (dataMemoryLocation + MEMORY_SIZE - 1) / MEMORY_SIZE;
+  object->dataBase = *instructionsNumber;
+  while (!isEmptyVector(dataLabels)) {
+    char *label = getFront(&dataLabels);
+    put(labelMapping, label, *get(*labelMapping, label) +
+                             object->dataBase * MEMORY_SIZE);
+    free(label);
+  }
+}
+
+void mapLabels(vector *currentLabels, vector *dataLabels, map *labelMapping,
+               uint32_t location, int section) {
+  while (!isEmptyVector(*currentLabels)) {
     // map all labels to current memorry location
-    put(labelMapping, getFront(&currentLabels), currentMemoryLocation);
+    char *label = getFront(currentLabels);
+    put(labelMapping, label, location);
+    if (section == SECTION_DATA) {
+      putBack(dataLabels, label);
+    }
+    free(label);
   }
-  return linesFromFile;
+}
+
+void alignLocation(uint32_t *location, uint32_t alignment) {
+  *location = (*location + alignment - 1) / alignment * alignment;
 }
 
 void secondPass(uint32_t *instructionsNumber, uint32_t instructions[],
-              vector *errorVector, map labelMapping,
-              char **linesFromFile, uint32_t lineNumber) {
-  //char buffer[MAX_LINE_LENGTH];
+              errorList *errors, map labelMapping, literalPool *pool,
+              char **linesFromFile, uint32_t lineCount, objectInfo *object) {
+  // byte offsets of the next location in the text and data sections
   uint32_t PC = 0;
+  uint32_t dataPC = object->dataBase * MEMORY_SIZE;
+  int section = SECTION_TEXT;
   uint32_t ln = 1;
-  vector addresses = constructVector();
-  while(ln != lineNumber) {
+  clearMap(&SYMBOLS.equates);
+  while(ln <= lineCount) {
     vector tokens = tokenise(linesFromFile[ln - 1], DELIMITERS);
     char *lineNo = uintToString(ln);
+    uint32_t *location = section == SECTION_DATA ? &dataPC : &PC;
+    uint32_t *poolSize = get(pool->before, lineNo);
+    if (poolSize) {
+      // branch over the pool the first pass placed in front of this line
+      uint32_t branch = 0xA << 0x18;
+      setCond(&branch, ALWAYS_CONDITION);
+      alignLocation(location, MEMORY_SIZE);
+      instructions[*location / MEMORY_SIZE] =
+        branch | (*poolSize / MEMORY_SIZE - 1);
+      *location += MEMORY_SIZE + *poolSize;
+    }
     while (!isEmptyVector(tokens)) {
       char *token = peekFront(tokens);
       if (DEBUG) {
@@ -537,73 +1792,1684 @@ void secondPass(uint32_t *instructionsNumber, uint32_t instructions[],
       if (getType(token) == INSTRUCTION) {
         // if there is a valid isntruction decode it and increase
         // instruction counter
-        instructions[PC] = decode(&tokens, &addresses, PC, *instructionsNumber,
-                      labelMapping, errorVector, lineNo);
-        PC++;
+        uint32_t size = instructionSize(tokens, pool, NULL);
+        alignLocation(location, MEMORY_SIZE);
+        instructions[*location / MEMORY_SIZE] = decode(&tokens, instructions,
+                      *location / MEMORY_SIZE, pool,
+                      labelMapping, errors, lineNo, object);
+        *location += size;
       } else if (getType(token) == LABEL) {
         // we have a label so we just remove it
         free(getFront(&tokens));
+      } else if (getType(token) == DIRECTIVE) {
+        uint32_t type = *get(DIRECTIVES, token);
+        if (type == LTORG_DIRECTIVE) {
+          // the pool is skipped below
+          clearVector(&tokens);
+        } else if (type < FIRST_DATA_DIRECTIVE) {
+          decodeDirective(&tokens, &section, false, object, errors, lineNo);
+        } else if (type == EQU_DIRECTIVE || type == SET_DIRECTIVE) {
+          decodeEquate(&tokens, errors, lineNo);
+        } else {
+          alignLocation(location, dataAlignment(type));
+          decodeData(&tokens, linesFromFile[ln - 1], location, instructions,
+                     labelMapping, object, errors, lineNo);
+        }
       } else {
 	getComment(&tokens);
 	if (!isEmptyVector(tokens)) {
-          throwUndefinedError(token, errorVector, lineNo);
+          throwUndefinedError(token, errors, lineNo);
           // throw error because instruction is undefined
           free(getFront(&tokens));
         }
       }
     }
-    ln++;
-    free(lineNo);
+    poolSize = get(pool->after, lineNo);
+    if (poolSize) {
+      // the literals were written by the ldr instructions using them
+      alignLocation(&PC, MEMORY_SIZE);
+      PC += *poolSize;
+    }
+    ln++;
+    free(lineNo);
+  }
+
+  // the last pool was placed at the end of the text section, the data
+  // section follows it
+  object->textSize = *instructionsNumber;
+  *instructionsNumber += object->dataSize;
+}
+
+void countLiterals(char **linesFromFile, uint32_t lineCount,
+                   literalPool *pool) {
+  clearMap(&SYMBOLS.equates);
+  for (uint32_t ln = 1; ln <= lineCount; ln++) {
+    vector tokens = tokenise(linesFromFile[ln - 1], DELIMITERS);
+    while (getType(peekFront(tokens)) == LABEL) {
+      free(getFront(&tokens));
+    }
+
+    uint32_t *type = getType(peekFront(tokens)) == DIRECTIVE
+                     ? get(DIRECTIVES, peekFront(tokens)) : NULL;
+    if (type && (*type == EQU_DIRECTIVE || *type == SET_DIRECTIVE)) {
+      // the literals keyed by value need the constants defined so far
+      decodeEquate(&tokens, NULL, NULL);
+    }
+
+    char *operand = getLiteralOperand(tokens);
+    if (operand) {
+      char *key = literalKey(operand);
+      uint32_t *uses = get(pool->uses, key);
+      put(&pool->uses, key, uses ? *uses + 1 : 1);
+      free(key);
+    }
+    clearVector(&tokens);
+  }
+}
+
+char *getLiteralOperand(vector tokens) {
+  char name[MAX_LINE_LENGTH], cond[MAX_LINE_LENGTH];
+  if (!tokens.first || !splitMnemonic(tokens.first->value, name, cond) ||
+      strcmp(name, "ldr") || !tokens.first->next ||
+      !tokens.first->next->next) {
+    return NULL;
+  }
+
+  char *operand = tokens.first->next->next->value;
+  return operand[0] == '=' && operand[1] ? operand : NULL;
+}
+
+char *literalKey(char *operand) {
+  expressionValue result;
+  if (!evaluateExpression(operand + 1, &result, NULL, NULL) ||
+      result.labelled) {
+    // an address, known once the labels are placed
+    return copy(operand);
+  }
+
+  // numbers written differently share a literal
+  char *value = uintToString(result.value);
+  char *key = malloc(strlen(value) + 2);
+  strcpy(key, "=");
+  strcat(key, value);
+  free(value);
+  return key;
+}
+
+uint32_t instructionSize(vector tokens, literalPool *pool, char **key) {
+  char *operand = getLiteralOperand(tokens);
+  uint32_t count = 0;
+  if (key) {
+    *key = NULL;
+  }
+  if (!operand) {
+    return MEMORY_SIZE;
+  }
+
+  char *literal = literalKey(operand);
+  expressionValue result;
+  // both passes must agree, so addresses are always loaded from the pool
+  if (evaluateExpression(operand + 1, &result, NULL, NULL) &&
+      !result.labelled) {
+    uint32_t ins[2];
+    uint32_t *uses = get(pool->uses, literal);
+    count = synthesiseConstant(result.value, uses ? *uses : 1, 0, ins);
+  }
+
+  if (!count && key) {
+    *key = literal;
+  } else {
+    free(literal);
+  }
+  return (count ? count : 1) * MEMORY_SIZE;
+}
+
+uint32_t synthesiseConstant(uint32_t value, uint32_t uses, uint32_t rd,
+                            uint32_t ins[2]) {
+  uint32_t first, second;
+  if (encodeImmediate(value, &first)) {
+    ins[0] = dataImmediate("mov", rd, 0, first);
+    return 1;
+  }
+  if (encodeImmediate(~value, &first)) {
+    ins[0] = dataImmediate("mvn", rd, 0, first);
+    return 1;
+  }
+  if (uses > 1) {
+    // ldr instructions sharing one literal are smaller than the pairs
+    return 0;
+  }
+
+  for (uint32_t rotation = 0; rotation < INSTRUCTION_SIZE; rotation += 2) {
+    // split the value into the byte at rotation and the remaining bits
+    uint32_t mask = rotation ? 0xFFu >> rotation |
+                               0xFFu << (INSTRUCTION_SIZE - rotation) : 0xFF;
+    if ((value & mask) && encodeImmediate(value & mask, &first) &&
+        encodeImmediate(value & ~mask, &second)) {
+      ins[0] = dataImmediate("mov", rd, 0, first);
+      ins[1] = dataImmediate("orr", rd, rd, second);
+      return 2;
+    }
+    if ((~value & mask) && encodeImmediate(~value & mask, &first) &&
+        encodeImmediate(~value & ~mask, &second)) {
+      ins[0] = dataImmediate("mvn", rd, 0, first);
+      ins[1] = dataImmediate("bic", rd, rd, second);
+      return 2;
+    }
+  }
+
+  return 0;
+}
+
+bool encodeImmediate(uint32_t value, uint32_t *operand) {
+  uint32_t rotations = 0;
+  // same search as getExpression, rotating left undoes the rotate right
+  while (value >= 0x100 && rotations <= 30) {
+    value = value << 2 | value >> (INSTRUCTION_SIZE - 2);
+    rotations += 2;
+  }
+
+  if (value >= 0x100) {
+    return false;
+  }
+
+  *operand = value | (rotations / 2) << 0x8;
+  return true;
+}
+
+uint32_t dataImmediate(char *opcode, uint32_t rd, uint32_t rn,
+                       uint32_t operand) {
+  uint32_t ins = 1 << 0x19;
+  setCond(&ins, ALWAYS_CONDITION);
+  ins |= *get(DATA_OPCODE, opcode) << 0x15;
+  ins |= rn << 0x10;
+  ins |= rd << 0xC;
+  return ins | operand;
+}
+
+void addLiteral(literalPool *pool, char *key, char *ln, uint32_t location) {
+  uint32_t *index = get(pool->keys, key);
+  if (!index) {
+    put(&pool->keys, key, pool->keys.size);
+    index = get(pool->keys, key);
+  }
+  put(&pool->lines, ln, *index);
+  if (location != NO_USE && pool->firstUse == NO_USE) {
+    pool->firstUse = location;
+  }
+}
+
+void placePool(literalPool *pool, uint32_t *location, map *placement,
+               char *ln) {
+  if (isEmptyMap(pool->keys)) {
+    return;
+  }
+
+  alignLocation(location, MEMORY_SIZE);
+  for (mapNode *node = pool->lines.head; node; node = node->next) {
+    put(&pool->slots, node->key, *location + node->value * MEMORY_SIZE);
+  }
+  uint32_t size = pool->keys.size * MEMORY_SIZE;
+  if (placement) {
+    put(placement, ln, size);
+  }
+  *location += size;
+
+  clearMap(&pool->keys);
+  clearMap(&pool->lines);
+  pool->firstUse = NO_USE;
+}
+
+bool isBarrier(vector tokens) {
+  char *instruction = peekFront(tokens);
+  if (!strcmp(instruction, "b") || !strcmp(instruction, "andeq")) {
+    return true;
+  }
+
+  // mov r15, ... and pop {..., r15} return from a function, ldr r15
+  // jumps through a table
+  return ((!strcmp(instruction, "mov") || !strcmp(instruction, "ldr")) &&
+          tokens.first->next && !strcmp(tokens.first->next->value, "r15")) ||
+         (get(BLOCK_MODES, instruction) && loadsPc(tokens));
+}
+
+void clearLiteralPool(literalPool *pool) {
+  clearMap(&pool->uses);
+  clearMap(&pool->keys);
+  clearMap(&pool->lines);
+  clearMap(&pool->slots);
+  clearMap(&pool->after);
+  clearMap(&pool->before);
+}
+
+void peephole(char **linesFromFile, uint32_t lineCount, FILE *report) {
+  peepholeLine *lines = malloc((lineCount ? lineCount : 1)
+                               * sizeof(peepholeLine));
+  if (!lines) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  // every change may expose another one, e.g. removing mov r1, r1 can
+  // bring an adds and its cmp together
+  uint32_t changes;
+  do {
+    map labels = parsePeepholeLines(linesFromFile, lineCount, lines);
+    changes = 0;
+    for (uint32_t i = 0; i < lineCount; i++) {
+      changes += peepholeLineAt(lines, lineCount, labels, linesFromFile, i,
+                                report);
+    }
+    clearMap(&labels);
+    clearPeepholeLines(lines, lineCount);
+  } while (changes);
+
+  free(lines);
+}
+
+map parsePeepholeLines(char **linesFromFile, uint32_t lineCount,
+                       peepholeLine *lines) {
+  map labels = constructMap();
+  int section = SECTION_TEXT;
+  for (uint32_t i = 0; i < lineCount; i++) {
+    peepholeLine *line = &lines[i];
+    line->labels = constructVector();
+    line->tokens = constructVector();
+    line->kind = PEEPHOLE_EMPTY;
+
+    vector tokens = tokenise(linesFromFile[i], DELIMITERS);
+    while (getType(peekFront(tokens)) == LABEL) {
+      char *label = getFront(&tokens);
+      label[strlen(label) - 1] = '\0';
+      put(&labels, label, i);
+      putBack(&line->labels, label);
+      free(label);
+    }
+
+    // drop the comment at the end of the line
+    while (!isEmptyVector(tokens)) {
+      getComment(&tokens);
+      char *token = getFront(&tokens);
+      if (token) {
+        putBack(&line->tokens, token);
+        free(token);
+      }
+    }
+
+    char *first = peekFront(line->tokens);
+    if (!first) {
+      continue;
+    }
+    if (getType(first) == DIRECTIVE) {
+      uint32_t type = *get(DIRECTIVES, first);
+      if (type == 0 || type == 1) {
+        section = type == 0 ? SECTION_TEXT : SECTION_DATA;
+      }
+      // .global, .extern, .equ and .set emit nothing
+      line->kind = type == 2 || type == 3 || type == EQU_DIRECTIVE ||
+                   type == SET_DIRECTIVE ? PEEPHOLE_EMPTY : PEEPHOLE_OTHER;
+    } else if (getType(first) == INSTRUCTION && section == SECTION_TEXT) {
+      line->kind = PEEPHOLE_CODE;
+    } else {
+      line->kind = PEEPHOLE_OTHER;
+    }
+  }
+
+  return labels;
+}
+
+void clearPeepholeLines(peepholeLine *lines, uint32_t lineCount) {
+  for (uint32_t i = 0; i < lineCount; i++) {
+    clearVector(&lines[i].labels);
+    clearVector(&lines[i].tokens);
+  }
+}
+
+uint32_t peepholeLineAt(peepholeLine *lines, uint32_t lineCount, map labels,
+                        char **linesFromFile, uint32_t i, FILE *report) {
+  peepholeLine *line = &lines[i];
+  if (line->kind != PEEPHOLE_CODE) {
+    return 0;
+  }
+
+  char *instruction = tokenAt(line->tokens, 0);
+  char name[MAX_LINE_LENGTH], cond[MAX_LINE_LENGTH];
+  splitMnemonic(instruction, name, cond);
+  int next = findInstruction(lines, lineCount, i + 1);
+
+  // mov rX, rX, a label on the last instruction would move off the code
+  bool removable = next >= 0 || isEmptyVector(line->labels);
+  if (removable && !strcmp(instruction, "mov") && line->tokens.size == 3 &&
+      !strcmp(tokenAt(line->tokens, 1), tokenAt(line->tokens, 2)) &&
+      strcmp(tokenAt(line->tokens, 1), "r15")) {
+    reportPeephole(report, i, "removed", linesFromFile[i]);
+    removeInstruction(lines, linesFromFile, i);
+    return 1;
+  }
+
+  // b label where label is the next instruction
+  if (*get(ALL_INSTRUCTIONS, name) == 3 && strcmp(instruction, "bl") &&
+      line->tokens.size == 2 && next >= 0) {
+    uint32_t *target = get(labels, tokenAt(line->tokens, 1));
+    if (target && findInstruction(lines, lineCount, *target) == next) {
+      reportPeephole(report, i, "removed", linesFromFile[i]);
+      removeInstruction(lines, linesFromFile, i);
+      return 1;
+    }
+  }
+
+  // adds rX, ... followed by cmp rX, #0 sets the same N and Z flags
+  if (next >= 0 && setsFlags(line->tokens) && !strcmp(cond, "") &&
+      *get(DATA_TYPE, name) != 2) {
+    peepholeLine *compare = &lines[next];
+    uint32_t value;
+    if (!isLabelled(lines, i + 1, next) && compare->tokens.size == 3 &&
+        !strcmp(tokenAt(compare->tokens, 0), "cmp") &&
+        !strcmp(tokenAt(compare->tokens, 1), tokenAt(line->tokens, 1)) &&
+        getImmediateValue(tokenAt(compare->tokens, 2), &value) && !value &&
+        !flagsLive(lines, lineCount, labels, next + 1, FLAG_DEPTH)) {
+      reportPeephole(report, next, "removed", linesFromFile[next]);
+      removeInstruction(lines, linesFromFile, next);
+      return 1;
+    }
+  }
+
+  // mov rX, #a followed by orr rX, rX, #b ... builds a constant
+  uint32_t value;
+  if (!strcmp(instruction, "mov") && line->tokens.size == 3 &&
+      getImmediateValue(tokenAt(line->tokens, 2), &value)) {
+    char *rd = tokenAt(line->tokens, 1);
+    uint32_t count = 1;
+    int last = i;
+    int j = next;
+    while (j >= 0 && !isLabelled(lines, last + 1, j)) {
+      vector orr = lines[j].tokens;
+      uint32_t bits;
+      if (orr.size != 4 || strcmp(tokenAt(orr, 0), "orr") ||
+          strcmp(tokenAt(orr, 1), rd) || strcmp(tokenAt(orr, 2), rd) ||
+          !getImmediateValue(tokenAt(orr, 3), &bits)) {
+        break;
+      }
+      value |= bits;
+      count++;
+      last = j;
+      j = findInstruction(lines, lineCount, j + 1);
+    }
+
+    uint32_t ins[2];
+    uint32_t needed = synthesiseConstant(value, 1, 0, ins);
+    if (count > 1 && (count > 2 || needed == 1) && strcmp(rd, "r15")) {
+      // ldr rX, =value picks mov, mvn, a pair or a literal
+      char replacement[MAX_LINE_LENGTH];
+      char *labelText = joinLabels(line->labels);
+      snprintf(replacement, MAX_LINE_LENGTH, "%sldr %s, =0x%x", labelText,
+               rd, value);
+      free(labelText);
+      for (int k = i + 1; k <= last; k++) {
+        if (lines[k].kind == PEEPHOLE_CODE) {
+          removeInstruction(lines, linesFromFile, k);
+        }
+      }
+      reportPeephole(report, i, "folded mov/orr into", replacement);
+      free(linesFromFile[i]);
+      linesFromFile[i] = copy(replacement);
+      // looked at again in the next sweep
+      line->kind = PEEPHOLE_OTHER;
+      return 1;
+    }
+  }
+
+  return ifConvert(lines, lineCount, labels, linesFromFile, i, report);
+}
+
+uint32_t ifConvert(peepholeLine *lines, uint32_t lineCount, map labels,
+                   char **linesFromFile, uint32_t i, FILE *report) {
+  vector branch = lines[i].tokens;
+  char *instruction = tokenAt(branch, 0);
+  uint32_t *type = get(ALL_INSTRUCTIONS, instruction);
+  if (!type || *type != 3 || branch.size != 2 ||
+      !strcmp(instruction, "b") || !strcmp(instruction, "bl")) {
+    return 0;
+  }
+
+  char *inverse = invertCondition(instruction + 1);
+  uint32_t *target = get(labels, tokenAt(branch, 1));
+  if (!inverse || !target || *target <= i) {
+    return 0;
+  }
+
+  int end = findInstruction(lines, lineCount, *target);
+  int last = i;
+  uint32_t count = 0;
+  for (int j = findInstruction(lines, lineCount, i + 1); j != end;
+       j = findInstruction(lines, lineCount, j + 1)) {
+    if (j < 0 || j > *target || ++count > IF_CONVERT_LIMIT) {
+      return 0;
+    }
+
+    char name[MAX_LINE_LENGTH], cond[MAX_LINE_LENGTH];
+    vector tokens = lines[j].tokens;
+    splitMnemonic(tokenAt(tokens, 0), name, cond);
+    uint32_t type = *get(ALL_INSTRUCTIONS, name);
+    if (type == 3 || type == 6 || strcmp(cond, "") || setsFlags(tokens) ||
+        (type == 1 && name[strlen(name) - 1] == 's') ||
+        (tokens.size > 1 && !strcmp(tokenAt(tokens, 1), "r15")) ||
+        loadsPc(tokens)) {
+      return 0;
+    }
+    last = j;
+  }
+
+  if (!count || isLabelled(lines, i + 1, last)) {
+    return 0;
+  }
+
+  reportPeephole(report, i, "if-converted", linesFromFile[i]);
+  removeInstruction(lines, linesFromFile, i);
+  for (int j = i + 1; j <= last; j++) {
+    if (lines[j].kind == PEEPHOLE_CODE) {
+      char *converted = addCondition(linesFromFile[j], inverse);
+      free(linesFromFile[j]);
+      linesFromFile[j] = converted;
+      // the tokens are stale until the next sweep
+      lines[j].kind = PEEPHOLE_OTHER;
+    }
+  }
+
+  return 1;
+}
+
+char *invertCondition(char *cond) {
+  static char *pairs[][2] = {{"eq", "ne"}, {"ge", "lt"}, {"gt", "le"},
+                             {"cs", "cc"}, {"hs", "lo"}, {"mi", "pl"},
+                             {"vs", "vc"}, {"hi", "ls"}};
+  for (int i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+    if (!strcmp(cond, pairs[i][0])) {
+      return pairs[i][1];
+    }
+    if (!strcmp(cond, pairs[i][1])) {
+      return pairs[i][0];
+    }
+  }
+
+  return NULL;
+}
+
+char *addCondition(char *line, char *cond) {
+  size_t start = strspn(line, " \t");
+  size_t end = start + strcspn(line + start, DELIMITERS);
+  char *converted = malloc(strlen(line) + strlen(cond) + 1);
+  if (!converted) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  memcpy(converted, line, end);
+  strcpy(converted + end, cond);
+  strcat(converted, line + end);
+  return converted;
+}
+
+bool isLabelled(peepholeLine *lines, uint32_t from, uint32_t to) {
+  for (uint32_t i = from; i <= to; i++) {
+    if (!isEmptyVector(lines[i].labels)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+int findInstruction(peepholeLine *lines, uint32_t lineCount, uint32_t from) {
+  for (uint32_t i = from; i < lineCount; i++) {
+    if (lines[i].kind == PEEPHOLE_CODE) {
+      return i;
+    }
+    if (lines[i].kind == PEEPHOLE_OTHER) {
+      return NOT_CODE;
+    }
+  }
+
+  return END_OF_CODE;
+}
+
+bool flagsLive(peepholeLine *lines, uint32_t lineCount, map labels,
+               uint32_t from, int depth) {
+  int i = findInstruction(lines, lineCount, from);
+  while (i >= 0) {
+    vector tokens = lines[i].tokens;
+    char *instruction = tokenAt(tokens, 0);
+    char name[MAX_LINE_LENGTH], cond[MAX_LINE_LENGTH];
+    splitMnemonic(instruction, name, cond);
+    uint32_t type = *get(ALL_INSTRUCTIONS, name);
+    if (type == 3) {
+      if (!strcmp(instruction, "bl")) {
+        // the callee may read the flags
+        return true;
+      }
+      char *cond = instruction + 1;
+      if (strcmp(cond, "") && strcmp(cond, "eq") && strcmp(cond, "ne")) {
+        // the other conditions also read C and V
+        return true;
+      }
+      uint32_t *target = tokens.size == 2 ? get(labels, tokenAt(tokens, 1))
+                                          : NULL;
+      if (!target || depth == 0) {
+        return true;
+      }
+      if (!strcmp(cond, "")) {
+        i = findInstruction(lines, lineCount, *target);
+        depth--;
+        continue;
+      }
+      if (flagsLive(lines, lineCount, labels, *target, depth - 1)) {
+        return true;
+      }
+    } else if (!strcmp(instruction, "andeq")) {
+      // andeq r0, r0, r0 halts
+      return false;
+    } else if (strcmp(cond, "") && strcmp(cond, "eq") && strcmp(cond, "ne")) {
+      // a conditional instruction reads the flags too
+      return true;
+    } else if (setsFlags(tokens) && !strcmp(cond, "")) {
+      return false;
+    } else if ((tokens.size > 1 && !strcmp(tokenAt(tokens, 1), "r15")) ||
+               loadsPc(tokens)) {
+      // returns to a caller that may read the flags
+      return true;
+    }
+    i = findInstruction(lines, lineCount, i + 1);
+  }
+
+  // the end of the program reads nothing, anything else is unknown
+  return i == NOT_CODE;
+}
+
+bool setsFlags(vector tokens) {
+  char name[MAX_LINE_LENGTH], cond[MAX_LINE_LENGTH];
+  splitMnemonic(tokenAt(tokens, 0), name, cond);
+  uint32_t *dataType = get(DATA_TYPE, name);
+  return dataType && (*dataType == 2 || name[3] == 's');
+}
+
+bool getImmediateValue(char *token, uint32_t *value) {
+  // constants are only defined by the passes, so they are not known here
+  expressionValue result;
+  if (getType(token) != EXPRESSION_TAG ||
+      !evaluateExpression(token + 1, &result, NULL, NULL) ||
+      result.labelled) {
+    return false;
+  }
+
+  *value = result.value;
+  return true;
+}
+
+char *tokenAt(vector tokens, int index) {
+  vectorNode *node = tokens.first;
+  for (int i = 0; node && i < index; i++) {
+    node = node->next;
+  }
+
+  return node ? node->value : NULL;
+}
+
+char *joinLabels(vector labels) {
+  char text[MAX_LINE_LENGTH] = "";
+  for (vectorNode *node = labels.first; node; node = node->next) {
+    strncat(text, node->value, MAX_LINE_LENGTH - strlen(text) - 3);
+    strcat(text, ": ");
+  }
+
+  return copy(text);
+}
+
+void removeInstruction(peepholeLine *lines, char **linesFromFile, uint32_t i) {
+  // labels on the line now name the instruction after it
+  free(linesFromFile[i]);
+  linesFromFile[i] = joinLabels(lines[i].labels);
+  clearVector(&lines[i].tokens);
+  lines[i].kind = PEEPHOLE_EMPTY;
+}
+
+void reportPeephole(FILE *report, uint32_t i, char *change, char *line) {
+  if (!report) {
+    return;
+  }
+
+  while (isspace(*line)) {
+    line++;
+  }
+  fprintf(report, "[%d] %s %s\n", i + 1, change, line);
+}
+
+bool readProfile(const char *filename, map *counts, map *taken) {
+  FILE *input = fopen(filename, "r");
+  if (!input) {
+    return false;
+  }
+
+  char line[MAX_LINE_LENGTH];
+  while (fgets(line, MAX_LINE_LENGTH, input)) {
+    char kind[MAX_LINE_LENGTH];
+    uint32_t first, second, count;
+    // block first last count or edge from to count, all hex
+    if (sscanf(line, "%s %x %x %x", kind, &first, &second, &count) != 4) {
+      continue;
+    }
+
+    if (!strcmp(kind, "block")) {
+      for (uint32_t address = first; address <= second;
+           address += MEMORY_SIZE) {
+        char *key = uintToString(address);
+        put(counts, key, count);
+        free(key);
+      }
+    } else if (!strcmp(kind, "edge")) {
+      char *key = uintToString(first);
+      uint32_t *previous = get(*taken, key);
+      put(taken, key, count + (previous ? *previous : 0));
+      free(key);
+    }
+  }
+
+  fclose(input);
+  return true;
+}
+
+char **layoutBlocks(char **linesFromFile, uint32_t *lineCount, uint32_t base,
+                    map counts, map taken, FILE *report) {
+  blockLayout layout = {NULL, linesFromFile, constructMap(), constructMap(),
+                        constructMap(), counts, taken, base, report};
+  if (!locateLines(linesFromFile, *lineCount, &layout.locations)) {
+    // the errors are reported when the source is assembled
+    clearMap(&layout.locations);
+    return linesFromFile;
+  }
+
+  layout.lines = malloc((*lineCount ? *lineCount : 1) * sizeof(peepholeLine));
+  if (!layout.lines) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  layout.labels = parsePeepholeLines(linesFromFile, *lineCount, layout.lines);
+  for (uint32_t i = 0; i < *lineCount; i++) {
+    vector tokens = layout.lines[i].tokens;
+    if (layout.lines[i].kind == PEEPHOLE_CODE && tokens.size == 2 &&
+        !strcmp(tokenAt(tokens, 0), "bl")) {
+      put(&layout.callees, tokenAt(tokens, 1), i);
+    }
+  }
+
+  vector output = constructVector();
+  uint32_t i = 0;
+  while (i < *lineCount) {
+    if (layout.lines[i].kind == PEEPHOLE_OTHER) {
+      putBack(&output, linesFromFile[i++]);
+      continue;
+    }
+
+    // the function runs to the next one, a directive or data
+    uint32_t end = i + 1;
+    while (end < *lineCount && layout.lines[end].kind != PEEPHOLE_OTHER &&
+           !isCallee(&layout, end)) {
+      end++;
+    }
+    layoutFunction(&layout, i, end - 1, &output);
+    i = end;
+  }
+
+  clearPeepholeLines(layout.lines, *lineCount);
+  free(layout.lines);
+  clearLinesFromFile(linesFromFile, *lineCount);
+  clearMap(&layout.labels);
+  clearMap(&layout.callees);
+  clearMap(&layout.locations);
+
+  *lineCount = output.size;
+  char **laidOut = malloc((output.size ? output.size : 1) * sizeof(char *));
+  if (!laidOut) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t j = 0; j < *lineCount; j++) {
+    laidOut[j] = getFront(&output);
+  }
+
+  return laidOut;
+}
+
+bool locateLines(char **linesFromFile, uint32_t lineCount, map *locations) {
+  map labelMapping = constructMap();
+  errorList errors = {NULL, 0, 0};
+  objectInfo object = {constructMap(), constructMap(), NULL, 0, 0, 0, 0, 0,
+                       0};
+  literalPool pool = {constructMap(), constructMap(), constructMap(), NO_USE,
+                      constructMap(), constructMap(), constructMap()};
+  uint32_t instructionsNumber;
+  firstPass(linesFromFile, lineCount, &labelMapping, &errors,
+            &instructionsNumber, &pool, &object, locations, NULL);
+  bool located = !errors.size;
+
+  free(errors.errors);
+  clearObject(&object);
+  clearLiteralPool(&pool);
+  clearMap(&labelMapping);
+  return located;
+}
+
+void layoutFunction(blockLayout *layout, uint32_t from, uint32_t to,
+                    vector *output) {
+  layoutBlock *blocks = malloc((to - from + 1) * sizeof(layoutBlock));
+  uint32_t *order = malloc((to - from + 1) * sizeof(uint32_t));
+  if (!blocks || !order) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t count = findBlocks(layout, from, to, blocks);
+  uint32_t entered = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    entered += blocks[i].count;
+  }
+
+  // a function falling into the code after it must keep its last block
+  bool moved = false;
+  if (count > 1 && entered && !blocks[count - 1].falls) {
+    orderBlocks(layout, blocks, count, order);
+    for (uint32_t i = 0; i < count; i++) {
+      moved |= order[i] != i;
+    }
+  }
+
+  if (!moved) {
+    for (uint32_t i = from; i <= to; i++) {
+      putBack(output, layout->linesFromFile[i]);
+    }
+    free(blocks);
+    free(order);
+    return;
+  }
+
+  // decide how every block ends first, the blocks branched to need labels
+  for (uint32_t i = 0; i < count; i++) {
+    layoutBlock *block = &blocks[order[i]];
+    int next = i + 1 < count ? order[i + 1] : -1;
+    int target = branchTarget(layout, blocks, count, block);
+    if (block->falls && next != order[i] + 1) {
+      char *inverse = block->branch >= 0 ? invertCondition(
+          tokenAt(layout->lines[block->branch].tokens, 0) + 1) : NULL;
+      block->action = next == target && inverse ? LAYOUT_INVERT
+                                                : LAYOUT_APPEND;
+      blockName(layout, &blocks[order[i] + 1]);
+    } else if (!block->falls && target >= 0 && next == target) {
+      block->action = LAYOUT_REMOVE;
+    }
+  }
+
+  char text[MAX_LINE_LENGTH] = "lines";
+  for (uint32_t i = 0; i < count; i++) {
+    layoutBlock *block = &blocks[order[i]];
+    char *follower = block->action == LAYOUT_APPEND ||
+                     block->action == LAYOUT_INVERT
+                     ? blockName(layout, &blocks[order[i] + 1]) : NULL;
+    for (uint32_t j = block->first; j <= block->last; j++) {
+      char line[MAX_LINE_LENGTH] = "";
+      if (j == block->first && block->name) {
+        snprintf(line, MAX_LINE_LENGTH, "%s: ", block->name);
+      }
+
+      char *labelText = joinLabels(layout->lines[j].labels);
+      if (j == block->branch && block->action == LAYOUT_INVERT) {
+        char *instruction = tokenAt(layout->lines[j].tokens, 0);
+        snprintf(line + strlen(line), MAX_LINE_LENGTH - strlen(line),
+                 "%s" LAYOUT_INDENT "b%s %s", labelText,
+                 invertCondition(instruction + 1), follower);
+      } else if (j == block->branch && block->action == LAYOUT_REMOVE) {
+        strncat(line, labelText, MAX_LINE_LENGTH - strlen(line) - 1);
+      } else {
+        strncat(line, layout->linesFromFile[j],
+                MAX_LINE_LENGTH - strlen(line) - 1);
+      }
+      free(labelText);
+      putBack(output, line);
+    }
+
+    if (block->action == LAYOUT_APPEND) {
+      char line[MAX_LINE_LENGTH];
+      snprintf(line, MAX_LINE_LENGTH, LAYOUT_INDENT "b %s", follower);
+      putBack(output, line);
+    }
+
+    char number[MAX_LINE_LENGTH];
+    snprintf(number, MAX_LINE_LENGTH, " %d", block->first + 1);
+    strncat(text, number, MAX_LINE_LENGTH - strlen(text) - 1);
+  }
+  reportPeephole(layout->report, from, "laid out blocks", text);
+
+  for (uint32_t i = 0; i < count; i++) {
+    free(blocks[i].name);
+  }
+  free(blocks);
+  free(order);
+}
+
+uint32_t findBlocks(blockLayout *layout, uint32_t from, uint32_t to,
+                    layoutBlock blocks[]) {
+  peepholeLine *lines = layout->lines;
+  uint32_t count = 0;
+  bool hasCode = false;
+  bool ended = false;
+  for (uint32_t i = from; i <= to; i++) {
+    // labels start a block, so does the instruction after a branch
+    if (i == from || (hasCode && (!isEmptyVector(lines[i].labels) ||
+                                  (ended && lines[i].kind == PEEPHOLE_CODE)))) {
+      layoutBlock block = {i, i, -1, true, 0, 0, LAYOUT_KEEP, NULL, false};
+      blocks[count++] = block;
+      hasCode = false;
+      ended = false;
+    }
+
+    layoutBlock *block = &blocks[count - 1];
+    block->last = i;
+    if (lines[i].kind != PEEPHOLE_CODE) {
+      continue;
+    }
+
+    if (!hasCode) {
+      block->count = profileAt(layout, layout->counts, i);
+      hasCode = true;
+    }
+    vector tokens = lines[i].tokens;
+    char *instruction = tokenAt(tokens, 0);
+    uint32_t *type = get(ALL_INSTRUCTIONS, instruction);
+    if ((type && *type == 3 && strcmp(instruction, "bl")) ||
+        isBarrier(tokens)) {
+      block->branch = i;
+      block->falls = type && *type == 3 && strcmp(instruction, "b");
+      block->taken = profileAt(layout, layout->taken, i);
+      ended = true;
+    }
+  }
+
+  return count;
+}
+
+void orderBlocks(blockLayout *layout, layoutBlock blocks[], uint32_t count,
+                 uint32_t order[]) {
+  order[0] = 0;
+  blocks[0].placed = true;
+  for (uint32_t i = 1; i < count; i++) {
+    uint32_t last = order[i - 1];
+    layoutBlock *block = &blocks[last];
+    int next = -1;
+    uint32_t weight = 0;
+    if (block->falls && last + 1 < count && !blocks[last + 1].placed &&
+        block->count > block->taken) {
+      next = last + 1;
+      weight = block->count - block->taken;
+    }
+    int target = branchTarget(layout, blocks, count, block);
+    if (target >= 0 && !blocks[target].placed && block->taken > weight) {
+      next = target;
+    }
+
+    if (next < 0) {
+      // start again from the hottest block left, the never executed
+      // blocks keep their order at the end
+      for (uint32_t j = 0; j < count; j++) {
+        if (!blocks[j].placed &&
+            (next < 0 || blocks[j].count > blocks[next].count)) {
+          next = j;
+        }
+      }
+    }
+
+    order[i] = next;
+    blocks[next].placed = true;
+  }
+}
+
+int branchTarget(blockLayout *layout, layoutBlock blocks[], uint32_t count,
+                 layoutBlock *block) {
+  if (block->branch < 0) {
+    return -1;
+  }
+
+  vector tokens = layout->lines[block->branch].tokens;
+  uint32_t *type = get(ALL_INSTRUCTIONS, tokenAt(tokens, 0));
+  uint32_t *line = tokens.size == 2 ? get(layout->labels, tokenAt(tokens, 1))
+                                    : NULL;
+  if (!type || *type != 3 || !line) {
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (blocks[i].first <= *line && *line <= blocks[i].last) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+uint32_t profileAt(blockLayout *layout, map values, uint32_t line) {
+  char *lineNo = uintToString(line + 1);
+  uint32_t *location = get(layout->locations, lineNo);
+  free(lineNo);
+  if (!location) {
+    return 0;
+  }
+
+  char *address = uintToString(layout->base + *location);
+  uint32_t *value = get(values, address);
+  free(address);
+  return value ? *value : 0;
+}
+
+bool isCallee(blockLayout *layout, uint32_t line) {
+  for (vectorNode *node = layout->lines[line].labels.first; node;
+       node = node->next) {
+    if (get(layout->callees, node->value)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+char *blockName(blockLayout *layout, layoutBlock *block) {
+  vector labels = layout->lines[block->first].labels;
+  if (!isEmptyVector(labels)) {
+    return peekFront(labels);
+  }
+
+  if (!block->name) {
+    char name[MAX_LINE_LENGTH];
+    snprintf(name, MAX_LINE_LENGTH, "block%d", block->first + 1);
+    while (get(layout->labels, name)) {
+      strncat(name, "_", MAX_LINE_LENGTH - strlen(name) - 1);
+    }
+    block->name = copy(name);
+  }
+
+  return block->name;
+}
+
+bool readCosts(const char *filename) {
+  FILE *input = fopen(filename, "r");
+  if (!input) {
+    return false;
+  }
+
+  bool valid = true;
+  char line[MAX_LINE_LENGTH];
+  while (valid && fgets(line, MAX_LINE_LENGTH, input)) {
+    line[strcspn(line, "#")] = '\0';
+    char name[MAX_LINE_LENGTH], rest[MAX_LINE_LENGTH];
+    uint32_t cycles;
+    int fields = sscanf(line, "%s %u %s", name, &cycles, rest);
+    if (fields == EOF) {
+      continue;
+    }
+
+    valid = fields == 2 && get(COSTS, name);
+    if (valid) {
+      put(&COSTS, name, cycles);
+    }
+  }
+
+  fclose(input);
+  return valid;
+}
+
+uint32_t instructionCost(map costs, uint32_t word) {
+  bool writesPc = ((word >> 12) & 0xF) == 15;
+  bool shifted = (word & 0xFF0) != 0;
+  if ((word & 0x0F000000) == 0x0F000000) {
+    return *get(costs, "svc");
+  }
+  if ((word & 0x0E000000) == 0x0A000000) {
+    return *get(costs, "branch");
+  }
+  if ((word & 0x0F0000F0) == 0x00000090) {
+    return *get(costs, "multiply");
+  }
+  if ((word & 0x0FD0F0F0) == 0x0710F010) {
+    return *get(costs, "divide");
+  }
+  if ((word & 0x0E000000) == 0x08000000) {
+    uint32_t registers = 0;
+    for (uint32_t list = word & 0xFFFF; list; list &= list - 1) {
+      registers++;
+    }
+    return *get(costs, "transfer")
+           + (registers > 1 ? registers - 1 : 0) * *get(costs, "register")
+           + ((word & (1 << 20)) && (word & (1 << PC_REGISTER))
+              ? *get(costs, "branch") : 0);
+  }
+  if ((word & 0x0F0000F0) == 0x01000090) {
+    // swp, ldrex and strex
+    return *get(costs, "transfer");
+  }
+  if ((word & 0x0E0000F0) == 0x000000B0) {
+    // ldrh/strh, which can't shift their register offset
+    return *get(costs, "transfer")
+           + ((word & (1 << 20)) && writesPc ? *get(costs, "branch") : 0);
+  }
+  if ((word & 0x0C000000) == 0x04000000) {
+    // a register offset is the one with bit 25 set, ldr r15 also branches
+    return *get(costs, "transfer")
+           + ((word & (1 << 25)) && shifted ? *get(costs, "shift") : 0)
+           + ((word & (1 << 20)) && writesPc ? *get(costs, "branch") : 0);
+  }
+
+  // tst, teq, cmp and cmn don't write their destination
+  uint32_t opcode = (word >> 21) & 0xF;
+  bool writes = opcode < 8 || opcode > 11;
+  return *get(costs, writes && writesPc ? "branch" : "data")
+         + (!(word & (1 << 25)) && shifted ? *get(costs, "shift") : 0);
+}
+
+uint32_t estimateCycles(uint32_t word) {
+  static map defaults = {NULL, 0};
+  if (!defaults.head) {
+    defaults = fillCosts();
+  }
+
+  return instructionCost(defaults, word);
+}
+
+void writeListing(FILE *output, char **linesFromFile, uint32_t lineCount,
+                  uint32_t *sourceLines, map locations, map sizes,
+                  asmResult *result) {
+  fprintf(output, "# asm cost listing, cycles of");
+  for (mapNode *node = COSTS.head; node; node = node->next) {
+    fprintf(output, " %s %u", node->key, node->value);
+  }
+  fprintf(output, "\n");
+
+  vector loops = constructVector();
+  char label[MAX_LINE_LENGTH] = "";
+  uint32_t instructions = 0, cycles = 0;
+  for (uint32_t i = 0; i < lineCount; i++) {
+    char name[MAX_LINE_LENGTH];
+    lineLabel(linesFromFile[i], name);
+    if (name[0]) {
+      listBlock(output, label, instructions, cycles);
+      strcpy(label, name);
+      instructions = 0;
+      cycles = 0;
+    }
+
+    char *lineNo = uintToString(i + 1);
+    uint32_t *location = get(locations, lineNo);
+    uint32_t *size = get(sizes, lineNo);
+    free(lineNo);
+    uint32_t line = sourceLines ? sourceLines[i] : i + 1;
+    if (!location) {
+      fprintf(output, "%s[%u] %s\n", LISTING_INDENT, line, linesFromFile[i]);
+      continue;
+    }
+
+    // ldr rd, =constant may be synthesised into two instructions, the
+    // source is shown with the first
+    for (uint32_t offset = 0; offset < *size; offset += MEMORY_SIZE) {
+      uint32_t word = result->words[(*location + offset) / MEMORY_SIZE];
+      uint32_t cost = instructionCost(COSTS, word);
+      fprintf(output, "0x%08x 0x%08x %4u", result->base + *location + offset,
+              word, cost);
+      if (offset) {
+        fprintf(output, "\n");
+      } else {
+        fprintf(output, "  [%u] %s\n", line, linesFromFile[i]);
+      }
+      instructions++;
+      cycles += cost;
+    }
+    if (!label[0]) {
+      // code before the first label is named by its address
+      snprintf(label, MAX_LINE_LENGTH, "0x%08x", result->base + *location);
+    }
+
+    // a branch is a single instruction
+    uint32_t word = result->words[*location / MEMORY_SIZE];
+    int32_t offset = ((int32_t) (word << 8)) >> 6;
+    int32_t target = (int32_t) *location + offset + PC_OFFSET * MEMORY_SIZE;
+    if ((word & 0x0E000000) != 0x0A000000 || target > (int32_t) *location ||
+        target < 0) {
+      continue;
+    }
+
+    // the loop runs from the target of the backward branch up to it
+    uint32_t bodyInstructions = 0, bodyCycles = 0;
+    for (mapNode *node = locations.head; node; node = node->next) {
+      if (node->value >= (uint32_t) target && node->value <= *location) {
+        uint32_t bytes = *get(sizes, node->key);
+        bodyInstructions += bytes / MEMORY_SIZE;
+        bodyCycles += instructionsCost(result, node->value, bytes);
+      }
+    }
+    char *loopName = NULL;
+    for (mapNode *node = result->symbols.head; node && !loopName;
+         node = node->next) {
+      if (node->value == result->base + target) {
+        loopName = node->key;
+      }
+    }
+    char loop[MAX_LINE_LENGTH];
+    snprintf(loop, MAX_LINE_LENGTH,
+             "# loop %s 0x%08x-0x%08x: %u instructions, %u cycles per "
+             "iteration", loopName ? loopName : "", result->base + target,
+             result->base + *location, bodyInstructions, bodyCycles);
+    putBack(&loops, loop);
+  }
+  listBlock(output, label, instructions, cycles);
+
+  while (!isEmptyVector(loops)) {
+    char *loop = getFront(&loops);
+    fprintf(output, "%s\n", loop);
+    free(loop);
+  }
+}
+
+uint32_t instructionsCost(asmResult *result, uint32_t location, uint32_t size) {
+  uint32_t cycles = 0;
+  for (uint32_t offset = 0; offset < size; offset += MEMORY_SIZE) {
+    cycles += instructionCost(COSTS, result->words[(location + offset)
+                                                   / MEMORY_SIZE]);
+  }
+
+  return cycles;
+}
+
+void listBlock(FILE *output, char *label, uint32_t instructions,
+               uint32_t cycles) {
+  if (instructions) {
+    fprintf(output, "# block %s: %u instructions, %u cycles\n", label,
+            instructions, cycles);
+  }
+}
+
+void lineLabel(char *line, char *name) {
+  line += strspn(line, DELIMITERS);
+  size_t length = strcspn(line, DELIMITERS);
+  if (length > 1 && line[length - 1] == ':') {
+    strncpy(name, line, length - 1);
+    name[length - 1] = '\0';
+  } else {
+    name[0] = '\0';
+  }
+}
+
+uint32_t dataAlignment(uint32_t type) {
+  return type == WORD_DIRECTIVE ? MEMORY_SIZE : 1;
+}
+
+void emitByte(uint32_t words[], uint32_t *location, uint8_t byte) {
+  if (words) {
+    // little endian, the first byte of a word is its least significant
+    uint32_t shift = *location % MEMORY_SIZE * 8;
+    words[*location / MEMORY_SIZE] &= ~(0xFFu << shift);
+    words[*location / MEMORY_SIZE] |= (uint32_t) byte << shift;
+  }
+  (*location)++;
+}
+
+void decodeData(vector *tokens, char *line, uint32_t *location,
+                uint32_t words[], map labelMapping, objectInfo *object,
+                errorList *errors, char *ln) {
+  char *directive = getFront(tokens);
+  uint32_t type = *get(DIRECTIVES, directive);
+  expressionValue value;
+  if (!words) {
+    // only the size matters in the first pass, errors are reported once
+    // during the second pass
+    errors = NULL;
+  }
+
+  switch (type) {
+    case WORD_DIRECTIVE: // .word value, label, ...
+    case BYTE_DIRECTIVE: // .byte value, ...
+      getComment(tokens);
+      if (isEmptyVector(*tokens)) {
+        throwExpressionMissingError(directive, errors, ln);
+      }
+      while (!isEmptyVector(*tokens)) {
+        char *token = getFront(tokens);
+        value.value = 0;
+        value.symbol[0] = '\0';
+        if (words) {
+          getDataValue(token, &value, errors, ln);
+        }
+        if (type == WORD_DIRECTIVE) {
+          if (value.symbol[0]) {
+            addRelocation(object, *location, RELOC_ABS32, value.symbol);
+          }
+          for (int i = 0; i < MEMORY_SIZE; i++) {
+            emitByte(words, location, value.value >> (i * 8));
+          }
+        } else {
+          if ((int32_t) value.value > 0xFF || (int32_t) value.value < -0x80) {
+            throwOutOfRangeError("byte", token, errors, ln);
+          }
+          emitByte(words, location, value.value);
+        }
+        free(token);
+        if (!isEmptyVector(*tokens)) {
+          getComment(tokens);
+        }
+      }
+      break;
+    case ASCII_DIRECTIVE: // .ascii "string"
+    case ASCIZ_DIRECTIVE: { // .asciz "string", null terminated
+      // the string may contain delimiters so it is read from the line
+      char *string = strchr(strstr(line, directive), '"');
+      if (!string) {
+        throwExpressionMissingError(directive, errors, ln);
+        break;
+      }
+      for (string++; *string && *string != '"'; string++) {
+        char c = *string;
+        if (c == '\\' && string[1]) {
+          string++;
+          switch (*string) {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case '0': c = '\0'; break;
+            default:  c = *string;
+          }
+        }
+        emitByte(words, location, c);
+      }
+      if (*string != '"') {
+        throwExpressionError(directive, errors, ln);
+      }
+      if (type == ASCIZ_DIRECTIVE) {
+        emitByte(words, location, '\0');
+      }
+      break;
+    }
+    case SPACE_DIRECTIVE: // .space bytes [, fill]
+    case ALIGN_DIRECTIVE: { // .align power of two
+      // the size must be known in the first pass, so no labels
+      char *token = peekFront(*tokens);
+      expressionValue fill = {0, "", false};
+      if (!token) {
+        throwExpressionMissingError(directive, errors, ln);
+        break;
+      }
+      if (!getDataValue(token, &value, errors, ln)) {
+        break;
+      }
+      if (value.labelled) {
+        throwExpressionError(token, errors, ln);
+        break;
+      }
+      free(getFront(tokens));
+      getComment(tokens);
+      token = peekFront(*tokens);
+      if (token) {
+        getDataValue(token, &fill, errors, ln);
+      }
+      uint32_t end = *location + value.value;
+      if (type == ALIGN_DIRECTIVE) {
+        if (value.value > MAX_ALIGNMENT) {
+          throwExpressionError(directive, errors, ln);
+          break;
+        }
+        end = *location;
+        alignLocation(&end, 1 << value.value);
+      }
+      while (*location < end) {
+        emitByte(words, location, fill.value);
+      }
+      break;
+    }
+  }
+
+  clearVector(tokens);
+  free(directive);
+}
+
+bool getDataValue(char *token, expressionValue *value, errorList *errors,
+                  char *ln) {
+  return evaluateExpression(token[0] == '#' ? token + 1 : token, value,
+                            errors, ln);
+}
+
+void decodeDirective(vector *tokens, int *section, bool firstPass,
+                objectInfo *object, errorList *errors, char *ln) {
+  char *directive = getFront(tokens);
+  uint32_t type = *get(DIRECTIVES, directive);
+  uint32_t line = atoi(ln);
+
+  switch (type) {
+    case 0: *section = SECTION_TEXT;
+            break;
+    case 1: *section = SECTION_DATA;
+            break;
+    case 2: // .global name, name, ...
+    case 3: // .extern name, name, ...
+            if (!firstPass) {
+              break;
+            }
+            if (isEmptyVector(*tokens)) {
+              throwExpressionMissingError(directive, errors, ln);
+            }
+            while (!isEmptyVector(*tokens)) {
+              getComment(tokens);
+              char *name = getFront(tokens);
+              if (!name) {
+                break;
+              }
+              put(type == 2 ? &object->globals : &object->externs, name, line);
+              free(name);
+            }
+            break;
+  }
+
+  clearVector(tokens);
+  free(directive);
+}
+
+void decodeEquate(vector *tokens, errorList *errors, char *ln) {
+  char *directive = getFront(tokens);
+  uint32_t type = *get(DIRECTIVES, directive);
+  getComment(tokens);
+  char *name = getFront(tokens);
+  getComment(tokens);
+  char *token = getFront(tokens);
+  expressionValue value;
+
+  if (!name || !token) {
+    throwExpressionMissingError(directive, errors, ln);
+  } else if (type == EQU_DIRECTIVE && get(SYMBOLS.equates, name)) {
+    throwSymbolError(name, "is already defined", errors, ln);
+  } else if (getDataValue(token, &value, errors, ln)) {
+    if (value.labelled) {
+      // the passes must agree on every constant, labels move between them
+      throwExpressionError(token, errors, ln);
+    } else {
+      put(&SYMBOLS.equates, name, value.value);
+    }
+    if (SYMBOLS.labels && get(*SYMBOLS.labels, name)) {
+      throwSymbolError(name, "is defined as a label and a constant", errors,
+                       ln);
+    }
+  }
+
+  free(name);
+  free(token);
+  clearVector(tokens);
+  free(directive);
+}
+
+void checkSymbols(map labelMapping, objectInfo *object, errorList *errors) {
+  for (mapNode *node = object->globals.head; node; node = node->next) {
+    if (!get(labelMapping, node->key)) {
+      char *lineNo = uintToString(node->value);
+      throwSymbolError(node->key, "is declared .global but never defined",
+                      errors, lineNo);
+      free(lineNo);
+    }
+  }
+
+  for (mapNode *node = object->externs.head; node; node = node->next) {
+    if (get(labelMapping, node->key)) {
+      char *lineNo = uintToString(node->value);
+      throwSymbolError(node->key, "is declared .extern but defined here",
+                      errors, lineNo);
+      free(lineNo);
+    }
+  }
+}
+
+void addRelocation(objectInfo *object, uint32_t offset, uint32_t type,
+                char *symbol) {
+  for (uint32_t i = 0; i < object->relocCount; i++) {
+    if (object->relocs[i].offset == offset && object->relocs[i].type == type) {
+      // a literal shared by several ldr instructions
+      return;
+    }
+  }
+
+  if (object->relocCount == object->relocCapacity) {
+    object->relocCapacity = object->relocCapacity ? 2 * object->relocCapacity
+                                                   : 16;
+    object->relocs = realloc(object->relocs,
+                            object->relocCapacity * sizeof(relocEntry));
+    if (!object->relocs) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  relocEntry *reloc = &object->relocs[object->relocCount++];
+  reloc->offset = offset;
+  reloc->type   = type;
+  reloc->symbol = copy(symbol);
+}
+
+void writeObject(FILE *output, asmResult *result) {
+  // every label is written so relocations against local labels can be
+  // resolved once the linker has placed the sections
+  objectInfo *object = &result->object;
+  map symbolIndex = constructMap();
+  uint32_t symbolCount = result->symbols.size + object->externs.size;
+  objSymbol *symbols = calloc(symbolCount ? symbolCount : 1, sizeof(objSymbol));
+  objReloc *relocs = calloc(object->relocCount ? object->relocCount : 1,
+                            sizeof(objReloc));
+  if (!symbols || !relocs) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t n = 0;
+  for (mapNode *node = result->symbols.head; node; node = node->next, n++) {
+    strncpy(symbols[n].name, node->key, OBJ_NAME_LENGTH - 1);
+    symbols[n].value   = node->value - result->base;
+    symbols[n].binding = get(object->globals, node->key) ? OBJ_GLOBAL
+                                                         : OBJ_LOCAL;
+    put(&symbolIndex, node->key, n);
+  }
+  for (mapNode *node = object->externs.head; node; node = node->next, n++) {
+    strncpy(symbols[n].name, node->key, OBJ_NAME_LENGTH - 1);
+    symbols[n].value   = 0;
+    symbols[n].binding = OBJ_EXTERN;
+    put(&symbolIndex, node->key, n);
+  }
+
+  uint32_t relocCount = 0;
+  for (uint32_t i = 0; i < object->relocCount; i++) {
+    uint32_t *index = get(symbolIndex, object->relocs[i].symbol);
+    if (!index) {
+      // predefined names are already absolute
+      continue;
+    }
+    relocs[relocCount].offset = object->relocs[i].offset;
+    relocs[relocCount].type   = object->relocs[i].type;
+    relocs[relocCount].symbol = *index;
+    relocCount++;
+  }
+
+  objHeader header = {OBJ_MAGIC, object->textSize, object->dataSize,
+                      symbolCount, relocCount};
+  fwrite(&header, sizeof(objHeader), 1, output);
+  fwrite(result->words, sizeof(uint32_t),
+         object->textSize + object->dataSize, output);
+  fwrite(symbols, sizeof(objSymbol), symbolCount, output);
+  fwrite(relocs, sizeof(objReloc), relocCount, output);
+
+  free(symbols);
+  free(relocs);
+  clearMap(&symbolIndex);
+}
+
+void writeElf(FILE *output, asmResult *result) {
+  objectInfo *object = &result->object;
+  uint32_t textBytes = object->textSize * MEMORY_SIZE;
+  uint32_t dataBytes = object->dataSize * MEMORY_SIZE;
+  uint32_t dataAddress = result->base + object->dataBase * MEMORY_SIZE;
+  uint32_t segmentCount = dataBytes ? 2 : 1;
+
+  // the local symbols have to come first, then the globals
+  uint32_t symbolCount = result->symbols.size + 1;
+  Elf32_Sym *symbols = calloc(symbolCount, sizeof(Elf32_Sym));
+  uint32_t namesSize = 1;
+  for (mapNode *node = result->symbols.head; node; node = node->next) {
+    namesSize += strlen(node->key) + 1;
+  }
+  char *names = calloc(namesSize, 1);
+  if (!symbols || !names) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  uint32_t n = 1, nameOffset = 1, firstGlobal = 1;
+  for (int global = 0; global < 2; global++) {
+    for (mapNode *node = result->symbols.head; node; node = node->next) {
+      if (!get(object->globals, node->key) != !global) {
+        continue;
+      }
+      symbols[n].st_name  = nameOffset;
+      symbols[n].st_value = node->value;
+      symbols[n].st_info  = ELF32_ST_INFO(global ? STB_GLOBAL : STB_LOCAL,
+                                          STT_NOTYPE);
+      symbols[n].st_shndx = node->value < result->base + textBytes ? 1 : 2;
+      strcpy(names + nameOffset, node->key);
+      nameOffset += strlen(node->key) + 1;
+      n++;
+    }
+    if (!global) {
+      firstGlobal = n;
+    }
+  }
+
+  // file layout: header, program headers, text, data, symbols, names,
+  // section names and the section headers
+  uint32_t textOffset = sizeof(Elf32_Ehdr) + segmentCount * sizeof(Elf32_Phdr);
+  uint32_t symbolOffset = textOffset + textBytes + dataBytes;
+  uint32_t namesOffset = symbolOffset + symbolCount * sizeof(Elf32_Sym);
+  uint32_t sectionNamesOffset = namesOffset + namesSize;
+  uint32_t sectionOffset = sectionNamesOffset + sizeof(ELF_SHSTRTAB);
+  alignLocation(&sectionOffset, MEMORY_SIZE);
+  uint32_t *entry = get(result->symbols, "_start");
+
+  Elf32_Ehdr header = {{ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS32,
+                        ELFDATA2LSB, EV_CURRENT, ELFOSABI_NONE}};
+  header.e_type      = ET_EXEC;
+  header.e_machine   = EM_ARM;
+  header.e_version   = EV_CURRENT;
+  header.e_entry     = entry ? *entry : result->base;
+  header.e_phoff     = sizeof(Elf32_Ehdr);
+  header.e_shoff     = sectionOffset;
+  header.e_flags     = EF_ARM_EABI_VER5;
+  header.e_ehsize    = sizeof(Elf32_Ehdr);
+  header.e_phentsize = sizeof(Elf32_Phdr);
+  header.e_phnum     = segmentCount;
+  header.e_shentsize = sizeof(Elf32_Shdr);
+  header.e_shnum     = ELF_SECTIONS;
+  header.e_shstrndx  = ELF_SECTIONS - 1;
+
+  Elf32_Phdr segments[2] = {
+    {PT_LOAD, textOffset, result->base, result->base, textBytes, textBytes,
+     PF_R | PF_X, MEMORY_SIZE},
+    {PT_LOAD, textOffset + textBytes, dataAddress, dataAddress, dataBytes,
+     dataBytes, PF_R | PF_W, MEMORY_SIZE}};
+
+  // name, type, flags, address, offset, size, link, info, alignment, entry
+  Elf32_Shdr sections[ELF_SECTIONS] = {
+    {0},
+    {1, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, result->base, textOffset,
+     textBytes, 0, 0, MEMORY_SIZE, 0},
+    {7, SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, dataAddress,
+     textOffset + textBytes, dataBytes, 0, 0, MEMORY_SIZE, 0},
+    {13, SHT_SYMTAB, 0, 0, symbolOffset, symbolCount * sizeof(Elf32_Sym), 4,
+     firstGlobal, MEMORY_SIZE, sizeof(Elf32_Sym)},
+    {21, SHT_STRTAB, 0, 0, namesOffset, namesSize, 0, 0, 1, 0},
+    {29, SHT_STRTAB, 0, 0, sectionNamesOffset, sizeof(ELF_SHSTRTAB), 0, 0, 1,
+     0}};
+
+  fwrite(&header, sizeof(Elf32_Ehdr), 1, output);
+  fwrite(segments, sizeof(Elf32_Phdr), segmentCount, output);
+  fwrite(result->words, sizeof(uint32_t),
+         object->textSize + object->dataSize, output);
+  fwrite(symbols, sizeof(Elf32_Sym), symbolCount, output);
+  fwrite(names, 1, namesSize, output);
+  fwrite(ELF_SHSTRTAB, 1, sizeof(ELF_SHSTRTAB), output);
+  for (uint32_t i = sectionNamesOffset + sizeof(ELF_SHSTRTAB);
+       i < sectionOffset; i++) {
+    fputc(0, output);
   }
+  fwrite(sections, sizeof(Elf32_Shdr), ELF_SECTIONS, output);
+
+  free(symbols);
+  free(names);
+}
 
-  // put all ldr addresses > 0xFF at the end of the file
-  while (!isEmptyVector(addresses)) {
-    char *address = getFront(&addresses);
-    instructions[PC] = getExpression(address, NULL, 0);
-    free(address);
-    PC++;
+void writeDebugInfo(FILE *output, asmResult *result, const char *source) {
+  fprintf(output, "# asm debug\n");
+  fprintf(output, "source %s\n", source);
+  for (mapNode *node = result->symbols.head; node; node = node->next) {
+    fprintf(output, "symbol 0x%08x %s\n", node->value - result->base,
+            node->key);
+  }
+  for (uint32_t i = 0; i < result->size; i++) {
+    if (result->lines[i]) {
+      fprintf(output, "line 0x%08x %u\n", i * MEMORY_SIZE, result->lines[i]);
+    }
   }
+}
 
-  *instructionsNumber = PC;
+void clearObject(objectInfo *object) {
+  for (uint32_t i = 0; i < object->relocCount; i++) {
+    free(object->relocs[i].symbol);
+  }
+  free(object->relocs);
+  object->relocs = NULL;
+  object->relocCount = 0;
+  object->relocCapacity = 0;
+  clearMap(&object->globals);
+  clearMap(&object->externs);
 }
 
 void getComment(vector *tokens) {
   char *token = peekFront(*tokens);
-  if (token[0] == '@' || (token[0] == '/' && token[1] == '/')) {
+  if (token && (token[0] == '@' || (token[0] == '/' && token[1] == '/'))) {
     clearVector(tokens);
   }
 }
 
-uint32_t decode(vector *tokens, vector *addresses, uint32_t instructionNumber,
-                uint32_t instructionsNumber, map labelMapping,
-                vector *errorVector, char *ln) {
-  uint32_t type = *get(ALL_INSTRUCTIONS, peekFront(*tokens));
+uint32_t decode(vector *tokens, uint32_t words[], uint32_t instructionNumber,
+                literalPool *pool, map labelMapping,
+                errorList *errors, char *ln, objectInfo *object) {
+  char name[MAX_LINE_LENGTH], cond[MAX_LINE_LENGTH];
+  splitMnemonic(peekFront(*tokens), name, cond);
+  uint32_t type = *get(ALL_INSTRUCTIONS, name);
   char *token = NULL;
   switch (type) {
-    case 0: return decodeDataProcessing(tokens, errorVector, ln);
-    case 1: return decodeMultiply(tokens, errorVector, ln);
-    case 2: return decodeSingleDataTransfer(tokens, addresses,
-                        instructionNumber, instructionsNumber, errorVector, ln);
+    case 0: return decodeDataProcessing(tokens, errors, ln);
+    case 1: return decodeMultiply(tokens, errors, ln);
+    case 2: return decodeSingleDataTransfer(tokens, words,
+                        instructionNumber, pool, labelMapping,
+                        errors, ln, object);
     case 3: return decodeBranch(tokens, instructionNumber,
-                                      labelMapping, errorVector, ln);
-    case 4: return decodeShift(tokens, errorVector, ln);
-    case 5: // andeq r0,r0,r0 we just free 4 times
-            free(getFront(tokens));
-            free(getFront(tokens));
-            free(getFront(tokens));
-            free(getFront(tokens));
-            return 0;
+                                labelMapping, errors, ln, object);
+    case 4: return decodeShift(tokens, errors, ln);
+    case 5: return decodeBlockDataTransfer(tokens, errors, ln);
+    case 7: return decodeDivide(tokens, errors, ln);
+    case 8: return decodeAtomic(tokens, errors, ln);
     case 6: token = getFront(tokens); // SVC instruction
             free(token);
             token = getFront(tokens);
             int res = 0;
             if (token[0] != '#') {
               printf("invalid SVC operand\n");
-              throwExpressionError(token, errorVector, ln);
-            } else if (token[1] == '0' && token[2] == 'x') {
-              res = getHex(token + 1);
+              throwExpressionError(token, errors, ln);
             } else {
-              res = getDec(token + 1);
+              res = getBoundedExpression(token, 0, MAX_SVC, "svc number",
+                                         errors, ln);
             }
             free(token);
             return 0xef000000 | res;
@@ -613,14 +3479,16 @@ uint32_t decode(vector *tokens, vector *addresses, uint32_t instructionNumber,
   }
 }
 
-uint32_t decodeDataProcessing(vector *tokens, vector *errorVector, char *ln) {
+uint32_t decodeDataProcessing(vector *tokens, errorList *errors, char *ln) {
   char *instruction = getFront(tokens);
+  char name[MAX_LINE_LENGTH], cond[MAX_LINE_LENGTH];
+  splitMnemonic(instruction, name, cond);
   uint32_t ins = 0;
-  uint32_t opcode = *get(DATA_OPCODE, instruction) << 0x15;
-  setCond(&ins, ALWAYS_CONDITION);
+  uint32_t opcode = *get(DATA_OPCODE, name) << 0x15;
+  setCond(&ins, cond);
   // set opcode
   ins |= opcode;
-  uint32_t dataType = *get(DATA_TYPE, instruction);
+  uint32_t dataType = *get(DATA_TYPE, name);
   /*
     dataType
     0 instructions that compute results and, eor, sub, rsb, add, orr
@@ -634,7 +3502,7 @@ uint32_t decodeDataProcessing(vector *tokens, vector *errorVector, char *ln) {
   char *token;
   if (dataType != 2) {
     // we have either 0, 1 type instruction
-    if (checkReg(tokens, instruction, errorVector, ln)) {
+    if (checkReg(tokens, instruction, errors, ln)) {
       token = getFront(tokens);
       rd = getDec(token + 1) << 0xC;
       free(token);
@@ -643,7 +3511,7 @@ uint32_t decodeDataProcessing(vector *tokens, vector *errorVector, char *ln) {
 
   if (dataType != 1) {
     // we have either 0, 2 type instruction
-    if (checkReg(tokens, instruction, errorVector, ln)) {
+    if (checkReg(tokens, instruction, errors, ln)) {
       token = getFront(tokens);
       rn = getDec(token + 1) << 0x10;
       free(token);
@@ -655,14 +3523,14 @@ uint32_t decodeDataProcessing(vector *tokens, vector *errorVector, char *ln) {
       getType(token) != EXPRESSION_EQUAL &&
             getType(token) != REGISTER) {
     // throw expression error
-    throwExpressionError(token, errorVector, ln);
+    throwExpressionError(token, errors, ln);
     free(instruction);
     return -1;
   }
 
   if (getType(token) == EXPRESSION_TAG || getType(token) == EXPRESSION_EQUAL) {
     // decode expression and set bit i to 1
-    operand2 = getExpression(token, errorVector, ln);
+    operand2 = getExpression(token, errors, ln);
     i = 1;
   } else {
     // we have a register
@@ -670,16 +3538,17 @@ uint32_t decodeDataProcessing(vector *tokens, vector *errorVector, char *ln) {
   }
   free(getFront(tokens));
 
-  if (dataType == 2) {
+  if (dataType == 2 || name[3] == 's') {
     // we have third type of instruction
     // with syntax <opcode> Rn, <Operand2>
+    // or an s suffixed instruction such as adds
     // set S bit to 1
     ins |= 0x1 << 0x14;
   }
 
   token = peekFront(*tokens);
   if (isShift(token)) {
-    getShift(tokens, &operand2, errorVector, ln);
+    getShift(tokens, &operand2, errors, ln);
   }
 
   // set bit I
@@ -696,77 +3565,133 @@ uint32_t decodeDataProcessing(vector *tokens, vector *errorVector, char *ln) {
   return ins;
 }
 
-uint32_t decodeMultiply(vector *tokens, vector *errorVector, char *ln) {
+uint32_t decodeMultiply(vector *tokens, errorList *errors, char *ln) {
   char *multType = (char *) getFront(tokens);
-  // set bits 4-7, same for mul and mla
+  char name[MAX_LINE_LENGTH], cond[MAX_LINE_LENGTH];
+  splitMnemonic(multType, name, cond);
+  // set bits 4-7, same for all multiplies
   uint32_t instr = 0x9 << 0x4;
   // set cond
-  setCond(&instr, ALWAYS_CONDITION);
-
-  uint32_t acc = 0;
-  uint32_t rd = 0;
-  uint32_t rm = 0;
-  uint32_t rs = 0;
-  uint32_t rn = 0;
+  setCond(&instr, cond);
 
-  // "mul"/"mla" set common registers (rd, rm, rs)
-  if(checkReg(tokens, multType, errorVector, ln)) {
-    char *token = (char *) getFront(tokens);
-    rd = getDec(token + 1) << 0x10;
-    free(token);
+  // muls, umulls... set the N and Z flags
+  size_t length = strlen(name);
+  uint32_t setFlags = name[length - 1] == 's';
+  if (setFlags) {
+    name[length - 1] = '\0';
+  }
+  bool isLong = name[0] == 'u' || name[0] == 's';
+  bool accumulate = !strcmp(name, "mla") || !strcmp(name + 1, "mlal");
+
+  // mul rd, rm, rs and mla rd, rm, rs, rn
+  // umull/smull/umlal/smlal rdlo, rdhi, rm, rs
+  uint32_t regs[4] = {0, 0, 0, 0};
+  int count = isLong || accumulate ? 4 : 3;
+  for (int i = 0; i < count; i++) {
+    if(checkReg(tokens, multType, errors, ln)) {
+      char *token = (char *) getFront(tokens);
+      regs[i] = getDec(token + 1);
+      free(token);
+    }
   }
 
-  if(checkReg(tokens, multType, errorVector, ln)) {
-    char *token = (char *) getFront(tokens);
-    rm = getDec(token + 1);
-    free(token);
+  if (isLong) {
+    // set bit 23 (Long), bit 22 (Signed) and rdlo, rdhi, rm and rs
+    instr |= 0x1 << 0x17;
+    instr |= (name[0] == 's') << 0x16;
+    instr |= regs[0] << 0xC | regs[1] << 0x10 | regs[2] | regs[3] << 0x8;
+  } else {
+    // set rd, rm, rs and rn
+    instr |= regs[0] << 0x10 | regs[1] | regs[2] << 0x8 | regs[3] << 0xC;
   }
+  // set bit 21 (Accumulator) and bit 20 (Set condition codes)
+  instr |= accumulate << 0x15;
+  instr |= setFlags << 0x14;
 
-  if(checkReg(tokens, multType, errorVector, ln)) {
-    char *token = (char *) getFront(tokens);
-    rs = getDec(token + 1) << 0x8;
-    free(token);
+  free(multType);
+
+  return instr;
+}
+
+uint32_t decodeDivide(vector *tokens, errorList *errors, char *ln) {
+  char *instruction = (char *) getFront(tokens);
+  char name[MAX_LINE_LENGTH], cond[MAX_LINE_LENGTH];
+  splitMnemonic(instruction, name, cond);
+  // sdiv is 0111 0001, udiv 0111 0011, then rd 1111 rm 0001 rn
+  uint32_t instr = !strcmp(name, "udiv") ? 0x0730F010 : 0x0710F010;
+  setCond(&instr, cond);
+
+  uint32_t regs[3] = {0, 0, 0};
+  for (int i = 0; i < 3; i++) {
+    if(checkReg(tokens, instruction, errors, ln)) {
+      char *token = (char *) getFront(tokens);
+      regs[i] = getDec(token + 1);
+      free(token);
+    }
   }
+  instr |= regs[0] << 0x10 | regs[1] | regs[2] << 0x8;
+
+  free(instruction);
 
- // "mla" instr case
-  if(!strcmp(multType, "mla")) {
-    //set bit 21 (Accumulator)
-    acc = 0x1 << 0x15;
+  return instr;
+}
 
-    if(checkReg(tokens, multType, errorVector, ln)) {
+uint32_t decodeAtomic(vector *tokens, errorList *errors, char *ln) {
+  char *instruction = (char *) getFront(tokens);
+  char name[MAX_LINE_LENGTH], cond[MAX_LINE_LENGTH];
+  splitMnemonic(instruction, name, cond);
+  // swp is 0001 0B00, ldrex 0001 1001 and strex 0001 1000, then rn rd and
+  // 0000 1001 rm for swp, 1111 1001 1111 for ldrex, 1111 1001 rm for strex
+  bool load = !strcmp(name, "ldrex");
+  uint32_t instr = load ? 0x01900F9F
+                   : !strcmp(name, "strex") ? 0x01800F90
+                   : 0x01000090 | !strcmp(name, "swpb") << 0x16;
+  setCond(&instr, cond);
+
+  uint32_t regs[2] = {0, 0};
+  for (int i = 0; i < (load ? 1 : 2); i++) {
+    if(checkReg(tokens, instruction, errors, ln)) {
       char *token = (char *) getFront(tokens);
-      rn = getDec(token + 1) << 0xC;
+      regs[i] = getDec(token + 1);
       free(token);
     }
   }
 
-  // set acc
-  instr |= acc;
-  // set rd
-  instr |= rd;
-  // set rm
-  instr |= rm;
-  // set rs
-  instr |= rs;
-  // set rn
-  instr |= rn;
+  // the address is only a register, [rn]
+  char *token = (char *) getFront(tokens);
+  char base[MAX_LINE_LENGTH] = "";
+  size_t length = token ? strlen(token) : 0;
+  if (length > 2 && length < MAX_LINE_LENGTH && token[0] == '[' &&
+      token[length - 1] == ']') {
+    strncpy(base, token + 1, length - 2);
+    base[length - 2] = '\0';
+  }
+  if (!token) {
+    throwExpressionMissingError(instruction, errors, ln);
+  } else if (!isRegister(base)) {
+    throwRegisterError(token, errors, ln);
+  } else {
+    instr |= getDec(base + 1) << 0x10;
+  }
+  free(token);
+  instr |= regs[0] << 0xC | regs[1];
 
-  free(multType);
+  free(instruction);
 
   return instr;
 }
 
 // helper function to check if incoming token is a valid register
 bool checkReg(vector *tokens, char *instr,
-                vector *errorVector, char *ln) {
+                errorList *errors, char *ln) {
   char *reg = (char *) peekFront(*tokens);
   if(!reg || getType(reg) == INSTRUCTION) {
-    throwExpressionMissingError(instr, errorVector, ln);
+    throwExpressionMissingError(instr, errors, ln);
     return false;
   }
 
   if (getType(reg) != REGISTER) {
-    throwRegisterError(reg, errorVector, ln);
+    throwRegisterError(reg, errors, ln);
     free(getFront(tokens));
     return false;
   }
@@ -792,7 +3717,7 @@ bool checkReg(vector *tokens, char *instr,
 
  */
 void getBracketExpr(vector *tokens, int *rn, int32_t *offset, int *i, int *u, int *p, int *w,
-                    vector *errorVector, char *ln) {
+                    errorList *errors, char *ln) {
   char *token;
   int tokenSize = 0;
   *w = 0; // default is dont write back to rn
@@ -878,18 +3803,14 @@ void getBracketExpr(vector *tokens, int *rn, int32_t *offset, int *i, int *u, in
       token++;
       fixtoken = 1;
     }
-    if (token[0] == '#' && token[1] == '-') { // ldr r0, [r1, #-4]
-      token[1] = '#';
-      token++;
-      *u = 0; // subtract from base, gusty
-      fixtoken = 1;
-    }
 
     if (DEBUG) {
     printf("GUSTY HERE: %s\n", token);
     }
     if (getType(token) == EXPRESSION_TAG) {
-      *offset = getExpression(token, NULL, 0);
+      // ldr r0, [r1, #-4], a negative offset subtracts from the base
+      *offset = getBoundedExpression(token, -OFFSET_RANGE, OFFSET_RANGE,
+                                     "offset", errors, ln);
     } else if (getType(token) == REGISTER) {
       if (DEBUG) {
       printf("GUSTY HERE\n");
@@ -909,7 +3830,7 @@ void getBracketExpr(vector *tokens, int *rn, int32_t *offset, int *i, int *u, in
   }
   if (isShift(token)) {
     uint32_t aux = *offset;
-    getShift(&bracketExpr, &aux, errorVector, ln);
+    getShift(&bracketExpr, &aux, errors, ln);
     if (DEBUG) {
     printf("shift: %d\n", aux); // gusty
     }
@@ -920,11 +3841,14 @@ void getBracketExpr(vector *tokens, int *rn, int32_t *offset, int *i, int *u, in
 /* Process ldr/str instructions - two formats
    1. ldr r0,[] - has a bracket expression
    2. ldr r0,=label - has an =label
-
+   ldrb/strb move the low byte of rd and set bit b 22. ldrh/strh move the
+   low halfword with the halfword encoding, which takes an 8-bit immediate
+   split into bits 8-11 and 0-3 or an unshifted register.
  */
-uint32_t decodeSingleDataTransfer(vector *tokens, vector *addresses,
-                uint32_t instructionNumber, uint32_t instructionsNumber,
-                vector *errorVector, char *ln) {
+uint32_t decodeSingleDataTransfer(vector *tokens, uint32_t words[],
+                uint32_t instructionNumber, literalPool *pool,
+                map labelMapping, errorList *errors, char *ln,
+                objectInfo *object) {
   char *instruction = getFront(tokens);
   char *rdName;
   uint32_t ins = 1 << 0x1A;
@@ -932,15 +3856,19 @@ uint32_t decodeSingleDataTransfer(vector *tokens, vector *addresses,
   int p = 1; // 0 is post (x++ or x--), 1 is pre (++x or --x)
   int u = 1; // 0 is down (sub), 1 is up (add)
   int w = 0; // 0 is not write back to rn, 1 is write back to rn
-  int l = !strcmp(instruction, "ldr") ? 1 : 0; // 0 is str, 1 is ldr
+  char name[MAX_LINE_LENGTH], cond[MAX_LINE_LENGTH];
+  splitMnemonic(instruction, name, cond);
+  int l = name[0] == 'l' ? 1 : 0; // 0 is str, 1 is ldr
+  int b = name[3] == 'b' ? 1 : 0; // 0 is word, 1 is byte
+  int half = name[3] == 'h';
   int32_t offset = 0;
   int rn = 0xf; // default rn - base register
   int rd = 0;   // destination register LDR rd, [rb]
   char *token;
 
-  setCond(&ins, ALWAYS_CONDITION);
+  setCond(&ins, cond);
 
-  if (checkReg(tokens, instruction, errorVector, ln)) { // get rd of LDR rd, [rb]
+  if (checkReg(tokens, instruction, errors, ln)) { // get rd of LDR rd, [rb]
     token = getFront(tokens);
     rd = getDec(token + 1);
     rdName = token;
@@ -953,7 +3881,7 @@ uint32_t decodeSingleDataTransfer(vector *tokens, vector *addresses,
   token = peekFront(*tokens);
   if (token && token[0] == '[') {
     // we have indexed address
-    getBracketExpr(tokens, &rn, &offset, &i, &u, &p, &w, errorVector, ln);
+    getBracketExpr(tokens, &rn, &offset, &i, &u, &p, &w, errors, ln);
 
     if (DEBUG) {
     printf("decodeSingle after getBracketExp\n");
@@ -977,10 +3905,6 @@ uint32_t decodeSingleDataTransfer(vector *tokens, vector *addresses,
         u = 0;
         free(token);
         token = getFront(tokens);
-      } else if (token[0] == '#' && token[1] == '-') { // change #-8 to #8
-        token++;
-        token[0] = '#';
-        u = 0;
       }
 
       if (DEBUG) {
@@ -990,16 +3914,11 @@ uint32_t decodeSingleDataTransfer(vector *tokens, vector *addresses,
 
       if (getType(token) == EXPRESSION_TAG) { // we have post indexed expression
         token = getFront(tokens);
-        if (u == 0) { // we modified peeked token - see previous if statement
-          token++;
-          token[0] = '#';
-        }
-        offset = getExpression(token, NULL, 0);
+        offset = getBoundedExpression(token, -OFFSET_RANGE, OFFSET_RANGE,
+                                      "offset", errors, ln);
         if (DEBUG) {
         printf("post indexed expression: token: %s, offset: %d\n", token, offset);
         }
-        if (u == 0) // we modified token, restore it before free
-          token--;
         free(token);
         p = 0;
         w = 1;
@@ -1014,7 +3933,7 @@ uint32_t decodeSingleDataTransfer(vector *tokens, vector *addresses,
         token = peekFront(*tokens);
         if (isShift(token)) {
           uint32_t aux = offset;
-          getShift(tokens, &aux, errorVector, ln);
+          getShift(tokens, &aux, errors, ln);
           offset = aux;
         }
       }
@@ -1024,41 +3943,95 @@ uint32_t decodeSingleDataTransfer(vector *tokens, vector *addresses,
       offset = abs(offset);
       u = 0;
     }
-  } else { // ldr r5, =0x20200000
-    p = 1; // pre inc/dec, add offset to the PC ldr r0, [ps, offset]
-    if (getType(token) != EXPRESSION_EQUAL) {
-      throwExpressionError(instruction, errorVector, ln);
-      free(rdName);
-      free(instruction);
-      return -1;
+  } else if (getType(token) != EXPRESSION_EQUAL) {
+    throwExpressionError(instruction, errors, ln);
+    free(rdName);
+    free(instruction);
+    return -1;
+  } else if (l && !b && !half) { // ldr r5, =0x20200000
+    expressionValue value = {0, "", true};
+    // instructionSize made the same choice between a literal and
+    // synthesising the value, addresses always go to the pool
+    bool valid = evaluateExpression(token + 1, &value, errors, ln);
+    if (valid && !value.labelled) {
+      char *key = literalKey(token);
+      uint32_t *uses = get(pool->uses, key);
+      uint32_t synthesised[2];
+      uint32_t count = synthesiseConstant(value.value, uses ? *uses : 1, rd,
+                                          synthesised);
+      free(key);
+      if (count) {
+        // the value is built by instructions, no literal is needed
+        setCond(&synthesised[0], cond);
+        if (count == 2) {
+          setCond(&synthesised[1], cond);
+          words[instructionNumber + 1] = synthesised[1];
+        }
+        free(getFront(tokens));
+        free(rdName);
+        free(instruction);
+        return synthesised[0];
+      }
     }
 
-    if (!strcmp(instruction, "ldr")) {
-      // we have a load instruction
-      if (getType(token) == EXPRESSION_EQUAL) {
-        uint32_t address = getExpression(token, errorVector, ln);
-
-        if (address <= 0xFF) {
-          // interpret as move instruction
-          putFront(tokens, rdName);
-          putFront(tokens, "mov");
-          free(rdName);
-          free(instruction);
-          return decodeDataProcessing(tokens, errorVector, ln);
-        } else {
-          // interpret as normal
-          putBack(addresses, token);
-          int addressLocation = instructionsNumber + addresses->size - 1;
-          offset = (addressLocation - instructionNumber - 2) * MEMORY_SIZE;
-        }
+    uint32_t *slot = get(pool->slots, ln);
+    if (slot) {
+      // ldr r0, =label loads the address of the label from the literal
+      // pool, the linker patches the literal once the label is placed
+      words[*slot / MEMORY_SIZE] = value.value;
+      if (valid && value.symbol[0]) {
+        addRelocation(object, *slot, RELOC_ABS32, value.symbol);
       }
-      free(getFront(tokens));
+      offset = (int32_t) *slot -
+               (int32_t) (instructionNumber + PC_OFFSET) * MEMORY_SIZE;
+      if (offset < 0) {
+        // ldr from the data section reaches back into the pool
+        offset = -offset;
+        u = 0;
+      }
+      if (offset > LITERAL_RANGE) {
+        throwRangeError(token, errors, ln);
+        offset = 0;
+      }
+    }
+    free(getFront(tokens));
+  } else {
+    // str, ldrb and ldrh can't take a literal
+    throwExpressionError(instruction, errors, ln);
+    free(rdName);
+    free(instruction);
+    return -1;
+  }
+
+  if (half) {
+    if (i && offset > 0xF) {
+      // the halfword encoding has no room for a shift
+      throwExpressionError(instruction, errors, ln);
+      offset &= 0xF;
+    } else if (!i && offset > HALF_OFFSET_RANGE) {
+      char expression[MAX_LINE_LENGTH];
+      snprintf(expression, MAX_LINE_LENGTH, "#%d", offset);
+      throwOutOfRangeError("offset", expression, errors, ln);
+      offset = 0;
     }
+    ins = (ins & 0xF0000000) | 0xB0; // bits 27-25 are 000, bits 7-4 1011
+    ins |= p << 0x18;
+    ins |= u << 0x17;
+    ins |= !i << 0x16; // set bit 22, imm=1, reg=0
+    ins |= w << 0x15;
+    ins |= l << 0x14;
+    ins |= rn << 0x10;
+    ins |= rd << 0xC;
+    ins |= (offset & 0xF0) << 4 | (offset & 0xF);
+    free(rdName);
+    free(instruction);
+    return ins;
   }
 
   ins |= i << 0x19; // set bit i 25, reg=1, imm=0
   ins |= p << 0x18; // set bit p 24, post=1, pre=0
   ins |= u << 0x17; // set bit u 23, sub=0, add=1
+  ins |= b << 0x16; // set bit b 22, word=0, byte=1
   ins |= w << 0x15; // set bit w 21, dont write back=0, write back=1
   ins |= l << 0x14; // set bit l 20, str=0, ldr=1
   ins |= rn << 0x10; // set rn
@@ -1070,8 +4043,145 @@ uint32_t decodeSingleDataTransfer(vector *tokens, vector *addresses,
   return ins;
 }
 
+uint32_t decodeBlockDataTransfer(vector *tokens, errorList *errors, char *ln) {
+  char *instruction = getFront(tokens);
+  char name[MAX_LINE_LENGTH], cond[MAX_LINE_LENGTH];
+  splitMnemonic(instruction, name, cond);
+  uint32_t mode = *get(BLOCK_MODES, name);
+  uint32_t ins = 0x4 << 0x19; // bits 27-25 are 100
+  setCond(&ins, cond);
+
+  // push and pop always write the stack pointer back
+  int rn = STACK_REGISTER;
+  int w = 1;
+  if (strcmp(name, "push") && strcmp(name, "pop")) {
+    char *token = peekFront(*tokens);
+    if (!token || getType(token) == INSTRUCTION) {
+      throwExpressionMissingError(instruction, errors, ln);
+      free(instruction);
+      return -1;
+    }
+
+    token = getFront(tokens);
+    size_t length = strlen(token);
+    w = token[length - 1] == '!';
+    if (w) {
+      token[length - 1] = '\0';
+    }
+    if (!isRegister(token) || getDec(token + 1) > PC_REGISTER) {
+      throwRegisterError(token, errors, ln);
+      free(token);
+      free(instruction);
+      return -1;
+    }
+    rn = getDec(token + 1);
+    free(token);
+  }
+
+  uint32_t list = decodeRegisterList(tokens, instruction, errors, ln);
+  free(instruction);
+  if (!list) {
+    return -1;
+  }
+
+  ins |= (mode & BLOCK_BEFORE ? 1 : 0) << 0x18; // set bit p 24
+  ins |= (mode & BLOCK_UP ? 1 : 0) << 0x17;     // set bit u 23
+  ins |= w << 0x15;                             // set bit w 21
+  ins |= (mode & BLOCK_LOAD ? 1 : 0) << 0x14;   // set bit l 20
+  ins |= rn << 0x10;                            // set rn
+  ins |= list;                                  // set the register list
+  return ins;
+}
+
+uint32_t decodeRegisterList(vector *tokens, char *instruction,
+                            errorList *errors, char *ln) {
+  char *token = peekFront(*tokens);
+  if (!token || getType(token) == INSTRUCTION) {
+    throwExpressionMissingError(instruction, errors, ln);
+    return 0;
+  }
+  if (token[0] != '{') {
+    throwExpressionError(token, errors, ln);
+    free(getFront(tokens));
+    return 0;
+  }
+
+  uint32_t list = 0;
+  bool valid = true, closed = false;
+  while (!closed && !isEmptyVector(*tokens)) {
+    token = getFront(tokens);
+    closed = token[strlen(token) - 1] == '}';
+    if (valid && !addListRegisters(token, &list)) {
+      throwRegisterError(token, errors, ln);
+      valid = false;
+    }
+    free(token);
+  }
+
+  if (valid && (!closed || !list)) {
+    throwExpressionMissingError(instruction, errors, ln);
+    valid = false;
+  }
+  return valid ? list : 0;
+}
+
+bool addListRegisters(char *element, uint32_t *list) {
+  char registers[MAX_LINE_LENGTH];
+  strncpy(registers, element + (element[0] == '{'), MAX_LINE_LENGTH - 1);
+  registers[MAX_LINE_LENGTH - 1] = '\0';
+  size_t length = strlen(registers);
+  if (length && registers[length - 1] == '}') {
+    registers[--length] = '\0';
+  }
+  if (!length) {
+    // the blank of { r4 } or {r4 }
+    return true;
+  }
+
+  char *last = strchr(registers, '-');
+  if (last) {
+    *last++ = '\0';
+  } else {
+    last = registers;
+  }
+  if (!isRegister(registers) || !isRegister(last)) {
+    return false;
+  }
+
+  int from = getDec(registers + 1), to = getDec(last + 1);
+  if (from > to || to > PC_REGISTER) {
+    return false;
+  }
+  for (int r = from; r <= to; r++) {
+    *list |= 1 << r;
+  }
+  return true;
+}
+
+bool loadsPc(vector tokens) {
+  char name[MAX_LINE_LENGTH], cond[MAX_LINE_LENGTH];
+  uint32_t *mode = NULL;
+  if (tokens.first && splitMnemonic(tokens.first->value, name, cond)) {
+    mode = get(BLOCK_MODES, name);
+  }
+  if (!mode || !(*mode & BLOCK_LOAD)) {
+    return false;
+  }
+
+  uint32_t list = 0;
+  bool inList = false;
+  for (vectorNode *node = tokens.first->next; node; node = node->next) {
+    inList = inList || node->value[0] == '{';
+    if (inList) {
+      addListRegisters(node->value, &list);
+    }
+  }
+  return list & 1 << PC_REGISTER;
+}
+
 uint32_t decodeBranch(vector *tokens, uint32_t instructionNumber,
-                        map labelMapping, vector *errorVector, char *ln) {
+                        map labelMapping, errorList *errors, char *ln,
+                        objectInfo *object) {
   char *branch = getFront(tokens);
   if (DEBUG) {
   printf("branch 0: branch: %s, %lu, %c, %c\n", branch, strlen(branch), branch[0], branch[1]);
@@ -1095,19 +4205,29 @@ uint32_t decodeBranch(vector *tokens, uint32_t instructionNumber,
   char *expression = (char *) peekFront(*tokens);
 
   if (!expression || getType(expression) == INSTRUCTION) {
-    throwExpressionMissingError(branch, errorVector, ln);
+    throwExpressionMissingError(branch, errors, ln);
     free(branch);
     return -1;
   }
 
   if ((mem = get(labelMapping, expression))) {
     // we have a mapping
-    target = *mem - instructionNumber - PC_OFFSET;
+    target = (int32_t) *mem / MEMORY_SIZE - instructionNumber - PC_OFFSET;
     target <<= INSTRUCTION_SIZE - (BRANCH_OFFSET_SIZE - 2);
     target >>= INSTRUCTION_SIZE - (BRANCH_OFFSET_SIZE - 2);
-  } 
-  else {
-    printf("no mapping for target of Branch.");
+    if ((*mem < object->dataBase * MEMORY_SIZE) !=
+        (instructionNumber < object->dataBase)) {
+      // the linker may move the sections apart
+      addRelocation(object, instructionNumber * MEMORY_SIZE, RELOC_BRANCH24,
+                    expression);
+    }
+  } else if (get(object->externs, expression)) {
+    // resolved by the linker
+    addRelocation(object, instructionNumber * MEMORY_SIZE, RELOC_BRANCH24,
+                  expression);
+    target = 0;
+  } else {
+    throwSymbolError(expression, "is not defined", errors, ln);
     target = 0;
   }
 
@@ -1118,11 +4238,11 @@ uint32_t decodeBranch(vector *tokens, uint32_t instructionNumber,
   return ins;
 }
 
-uint32_t decodeShift(vector *tokens, vector *errorVector, char *ln) {
+uint32_t decodeShift(vector *tokens, errorList *errors, char *ln) {
   char *shift = getFront(tokens);
   char *rn = NULL;
 
-  if (checkReg(tokens, shift, errorVector, ln)) {
+  if (checkReg(tokens, shift, errors, ln)) {
     rn = getFront(tokens);
   }
 
@@ -1131,20 +4251,24 @@ uint32_t decodeShift(vector *tokens, vector *errorVector, char *ln) {
     return -1;
   }
 
-  // fill front of tokens with mov Rn, Rn, lsl <#expression>
-  putFront(tokens, shift);
+  // fill front of tokens with mov<cond> Rn, Rn, lsl <#expression>
+  char name[MAX_LINE_LENGTH], cond[MAX_LINE_LENGTH];
+  splitMnemonic(shift, name, cond);
+  char mov[MAX_LINE_LENGTH] = "mov";
+  strcat(mov, cond);
+  putFront(tokens, name);
   putFront(tokens, rn);
   putFront(tokens, rn);
-  putFront(tokens, "mov");
+  putFront(tokens, mov);
 
   free(shift);
   free(rn);
 
-  return decodeDataProcessing(tokens, errorVector, ln);
+  return decodeDataProcessing(tokens, errors, ln);
 }
 
 void getShift(vector *tokens, uint32_t *operand,
-                vector *errorVector, char *ln) {
+                errorList *errors, char *ln) {
   char *shift = getFront(tokens);
   char *token = peekFront(*tokens);
 
@@ -1154,7 +4278,8 @@ void getShift(vector *tokens, uint32_t *operand,
 
   if (getType(token) == EXPRESSION_TAG) {
     // we have expression
-    *operand |= getExpression(token, errorVector, ln) << 0x7;
+    *operand |= getBoundedExpression(token, 0, MAX_SHIFT, "shift", errors,
+                                     ln) << 0x7;
   } else {
     // we have register
     *operand |= getDec(token + 1) << 0x8;
@@ -1233,49 +4358,49 @@ bool isLabel(char *token) {
 }
 
 typeEnum isExpression(char *token) {
-  if (!strlen(token)) {
+  if ((token[0] != '#' && token[0] != '=') || !token[1]) {
     return UNDEFINED;
   }
 
-  if (token[0] != '#' && token[0] != '=') {
-    return UNDEFINED;
-  }
+  // the expression itself is checked when it is evaluated
+  return token[0] == '#' ? EXPRESSION_TAG : EXPRESSION_EQUAL;
+}
 
-  int i = 1;
-  if (token[i] == '-') {
-    i++;
-  }
+bool isDirective(char *token) {
+  return token[0] == '.' && get(DIRECTIVES, token);
+}
 
-  if (strlen(token) >= i + 3 && token[i] == '0' &&token[i + 1] == 'x') {
-    // we might have a hex value
-    i += 2;
+bool isInstruction(char *token) {
+  char name[MAX_LINE_LENGTH], cond[MAX_LINE_LENGTH];
+  return splitMnemonic(token, name, cond);
+}
 
-    for (; token[i] != '\0'; i++) {
-      if ((token[i] < '0' || token[i] > '9') &&
-          (token[i] < 'a' || token[i] > 'f') &&
-          (token[i] < 'A' || token[i] > 'F')) {
-        return UNDEFINED;
-      }
-    }
-  } else {
-    // we might have a decimal value
+bool splitMnemonic(char *token, char *name, char *cond) {
+  size_t length = strlen(token);
+  strcpy(cond, ALWAYS_CONDITION);
+  if (length >= MAX_LINE_LENGTH) {
+    return false;
+  }
 
-    if (token[i] == '\0') {
-      return UNDEFINED;
-    }
+  strcpy(name, token);
+  if (get(ALL_INSTRUCTIONS, token)) {
+    return true;
+  }
 
-    for (int i = 1; token[i] != '\0'; i++) {
-      if (token[i] < '0' || token[i] > '9') {
-        return UNDEFINED;
-      }
-    }
+  if (length <= 2 || !get(CONDITIONS, token + length - 2)) {
+    return false;
   }
 
-  return token[0] == '#' ? EXPRESSION_TAG : EXPRESSION_EQUAL;
-}
+  // branches list their conditions in ALL_INSTRUCTIONS, svc has none
+  name[length - 2] = '\0';
+  uint32_t *type = get(ALL_INSTRUCTIONS, name);
+  if (!type || *type == 3 || *type == 6) {
+    strcpy(name, token);
+    return false;
+  }
 
-bool isInstruction(char *token) {
-  return get(ALL_INSTRUCTIONS, token);
+  strcpy(cond, token + length - 2);
+  return true;
 }
 
 bool isShift(char *token) {
@@ -1303,6 +4428,10 @@ typeEnum getType(char *token) {
     return INSTRUCTION;
   }
 
+  if (isDirective(token)) {
+    return DIRECTIVE;
+  }
+
   if (isRegister(token)) {
     return REGISTER;
   }
@@ -1310,49 +4439,212 @@ typeEnum getType(char *token) {
   return UNDEFINED;
 }
 
-// BUG: returns positivee in *exp for #-4
-int32_t getExpression(char *exp, vector *errorVector, char *ln) {
-  uint32_t res = 0;
-  uint32_t rotations = 0;
+int32_t getExpression(char *exp, errorList *errors, char *ln) {
+  expressionValue result;
+  if (!evaluateExpression(exp + 1, &result, errors, ln)) {
+    return -1;
+  }
+
+  uint32_t operand = result.value;
+  if (exp[0] == '#' && !encodeImmediate(result.value, &operand)) {
+    // not an 8 bit value rotated right by an even amount
+    throwOutOfRangeError("immediate", exp, errors, ln);
+    return -1;
+  }
 
-  int i = 1, neg = 0;
+  return operand;
+}
 
-  if (exp[i] == '-') {
-    i++;
-    neg = 1;
+int32_t getBoundedExpression(char *exp, int32_t min, int32_t max, char *kind,
+                             errorList *errors, char *ln) {
+  expressionValue result;
+  if (!evaluateExpression(exp + 1, &result, errors, ln)) {
+    return 0;
   }
 
-  if (exp[i] == '0' && exp[i + 1] == 'x') {
-    res = getHex(exp + 1);
-  } else {
-    res = getDec(exp + 1);
+  int32_t value = result.value;
+  if (value < min || value > max) {
+    throwOutOfRangeError(kind, exp, errors, ln);
+    return 0;
+  }
+
+  return value;
+}
+
+// ---------------------EXPRESSIONS----------------------------
+/* Binary operators from the lowest to the highest precedence */
+static const char *OPERATORS[OPERATOR_LEVELS][2] = {
+  {"|", NULL}, {"&", NULL}, {"<<", ">>"}, {"+", "-"}, {"*", "/"}
+};
+
+bool evaluateExpression(char *text, expressionValue *result,
+                        errorList *errors, char *ln) {
+  expressionParser parser = {text, ""};
+  bool valid = parseOperators(&parser, 0, result) && !*parser.position;
+
+  if (parser.undefined[0]) {
+    throwSymbolError(parser.undefined, "is not defined", errors, ln);
+    return false;
+  }
+  if (!valid) {
+    throwExpressionError(text, errors, ln);
+  }
+  return valid;
+}
+
+bool parseOperators(expressionParser *parser, int level,
+                    expressionValue *left) {
+  if (level == OPERATOR_LEVELS) {
+    return parseOperand(parser, left);
+  }
+  if (!parseOperators(parser, level + 1, left)) {
+    return false;
   }
 
-  if (exp[0] == '#') {
-    // check if exp can be roatated to a 8 bit imediate value
-    //while (abs(res) >= 0x100 && rotations <= 30) { - original line had abs(res) - res is uint
-    while (res >= 0x100 && rotations <= 30) {
-      char bits31_30 = (res & 0xC0000000) >> (INSTRUCTION_SIZE - 2);
-      res <<= 2;
-      res |= bits31_30;
-      rotations += 2;
+  while (true) {
+    const char *operator = NULL;
+    for (int i = 0; i < 2 && !operator; i++) {
+      const char *candidate = OPERATORS[level][i];
+      if (candidate &&
+          !strncmp(parser->position, candidate, strlen(candidate))) {
+        operator = candidate;
+      }
+    }
+    if (!operator) {
+      return true;
     }
 
-    if (rotations > 30) {
-      // throw an error
-      // number can't be represented
-      printf("HERE\n");
-      throwExpressionError(exp, errorVector, ln);
-      return -1;
+    // operators of a level associate to the left
+    expressionValue right;
+    parser->position += strlen(operator);
+    if (!parseOperators(parser, level + 1, &right) ||
+        !applyOperator(operator, left, &right)) {
+      return false;
+    }
+  }
+}
+
+bool parseOperand(expressionParser *parser, expressionValue *operand) {
+  char c = *parser->position;
+  operand->value = 0;
+  operand->symbol[0] = '\0';
+  operand->labelled = false;
+
+  if (c == '-' || c == '~' || c == '+') {
+    parser->position++;
+    if (!parseOperand(parser, operand)) {
+      return false;
+    }
+    if (c != '+') {
+      operand->value = c == '-' ? -operand->value : ~operand->value;
+      operand->symbol[0] = '\0';
+    }
+    return true;
+  }
+
+  if (c == '(') {
+    parser->position++;
+    if (!parseOperators(parser, 0, operand) || *parser->position != ')') {
+      return false;
+    }
+    parser->position++;
+    return true;
+  }
+
+  if (isdigit(c)) {
+    bool hex = c == '0' && tolower(parser->position[1]) == 'x';
+    char *end;
+    unsigned long long value = strtoull(parser->position, &end, hex ? 16 : 10);
+    parser->position = end;
+    operand->value = value;
+    // values must fit a word
+    return value <= UINT32_MAX;
+  }
+
+  if (isalpha(c) || c == '_' || c == '.') {
+    char name[MAX_LINE_LENGTH];
+    int length = 0;
+    while (isalnum(parser->position[length]) ||
+           parser->position[length] == '_' ||
+           parser->position[length] == '.') {
+      name[length] = parser->position[length];
+      length++;
     }
+    name[length] = '\0';
+    parser->position += length;
+    resolveSymbol(parser, name, operand);
+    return true;
+  }
+
+  return false;
+}
+
+void resolveSymbol(expressionParser *parser, char *name,
+                   expressionValue *operand) {
+  uint32_t *value = get(SYMBOLS.equates, name);
+  if (value) {
+    operand->value = *value;
+    return;
+  }
+
+  operand->labelled = true;
+  strcpy(operand->symbol, name);
+  if (!SYMBOLS.labels) {
+    // the first pass has not placed the labels yet
+    return;
+  }
 
-    res |= ((rotations / 2) << 0x8);
+  uint32_t *offset = get(*SYMBOLS.labels, name);
+  if (offset) {
+    operand->value = SYMBOLS.object->base + *offset;
+  } else if (!get(SYMBOLS.object->externs, name) && !parser->undefined[0]) {
+    strcpy(parser->undefined, name);
   }
+}
 
-  if (neg)
-    res = -res;
+bool applyOperator(const char *operator, expressionValue *left,
+                   expressionValue *right) {
+  uint32_t a = left->value;
+  uint32_t b = right->value;
+
+  switch (operator[0]) {
+    case '+': left->value = a + b;
+              break;
+    case '-': left->value = a - b;
+              break;
+    case '*': left->value = a * b;
+              break;
+    case '/': if (!b) {
+                return false;
+              }
+              // signed, -1 is special cased as INT32_MIN / -1 overflows
+              left->value = (int32_t) b == -1 ? -a
+                            : (uint32_t) ((int32_t) a / (int32_t) b);
+              break;
+    case '<': left->value = b < INSTRUCTION_SIZE ? a << b : 0;
+              break;
+    case '>': left->value = b < INSTRUCTION_SIZE ? a >> b : 0;
+              break;
+    case '&': left->value = a & b;
+              break;
+    case '|': left->value = a | b;
+              break;
+  }
 
-  return res;
+  // label + constant and label - constant stay relative to the label, the
+  // difference of two labels is a constant, anything else is only correct
+  // for the address the image is assembled for
+  if (operator[0] == '+') {
+    if (!left->symbol[0]) {
+      strcpy(left->symbol, right->symbol);
+    } else if (right->symbol[0]) {
+      left->symbol[0] = '\0';
+    }
+  } else if (operator[0] != '-' || right->symbol[0]) {
+    left->symbol[0] = '\0';
+  }
+  left->labelled = left->labelled || right->labelled;
+  return true;
 }
 
 int32_t getHex(char *exp) {
@@ -1404,67 +4696,109 @@ char *uintToString(uint32_t num) {
   return ret;
 }
 
-void clearLinesFromFile(char **linesFromFile) {
-  for(int i = 0; i < (countDynamicExpansions * NUMBER_OF_LINES); i++) {
+void clearLinesFromFile(char **linesFromFile, uint32_t lineCount) {
+  for(int i = 0; i < lineCount; i++) {
     free(linesFromFile[i]);
   }
   free(linesFromFile);
 }
 
 // ----------------------ERRORS--------------------------------
-void throwUndefinedError(char *name, vector *errorVector, char *ln) {
-  char *error = malloc(200);
-  strcpy(error, "[");
-  strcat(error, ln);
-  strcat(error, "] Undefined instruction ");
-  strcat(error, name);
-  strcat(error, ".");
-  putBack(errorVector, error);
-  free(error);
-}
-
-void throwLabelError(char *name, vector *errorVector, char *ln) {
-  char *error = malloc(200);
-  strcpy(error, "[");
-  strcat(error, ln);
-  strcat(error, "] Multiple definitions of the same label: ");
-  strcat(error, name);
-  strcat(error, ".");
-  putBack(errorVector, error);
-  free(error);
-}
-
-void throwExpressionError(char *name, vector *errorVector, char *ln) {
-  char *error = malloc(200);
-  strcpy(error, "[");
-  strcat(error, ln);
-  strcat(error, "] The expression ");
-  strcat(error, name);
-  strcat(error, " is invalid.");
-  putBack(errorVector, error);
-  free(error);
-}
-
-void throwRegisterError(char *name, vector *errorVector, char *ln) {
-  char *error = malloc(200);
-  strcpy(error, "[");
-  strcat(error, ln);
-  strcat(error, "] The register ");
-  strcat(error, name);
-  strcat(error, " is invalid.");
-  putBack(errorVector, error);
-  free(error);
-}
-
-void throwExpressionMissingError(char *ins, vector *errorVector, char *ln) {
-  char *error = malloc(200);
-  strcpy(error, "[");
-  strcat(error, ln);
-  strcat(error, "] The expression is missing from the ");
-  strcat(error, ins);
-  strcat(error, " instruction.");
-  putBack(errorVector, error);
-  free(error);
+void addError(errorList *errors, errorEnum kind, char *ln, char *message) {
+  if (!errors) {
+    // caller only wants the value, not the diagnostics
+    return;
+  }
+
+  if (errors->size == errors->capacity) {
+    errors->capacity = errors->capacity ? 2 * errors->capacity : 8;
+    errors->errors = realloc(errors->errors,
+                             errors->capacity * sizeof(asmError));
+    if (!errors->errors) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  asmError *error = &errors->errors[errors->size++];
+  error->line = ln ? atoi(ln) : 0;
+  error->kind = kind;
+  strncpy(error->message, message, ASM_ERROR_LENGTH - 1);
+  error->message[ASM_ERROR_LENGTH - 1] = '\0';
+}
+
+void throwUndefinedError(char *name, errorList *errors, char *ln) {
+  char error[ASM_ERROR_LENGTH];
+  snprintf(error, ASM_ERROR_LENGTH, "Undefined instruction %s.", name);
+  addError(errors, UNDEFINED_ERROR, ln, error);
+}
+
+void throwLabelError(char *name, errorList *errors, char *ln) {
+  char error[ASM_ERROR_LENGTH];
+  snprintf(error, ASM_ERROR_LENGTH,
+           "Multiple definitions of the same label: %s.", name);
+  addError(errors, LABEL_ERROR, ln, error);
+}
+
+void throwExpressionError(char *name, errorList *errors, char *ln) {
+  char error[ASM_ERROR_LENGTH];
+  snprintf(error, ASM_ERROR_LENGTH, "The expression %s is invalid.", name);
+  addError(errors, EXPRESSION_ERROR, ln, error);
+}
+
+void throwRegisterError(char *name, errorList *errors, char *ln) {
+  char error[ASM_ERROR_LENGTH];
+  snprintf(error, ASM_ERROR_LENGTH, "The register %s is invalid.", name);
+  addError(errors, REGISTER_ERROR, ln, error);
+}
+
+void throwExpressionMissingError(char *ins, errorList *errors, char *ln) {
+  char error[ASM_ERROR_LENGTH];
+  snprintf(error, ASM_ERROR_LENGTH,
+           "The expression is missing from the %s instruction.", ins);
+  addError(errors, EXPRESSION_MISSING_ERROR, ln, error);
+}
+
+void throwSymbolError(char *name, char *reason, errorList *errors, char *ln) {
+  char error[ASM_ERROR_LENGTH];
+  snprintf(error, ASM_ERROR_LENGTH, "The symbol %s %s.", name, reason);
+  addError(errors, SYMBOL_ERROR, ln, error);
+}
+
+void throwRangeError(char *literal, errorList *errors, char *ln) {
+  char error[ASM_ERROR_LENGTH];
+  snprintf(error, ASM_ERROR_LENGTH,
+           "The literal %s is out of range, place a .ltorg closer to it.",
+           literal);
+  addError(errors, EXPRESSION_ERROR, ln, error);
+}
+
+void throwOutOfRangeError(char *kind, char *expression, errorList *errors,
+                          char *ln) {
+  char error[ASM_ERROR_LENGTH];
+  snprintf(error, ASM_ERROR_LENGTH, "The %s %s is out of range.", kind,
+           expression);
+  addError(errors, EXPRESSION_ERROR, ln, error);
+}
+
+void throwRepeatError(char *directive, char *reason, errorList *errors,
+                      char *ln) {
+  char error[ASM_ERROR_LENGTH];
+  snprintf(error, ASM_ERROR_LENGTH, "The %s %s.", directive, reason);
+  addError(errors, REPEAT_ERROR, ln, error);
+}
+
+void throwProfileError(char *filename, errorList *errors) {
+  char error[ASM_ERROR_LENGTH];
+  snprintf(error, ASM_ERROR_LENGTH, "The profile %s can't be read.", filename);
+  addError(errors, PROFILE_ERROR, NULL, error);
+}
+
+void throwCostError(char *filename, errorList *errors) {
+  char error[ASM_ERROR_LENGTH];
+  snprintf(error, ASM_ERROR_LENGTH, "The cost table %s can't be read.",
+           filename);
+  addError(errors, COST_ERROR, NULL, error);
 }
 
 // -----------------------DEBUGGING---------------------------
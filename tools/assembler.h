@@ -0,0 +1,170 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include "adts.h"
+#include "object.h"
+
+/**
+ * Library interface of the assembler, used by the asm command line tool and
+ * by the as/a commands of emu.
+ *
+ *   asmResult result;
+ *   if (assembleSource(source, 0x100, NULL, NULL, &result)) {
+ *     // result.words[0 .. result.size) is the image for address 0x100
+ *   } else {
+ *     printAsmErrors(stderr, &result);
+ *   }
+ *   clearAsmResult(&result);
+ */
+
+#define ASM_ERROR_LENGTH 200
+
+/**
+ * Kinds of errors the assembler reports
+ */
+typedef enum {UNDEFINED_ERROR, LABEL_ERROR, EXPRESSION_ERROR, REGISTER_ERROR,
+              EXPRESSION_MISSING_ERROR, SYMBOL_ERROR, PROFILE_ERROR,
+              REPEAT_ERROR, COST_ERROR} errorEnum;
+
+typedef struct asmError asmError;
+typedef struct errorList errorList;
+typedef struct relocEntry relocEntry;
+typedef struct objectInfo objectInfo;
+typedef struct asmResult asmResult;
+typedef struct asmOptions asmOptions;
+
+/* An error found while assembling, line is the 1-based source line */
+struct asmError {
+  uint32_t  line;
+  errorEnum kind;
+  char      message[ASM_ERROR_LENGTH];
+};
+
+struct errorList {
+  asmError *errors;
+  uint32_t size;
+  uint32_t capacity;
+};
+
+/**
+ * A relocation recorded during the second pass, the symbol is kept by name
+ * and only turned into a symbol table index when the object is written
+ */
+struct relocEntry {
+  uint32_t offset;
+  uint32_t type;
+  char     *symbol;
+};
+
+/**
+ * Section layout, symbol bindings and relocations of the assembled program.
+ * globals and externs map each declared name to the line declaring it.
+ */
+struct objectInfo {
+  map        globals;
+  map        externs;
+  relocEntry *relocs;
+  uint32_t   relocCount;
+  uint32_t   relocCapacity;
+  uint32_t   textSize; // words of instructions and literal pool
+  uint32_t   dataSize; // words placed in the data section
+  uint32_t   dataBase; // word offset of the data section in the image
+  uint32_t   base;     // byte address the image is loaded at
+};
+
+/**
+ * The output of one assembly
+ * words   - size words of the image, valid when errors is empty
+ * base    - byte address the image was assembled to be loaded at
+ * symbols - every label defined in the source mapped to its byte address
+ * lines   - source line of each of the size words, 0 for literal pools, data
+ *           and every word once the blocks were laid out by a profile
+ */
+struct asmResult {
+  uint32_t   *words;
+  uint32_t   *lines;
+  uint32_t   size;
+  uint32_t   base;
+  map        symbols;
+  errorList  errors;
+  objectInfo object;
+};
+
+/**
+ * Optional behaviour of an assembly, a NULL options pointer selects the
+ * defaults (all zero)
+ * optimise - run the peephole and if-conversion pass over the source before
+ *            assembling it
+ * profile  - profile written by the pr command of emu, the blocks of every
+ *            function are reordered by it so the hot paths fall through. It
+ *            must come from this source assembled with the same options
+ *            (may be NULL)
+ * report   - receives a "[line] change" line for every change the passes
+ *            make (may be NULL)
+ * listing  - receives every assembled line with the address, encoding and
+ *            estimated cycles of each of its instructions, followed by the
+ *            cycles of every labelled block and of one iteration of every
+ *            loop (may be NULL)
+ * costs    - table of "class cycles" lines replacing some of the default
+ *            cycles of the listing, the classes are data, shift, multiply,
+ *            divide, transfer, register, branch and svc (may be NULL)
+ */
+struct asmOptions {
+  bool       optimise;
+  const char *profile;
+  FILE       *report;
+  FILE       *listing;
+  const char *costs;
+};
+
+/**
+* Assembles the null terminated source for an image loaded at byte address
+* base. predefined may map further names to byte addresses, they are used
+* for labels the source references but does not define (may be NULL).
+* Returns true iff there were no errors. result must always be cleared with
+* clearAsmResult.
+**/
+bool assembleSource(const char *source, uint32_t base, map *predefined,
+                    const asmOptions *options, asmResult *result);
+
+/* Frees everything held by result */
+void clearAsmResult(asmResult *result);
+
+/* Prints every error of result as "[line] message" */
+void printAsmErrors(FILE *stream, asmResult *result);
+
+/* Writes the image with its symbol and relocation tables (see object.h) */
+void writeObject(FILE *output, asmResult *result);
+
+/**
+* Writes the image as an ELF32 ARM executable: a loadable segment for the
+* text and one for the data, if there is any, placed at their addresses, and
+* a symbol table with every label. Execution starts at the label _start, or
+* at the base address if there is none.
+**/
+void writeElf(FILE *output, asmResult *result);
+
+/**
+* Writes the debug sidecar of the image assembled from the file source, for
+* emu to name addresses. Addresses are hex byte offsets into the image.
+*   # asm debug
+*   source code.s
+*   symbol 0x00000010 main     - one line for every label
+*   line 0x00000010 12         - source line of the instruction at 0x10
+**/
+void writeDebugInfo(FILE *output, asmResult *result, const char *source);
+
+/**
+* Returns the cycles the cost listing of asm -l estimates for the instruction
+* word, with the default cycles of every class. The first call sets them up,
+* it must not run alongside other calls.
+**/
+uint32_t estimateCycles(uint32_t word);
+
+/**
+* Returns the contents of the file on the heap, null terminated
+* Returns NULL if the file can't be read
+**/
+char *readSourceFile(const char *filename);
+
+#endif
@@ -40,10 +40,8 @@ halt:
 // r0 has address of int array
 // r1 has num of elements in array
 largest:
-    sub r13, r13, #20   // space for largest, i, r4, r5, and lr
-    str r4, [r13, #8]   // save r4 on stack
-    str r5, [r13, #12]  // save r5 on stack
-    str r14, [r13, #16] // save lr on stack
+    push {r4, r5, r14}  // save r4, r5 and lr on stack
+    sub r13, r13, #8    // space for largest and i
     ldr r2, [r0]
     str r2, [r13, #0]   // int largest = a[0]
     mov r4, r0          // put address of a in r4
@@ -61,8 +59,6 @@ skip:
     cmp r3, r1          // for( ; i < size; )
     blt loop            // continue looping until i >= size
     mov r0, r2          // place largest in r0
-    ldr r4, [r13, #8]   // restore r4
-    ldr r5, [r13, #12]  // restore r5
-    ldr r14, [r13, #16] // restore lr
-    mov r15, r14        // return to caller
+    add r13, r13, #8    // free largest and i
+    pop {r4, r5, r15}   // restore r4 and r5, return to caller
     
@@ -4,11 +4,19 @@
 #include <assert.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <ctype.h>
 #include <getopt.h>
 #include <time.h> 
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <pthread.h>
+#include <sched.h>
+#include "assembler.h"
 
 #define NDEBUG
 
@@ -28,8 +36,27 @@
 #define STACK_ADDR 0x4000
 #define MEM_DUMP_LEN 8
 
+/*
+ Heap layout of os.s, a boundary tag allocator. The word at HEAP_ADDR holds
+ top, the start of the space never handed out, the HEAP_LISTS words after it
+ the heads of the free lists: lists 0-7 hold the free blocks of 16, 24, ... 72
+ bytes, the last one all larger free blocks. Every block has a header and a
+ footer word holding its size, bit 0 set while it is allocated, a free block
+ keeps the next and previous block of its list in its first two payload words.
+ */
+#define HEAP_LISTS 9
+#define HEAP_START (HEAP_ADDR + 4 + HEAP_LISTS * 4)
+#define HEAP_END   0x3000
+#define HEAP_SMALL 72
+
+// Define the bytes os.s printf formats at most
+#define PRINTF_SIZE 128
+
 // Define maximum arguments for an emu command
-#define MAXARGS 10
+#define MAXARGS 20
+
+// Define the number of source files debug info can name
+#define MAX_DEBUG_SOURCES 16
 
 // Define GPIO macros
 #define GPIO20_29_ADDRESS 0x20200008
@@ -38,6 +65,94 @@
 #define GPIO_OUTPUT_OFF   0x20200028
 #define GPIO_OUTPUT_ON    0x2020001C
 
+// Define DMA macros, the registers of the DMA engine follow the GPIO ones
+#define DMA_SOURCE      0x20200040
+#define DMA_DESTINATION 0x20200044
+#define DMA_LENGTH      0x20200048 // bytes
+#define DMA_CONTROL     0x2020004C // a write of a DMA_ mode starts a transfer
+#define DMA_STATUS      0x20200050
+#define DMA_FILL        0x20200054 // the byte of DMA_FILL_MODE
+#define DMA_COPY_MODE   1
+#define DMA_FILL_MODE   2
+#define DMA_DONE        1 // status bits
+#define DMA_ERROR       2
+
+// Define block device macros, its registers follow the DMA ones
+#define BLOCK_SECTOR   0x20200060 // the first sector of a transfer
+#define BLOCK_COUNT    0x20200064 // sectors
+#define BLOCK_ADDRESS  0x20200068 // where in memory
+#define BLOCK_COMMAND  0x2020006C // a write of a BLOCK_ command starts a transfer
+#define BLOCK_STATUS   0x20200070 // 0 while busy, then BLOCK_DONE or BLOCK_ERROR
+#define BLOCK_CAPACITY 0x20200074 // sectors of the device
+#define BLOCK_READ     1
+#define BLOCK_WRITE    2
+#define BLOCK_DONE     1
+#define BLOCK_ERROR    2
+#define SECTOR_SIZE    512
+
+// Define timer macros, its registers follow the block device ones
+#define TIMER_LOAD    0x20200080 // instructions between ticks, a write restarts the count
+#define TIMER_VALUE   0x20200084 // instructions left until the next tick
+#define TIMER_CONTROL 0x20200088 // TIMER_ENABLE starts the timer
+#define TIMER_TICKS   0x2020008C // ticks since emu started
+#define TIMER_ENABLE  1
+
+// Define interrupt controller macros, its registers follow the timer ones
+#define IRQ_PENDING 0x20200090 // the sources asking, a write of 1s clears them
+#define IRQ_ENABLE  0x20200094 // the sources that interrupt
+#define IRQ_VECTOR  0x20200098 // where an interrupt enters the OS, 0 for none
+#define IRQ_RETURN  0x2020009C // where the interrupted code resumes
+#define IRQ_FLAGS   0x202000A0 // its NZCV, restored on the return to user mode
+#define IRQ_TIMER   1 // sources
+#define IRQ_DMA     2
+#define IRQ_BLOCK   4
+
+// Define multi-core macros, the core registers follow the interrupt ones
+#define CORE_ID    0x202000A4 // the core reading it, 0 is the one emu starts
+#define CORE_COUNT 0x202000A8 // cores of the machine, see emu -n
+#define CORE_START 0x202000AC // a write starts every stopped core there
+#define MAX_CORES  4
+#define CORE_STACK 0x400 // bytes of stack of each core, below STACK_ADDR
+#define QUANTUM    1000  // instructions a core runs between the checks of go
+
+// Define performance counter macros, the counters are those of the core
+// reading them and follow the core registers, only the control is written
+#define PERF_CONTROL      0x202000C0 // a write of PERF_ bits
+#define PERF_INSTRUCTIONS 0x202000C4 // retired
+#define PERF_CYCLES       0x202000C8 // by the cost model of asm -l
+#define PERF_BRANCHES     0x202000CC // taken b and bl
+#define PERF_FLUSHES      0x202000D0 // pipeline refills
+#define PERF_LOADS        0x202000D4 // registers loaded from memory
+#define PERF_STORES       0x202000D8 // registers stored to memory
+#define PERF_SVCS         0x202000DC
+#define PERF_RESET        1 // zeroes the counters
+#define PERF_FREEZE       2 // the counters stop while it is set
+
+// Define console macros
+#define CONSOLE_SIZE  8192 // bytes of guest output buffered, of queued input
+#define CONSOLE_VALUE 100  // longest input value
+
+/*
+ The performance counters of a core, see perfWrite. They count 32 bits and
+ wrap around.
+ */
+struct perf_counters {
+  uint32_t instructions;
+  uint32_t cycles;
+  uint32_t branches;
+  uint32_t flushes;
+  uint32_t loads;
+  uint32_t stores;
+  uint32_t svcs;
+  int control;
+};
+
+typedef struct perf_counters perf_counters_t;
+
+/*
+ A core, all cores share memory. exclusive is the address the last ldrex
+ loaded exclusiveValue from, -1 once a strex, svc or interrupt cleared it.
+ */
 struct proc_state {
   int NEG; // N flag
   int ZER; // Z flag
@@ -45,10 +160,15 @@ struct proc_state {
   int OVF; // V flag
   int SVC; // kernel mode when 1
   int PC;
+  int core;
+  int running; // 0 until CORE_START starts the core, core 0 always runs
+  int exclusive;
+  int exclusiveValue;
+  perf_counters_t perf;
   int prev_regs[NUMBER_REGS];
   int regs[NUMBER_REGS];
   int prev_memory[OS_ADDR];
-  int memory[MEM_SIZE_WORDS];
+  int *memory; // MEM_SIZE_WORDS words
 };
 
 typedef struct proc_state proc_state_t;
@@ -61,6 +181,181 @@ struct pipeline {
 
 typedef struct pipeline pipeline_t;
 
+/*
+ A taken branch, svc or write to PC, from and to are byte addresses
+ */
+struct profile_edge {
+  int from;
+  int to;
+  uint32_t count;
+};
+
+typedef struct profile_edge profile_edge_t;
+
+/*
+ An OS service emulated natively, see executeSvc
+ */
+struct hle_service {
+  int service;
+  const char *name;
+  void (*handler)(proc_state_t *pState);
+  uint32_t calls;
+};
+
+typedef struct hle_service hle_service_t;
+
+/*
+ The memory mapped DMA engine, see dmaWrite. transfers and bytes count the
+ completed transfers since emu started.
+ */
+struct dma_engine {
+  int source;
+  int destination;
+  int length;
+  int control;
+  int status;
+  int fill;
+  uint32_t transfers;
+  uint64_t bytes;
+};
+
+typedef struct dma_engine dma_engine_t;
+
+/*
+ The block device, the file -b names mapped into emu, see blockStart.
+ capacity is its size in sectors, reads and writes count the sectors moved.
+ */
+struct block_device {
+  const char *filename;
+  uint8_t *data;
+  int capacity;
+  int sector;
+  int count;
+  int address;
+  int command;
+  int status;
+  uint64_t reads;
+  uint64_t writes;
+};
+
+typedef struct block_device block_device_t;
+
+/*
+ The timer, counting down the instructions emu retires, see timerTick
+ */
+struct timer_device {
+  int load;
+  int value;
+  int control;
+  uint32_t ticks;
+};
+
+typedef struct timer_device timer_device_t;
+
+/*
+ The interrupt controller, see takeInterrupt. ret and flags are the banked
+ return state of the interrupted code, restore is set while its flags are
+ still to come back. taken counts the interrupts since emu started.
+ */
+struct interrupt_controller {
+  int pending;
+  int enable;
+  int vector;
+  int ret;
+  int flags;
+  bool restore;
+  uint32_t taken;
+};
+
+typedef struct interrupt_controller interrupt_controller_t;
+
+/*
+ Execution profile of everything stepped since emu started or the last prc.
+ profile_counts holds the number of times each word was executed.
+ */
+static uint32_t profile_counts[MEM_SIZE_WORDS];
+static profile_edge_t *profile_edges = NULL;
+static int profile_edge_count = 0;
+static int profile_edge_capacity = 0;
+
+/*
+ State of the gpio pins, kept across stores.
+ gpio_physical[0...2] is the representation of mem[0x2020 0000...0x2020 0008]
+ and holds control bits for each pin in the intervals 0-9, 10-19, 20-29 resp.
+ gpio_output_on_off holds two addresses:
+   0 |-> 0x2020 0028 OFF
+   1 |-> 0x2020 001C ON
+ */
+static int gpio_physical[3];
+static int gpio_output_on_off[2];
+
+/*
+ Names of the code, from its .dbg sidecar (see loadDebugInfo) or the as
+ command. symbols maps labels to byte addresses, debug_lines holds the source
+ line of each word, 0 if unknown, and debug_files the index of its source file
+ in debug_sources.
+ */
+static map symbols = {NULL, 0};
+static uint32_t debug_lines[MEM_SIZE_WORDS];
+static uint8_t debug_files[MEM_SIZE_WORDS];
+static char *debug_sources[MAX_DEBUG_SOURCES];
+static int debug_source_count = 0;
+
+/*
+ Where svc enters the OS, the entry point of an ELF OS image
+ */
+static int os_entry = OS_ADDR;
+
+/*
+ With hle on, svc runs the services of hle_services natively (see executeSvc)
+ */
+static bool hle_enabled = false;
+
+static dma_engine_t dma = {0, 0, 0, 0, 0, 0, 0, 0};
+static block_device_t block = {NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0};
+static timer_device_t timer = {0, 0, 0, 0};
+static interrupt_controller_t irq = {0, 0, 0, 0, 0, false, 0};
+
+/*
+ The cores of emu -n. Commands act on core_states[current_core], go runs
+ them all, on a host thread each unless deterministic is set (emu -d).
+ kernel_core is the core in kernel mode, -1 if there is none, kernel mode
+ is one core at a time. device_lock serialises the memory mapped devices
+ and the hle services while more than one core runs.
+ */
+static proc_state_t *core_states = NULL;
+static pipeline_t *core_pipelines = NULL;
+static int core_count = 1;
+static int current_core = 0;
+static bool deterministic = false;
+static int kernel_core = -1;
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ The cycles of the instruction at each word address, by estimateCycles, the
+ instruction in the high word and its cycles plus 1 in the low one, so 0 is
+ an empty entry. Each entry is one atomic word, the cores share them.
+ */
+static uint64_t cycle_cache[MEM_SIZE_WORDS];
+
+/*
+ The console behind IO_INT_ADDRESS and IO_STR_ADDRESS. Guest output collects
+ in console_out and goes to console_file (stdout if NULL) in bulk, when the
+ buffer fills and before emu prints anything of its own, see consoleFlush.
+ Guest input takes the values queued by the in command first, null separated
+ in console_queue, then whitespace separated values from console_input (stdin
+ if NULL). Every value the guest reads is also logged to console_record, one
+ per line, so that reading the log with -i replays the run.
+ */
+static char console_out[CONSOLE_SIZE];
+static int console_used = 0;
+static FILE *console_file = NULL;
+static FILE *console_input = NULL;
+static FILE *console_record = NULL;
+static char console_queue[CONSOLE_SIZE];
+static int console_queued = 0;
+static int console_next = 0;
+
 /*
  opcodes and condcodes are used by disassemble.
  */
@@ -78,7 +373,7 @@ void disassemble(int inst) { // prints disassembled instruction to stdout
   int i = inst >> 25 & 1;
   int p = inst >> 24 & 1;
   int u = inst >> 23 & 1;
-  //int b = inst >> 22 & 1;
+  int b = inst >> 22 & 1;
   int w = inst >> 21 & 1;
   int l = inst >> 20 & 1;
   int rn = inst >> 16 & 0xf;
@@ -100,22 +395,61 @@ void disassemble(int inst) { // prints disassembled instruction to stdout
   int boff = inst & 0xffffff;
   int mulop1 = inst >> 22 & 0x3f;
   int mulop2 = inst >> 4 & 0xf;
-  if (mulop1 == 0 && mulop2 == 9) { // mul
+  if ((mulop1 == 0 || mulop1 >> 1 == 1) && mulop2 == 9) { // mul, mla, umull...
     int mrd = inst >> 16 & 0xf;
-    //int mrn = inst >> 12 & 0xf;
+    int mrn = inst >> 12 & 0xf;
     int mrs = inst >> 8 & 0xf;
     int mrm = inst & 0xf;
-    printf("mul");
+    int macc = inst >> 21 & 1;
+    if (mulop1)
+      printf("%s%s", inst >> 22 & 1 ? "s" : "u", macc ? "mlal" : "mull");
+    else
+      printf(macc ? "mla" : "mul");
     if (cond <= 13)
       printf("%s", condcodes[cond]);
     if (s)
       printf("s");
-    printf(" r%d, r%d, r%d", mrd, mrm, mrs);
+    if (mulop1) // rdlo, rdhi
+      printf(" r%d, r%d, r%d, r%d", mrn, mrd, mrm, mrs);
+    else {
+      printf(" r%d, r%d, r%d", mrd, mrm, mrs);
+      if (macc)
+        printf(", r%d", mrn);
+    }
+  } else if ((inst & 0x0f0000f0) == 0x01000090) { // swp, ldrex, strex
+    printf("%s", inst >> 23 & 1 ? (l ? "ldrex" : "strex") : b ? "swpb" : "swp");
+    if (cond <= 13)
+      printf("%s", condcodes[cond]);
+    if (inst >> 23 & 1 && l)
+      printf(" r%d, [r%d]", rd, rn);
+    else
+      printf(" r%d, r%d, [r%d]", rd, rs, rn);
+  } else if ((inst & 0x0fd0f0f0) == 0x0710f010) { // sdiv/udiv
+    printf("%s", inst >> 21 & 1 ? "udiv" : "sdiv");
+    if (cond <= 13)
+      printf("%s", condcodes[cond]);
+    printf(" r%d, r%d, r%d", inst >> 16 & 0xf, inst & 0xf, inst >> 8 & 0xf);
+  } else if ((inst & 0x0e0000f0) == 0xb0) { // ldrh/strh
+    int himm = (inst >> 4 & 0xf0) | (inst & 0xf);
+    printf("%s", l ? "ldrh" : "strh");
+    if (cond <= 13)
+      printf("%s", condcodes[cond]);
+    printf(" r%d, [r%d", rd, rn);
+    if (!p)
+      printf("]");
+    if (b) // immediate
+      printf(", #%s%d", u ? "" : "-", himm);
+    else
+      printf(", %sr%d", u ? "" : "-", rs);
+    if (p)
+      printf("]%s", w ? "!" : "");
   } else if (zo == 1) { // ldr/str
     if (l)
         printf("ldr");
     else
       printf("str");
+    if (b)
+      printf("b");
     if (cond <= 13)
       printf("%s", condcodes[cond]);
     printf(" ");
@@ -232,6 +566,24 @@ void disassemble(int inst) { // prints disassembled instruction to stdout
       }
     }
     //printf("\n");
+  } else if (zo == 2 && !i) { // ldm/stm, push/pop for the stack forms
+    int list = inst & 0xffff;
+    int stack = rn == INDEX_SP && w && (l ? !p && u : p && !u);
+    if (stack)
+      printf(l ? "pop" : "push");
+    else
+      printf("%s%s%s", l ? "ldm" : "stm", u ? "i" : "d", p ? "b" : "a");
+    if (cond <= 13)
+      printf("%s", condcodes[cond]);
+    if (!stack)
+      printf(" r%d%s,", rn, w ? "!" : "");
+    printf(" {");
+    for (int r = 0, first = 1; r < 16; r++)
+      if (list >> r & 1) {
+        printf("%sr%d", first ? "" : ", ", r);
+        first = 0;
+      }
+    printf("}");
   } else if (zo == 2) { // branch instruction
     printf("b");
     if (bl)
@@ -277,9 +629,10 @@ int executeShift(int contentsRm, int shiftValue, proc_state_t *pState,
       break;
     case 0x2: // arithmetic right
       signBit = contentsRm  & 0x80000000;
+      operand2ThroughShifter = contentsRm;
       for(int i = 0; i < shiftValue; i++) {
-        contentsRm = contentsRm >> 1;
-        contentsRm =  contentsRm | signBit;
+        operand2ThroughShifter = operand2ThroughShifter >> 1;
+        operand2ThroughShifter = operand2ThroughShifter | signBit;
       }
       if(setFlags) {
         // how should carry be set. The original bit or arithmetic shifted bit. I do original.
@@ -294,31 +647,133 @@ int executeShift(int contentsRm, int shiftValue, proc_state_t *pState,
       }
       break;
   }
-  assert(operand2ThroughShifter != -1);
-  return operand2ThroughShifter;
+  return operand2ThroughShifter; // all ones is a valid result, e.g. mov of -1
 }
 
 /*
-  Compute carry bit for two operands
+ A write of PERF_RESET zeroes the counters of the core, one with
+ PERF_FREEZE stops them until a write without it. Both bits at once take a
+ snapshot of 0s. The counters only count the guest, the commands of emu
+ are not in them.
  */
-int getAdditionCarry(int operand1, int operand2) {
-  int msbOp1 = operand1 >> 31;
-  int msbOp2 = operand2 >> 31;
-  int result = operand1 + operand2;
-  int msbResult = result >> 31;
-  if((msbOp1 + msbOp2) != msbResult) {
-    return 1;
-  } else {
-    return 0;
+void perfWrite(proc_state_t *pState, int word) {
+  if (word & PERF_RESET)
+    pState->perf = (perf_counters_t) {0, 0, 0, 0, 0, 0, 0, 0};
+  pState->perf.control = word & PERF_FREEZE;
+}
+
+int perfRead(proc_state_t *pState, int address) {
+  perf_counters_t *perf = &pState->perf;
+  switch (address) {
+    case PERF_CONTROL:      return perf->control;
+    case PERF_INSTRUCTIONS: return perf->instructions;
+    case PERF_CYCLES:       return perf->cycles;
+    case PERF_BRANCHES:     return perf->branches;
+    case PERF_FLUSHES:      return perf->flushes;
+    case PERF_LOADS:        return perf->loads;
+    case PERF_STORES:       return perf->stores;
+    default:                return perf->svcs;
   }
 }
 
+bool perfCounting(proc_state_t *pState) {
+  return !(pState->perf.control & PERF_FREEZE);
+}
+
+/*
+ Counts the instruction word the core retired from address, and the
+ pipeline refill it caused if flushed
+ */
+void perfRetired(proc_state_t *pState, int address, int word, bool flushed) {
+  if (!perfCounting(pState))
+    return;
+  uint64_t *entry = &cycle_cache[(address / 4) & (MEM_SIZE_WORDS - 1)];
+  uint64_t cached = __atomic_load_n(entry, __ATOMIC_RELAXED);
+  if ((uint32_t) cached == 0 || (uint32_t) (cached >> 32) != (uint32_t) word) {
+    cached = (uint64_t) (uint32_t) word << 32 | (estimateCycles(word) + 1);
+    __atomic_store_n(entry, cached, __ATOMIC_RELAXED);
+  }
+  pState->perf.instructions++;
+  pState->perf.cycles += (uint32_t) cached - 1;
+  pState->perf.flushes += flushed;
+}
+
+void printPerf(proc_state_t *pState) {
+  perf_counters_t *perf = &pState->perf;
+  printf("core %d%s: %u instructions, %u cycles, %u branches, %u flushes\n",
+         pState->core, perf->control & PERF_FREEZE ? " frozen" : "",
+         perf->instructions, perf->cycles, perf->branches, perf->flushes);
+  printf("%u loads, %u stores, %u svcs\n", perf->loads, perf->stores,
+         perf->svcs);
+}
+
+void deviceLock(void) {
+  if (core_count > 1)
+    pthread_mutex_lock(&device_lock);
+}
+
+void deviceUnlock(void) {
+  if (core_count > 1)
+    pthread_mutex_unlock(&device_lock);
+}
+
+/*
+ Claims kernel mode for the core, returns false while another core has it
+ */
+bool enterKernel(proc_state_t *pState) {
+  int expected = -1;
+  return __atomic_compare_exchange_n(&kernel_core, &expected, pState->core, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ||
+         expected == pState->core;
+}
+
+/*
+ mov r15 and ldm with r15 in kernel mode return to user mode, with the
+ flags of IRQ_FLAGS if an interrupt or the OS left them to restore
+ */
+void leaveKernel(proc_state_t *pState) {
+  int cpsr = pState->regs[INDEX_CPSR] & ~KERNEL_MODE;
+  pState->SVC = 0;
+  pState->exclusive = -1;
+  __atomic_store_n(&kernel_core, -1, __ATOMIC_SEQ_CST);
+  if (irq.restore) {
+    cpsr = (cpsr & 0x0fffffff) | (irq.flags & 0xf0000000);
+    pState->NEG = cpsr >> 31 & 1;
+    pState->ZER = cpsr >> 30 & 1;
+    pState->CRY = cpsr >> 29 & 1;
+    pState->OVF = cpsr >> 28 & 1;
+    irq.restore = false;
+  }
+  pState->regs[INDEX_CPSR] = cpsr;
+}
+
+/*
+  Compute carry bit for two operands, the carry out of bit 31 of their
+  unsigned sum
+ */
+int getAdditionCarry(int operand1, int operand2) {
+  return (uint32_t) operand1 + (uint32_t) operand2 < (uint32_t) operand1;
+}
+
+/* The overflow bit of operand1 + operand2, the signed sum doesn't fit */
+int getAdditionOverflow(int operand1, int operand2) {
+  uint32_t result = (uint32_t) operand1 + (uint32_t) operand2;
+  return (~(operand1 ^ operand2) & (operand1 ^ result)) >> 31 & 1;
+}
+
+/* The overflow bit of operand1 - operand2, the carry is operand1 >= operand2 unsigned */
+int getSubtractionOverflow(int operand1, int operand2) {
+  uint32_t result = (uint32_t) operand1 - (uint32_t) operand2;
+  return ((operand1 ^ operand2) & (operand1 ^ result)) >> 31 & 1;
+}
+
 /*
   opcode is a data processing instruction
  */
 void executeOperation(proc_state_t *pState, int Rdest, int Rn, int operand2, int S, int opcode) {
   int opResult = -1;
   int carry = -1;
+  int overflow = pState->OVF; // only the arithmetic operations change V
   bool zflag = false;
   switch(opcode) {
     case 0x0: /*AND*/
@@ -334,22 +789,25 @@ void executeOperation(proc_state_t *pState, int Rdest, int Rn, int operand2, int
       carry = 0;
       break;
     case 0x2: /*SUB*/
-      pState->regs[Rdest] = pState->regs[Rn] - operand2;
+      carry = (uint32_t) pState->regs[Rn] >= (uint32_t) operand2;
+      overflow = getSubtractionOverflow(pState->regs[Rn], operand2);
+      pState->regs[Rdest] = (uint32_t) pState->regs[Rn] - (uint32_t) operand2;
       opResult = pState->regs[Rdest];
       zflag = opResult == 0;
-      carry = opResult & 0x80000000 ? 0 : 1;
       break;
     case 0x3: /*RSB*/
-      pState->regs[Rdest] = operand2 - pState->regs[Rn];
+      carry = (uint32_t) operand2 >= (uint32_t) pState->regs[Rn];
+      overflow = getSubtractionOverflow(operand2, pState->regs[Rn]);
+      pState->regs[Rdest] = (uint32_t) operand2 - (uint32_t) pState->regs[Rn];
       opResult = pState->regs[Rdest];
       zflag = opResult == 0;
-      carry = getAdditionCarry(operand2, !(pState->regs[Rn]) + 1);
       break;
     case 0x4: /*ADD*/
-      pState->regs[Rdest] = pState->regs[Rn] + operand2;
+      carry = getAdditionCarry(pState->regs[Rn], operand2);
+      overflow = getAdditionOverflow(pState->regs[Rn], operand2);
+      pState->regs[Rdest] = (uint32_t) pState->regs[Rn] + (uint32_t) operand2;
       opResult = pState->regs[Rdest];
       zflag = opResult == 0;
-      carry = getAdditionCarry(pState->regs[Rn], operand2);
       break;
     case 0x8: /*TST*/
       opResult = pState->regs[Rn] & operand2;
@@ -362,8 +820,9 @@ void executeOperation(proc_state_t *pState, int Rdest, int Rn, int operand2, int
       zflag = opResult == 0;
       break;
     case 0xA: /*CMP*/
-      opResult = pState->regs[Rn] - operand2;
-      carry = opResult & 0x80000000 ? 0 : 1;
+      opResult = (uint32_t) pState->regs[Rn] - (uint32_t) operand2;
+      carry = (uint32_t) pState->regs[Rn] >= (uint32_t) operand2;
+      overflow = getSubtractionOverflow(pState->regs[Rn], operand2);
       zflag = opResult == 0;
       break;
     case 0xC: /*ORR*/
@@ -382,10 +841,20 @@ void executeOperation(proc_state_t *pState, int Rdest, int Rn, int operand2, int
       // svc instruction sets kernel mode and does BL to the OS address
       // OS does a mov PC, LR to return to application
       // If cpsr state is supervisory and mov destination if PC, we return to user mode
-      if (pState->SVC && Rdest == INDEX_PC) { // returned from kernel mode
-        pState->SVC = 0;
-        pState->regs[INDEX_CPSR] = pState->regs[INDEX_CPSR] & ~KERNEL_MODE;
-      }
+      if (pState->SVC && Rdest == INDEX_PC) // returned from kernel mode
+        leaveKernel(pState);
+      break;
+    case 0xE: /*BIC*/
+      pState->regs[Rdest] = pState->regs[Rn] & ~operand2;
+      opResult = pState->regs[Rdest];
+      zflag = opResult == 0;
+      carry = 0;
+      break;
+    case 0xF: /*MVN*/
+      pState->regs[Rdest] = ~operand2;
+      opResult = pState->regs[Rdest];
+      zflag = opResult == 0;
+      carry = 0;
       break;
   }
 
@@ -394,7 +863,8 @@ void executeOperation(proc_state_t *pState, int Rdest, int Rn, int operand2, int
     //ALU ~ C = Cout of bit 31;
     pState->CRY = carry; // C bit
     pState->ZER = zflag ? 1 : 0; // Z bit
-    pState->NEG = opResult >> 31;
+    pState->NEG = opResult >> 31 & 1;
+    pState->OVF = overflow; // V bit
     int modebits = pState->regs[INDEX_CPSR] & 0x1f;
     pState->regs[INDEX_CPSR] = (pState->NEG << 31) | (pState->ZER << 30) |
                                (pState->CRY << 29) | (pState->OVF << 28) | modebits;
@@ -444,8 +914,8 @@ void executeDataProcessing(int instruction, proc_state_t *pState, pipeline_t *pi
      }
      executeOperation(pState, Rdest, Rn, operand2ThroughShifter, S, opcode);
    }
-   if (Rdest == INDEX_PC) { // do a branch
-     pState->PC = pState->regs[Rdest] - 4;
+   if (Rdest == INDEX_PC) { // do a branch, the next fetch is the value
+     pState->PC = pState->regs[Rdest];
      pState->regs[INDEX_PC] = pState->PC;
      pipeline->decoded = -1;
      pipeline->fetched = -1;
@@ -463,8 +933,372 @@ int setByte(int word, int index, int newByte) {
   }
 }
 
+/* Writes the buffered guest output */
+void consoleFlush(void) {
+  if (console_used)
+    fwrite(console_out, 1, console_used, console_file ? console_file : stdout);
+  console_used = 0;
+}
+
+/* Appends guest output, output longer than the buffer is written directly */
+void consoleWrite(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(console_out + console_used, CONSOLE_SIZE - console_used,
+                         format, args);
+  va_end(args);
+  if (length < CONSOLE_SIZE - console_used) {
+    console_used += length;
+    return;
+  }
+  consoleFlush();
+  va_start(args, format);
+  if (length < CONSOLE_SIZE)
+    console_used = vsnprintf(console_out, CONSOLE_SIZE, format, args);
+  else
+    vfprintf(console_file ? console_file : stdout, format, args);
+  va_end(args);
+}
+
+/*
+ Reads the next input value of the guest into value, prompting only when it
+ comes from the terminal. Returns false once the input has ended.
+ */
+bool consoleRead(const char *prompt, char *value, int size) {
+  if (console_next < console_queued) {
+    snprintf(value, size, "%s", console_queue + console_next);
+    console_next += strlen(console_queue + console_next) + 1;
+    if (console_next == console_queued)
+      console_next = console_queued = 0;
+  } else {
+    char format[16];
+    snprintf(format, sizeof(format), "%%%ds", size - 1);
+    if (!console_input) {
+      consoleFlush();
+      printf("%s", prompt);
+      fflush(stdout);
+    }
+    if (fscanf(console_input ? console_input : stdin, format, value) != 1)
+      return false;
+  }
+  if (console_record)
+    fprintf(console_record, "%s\n", value);
+  return true;
+}
+
+/* Reads a decimal number, 0 once the input has ended */
+int consoleReadInt(void) {
+  char value[CONSOLE_VALUE];
+  if (!consoleRead("emu int scanf - enter a number: ", value, sizeof(value)))
+    return 0;
+  return (int) strtol(value, NULL, 10);
+}
+
+/* Opens a file of the console, emu exits if it can't */
+FILE *consoleOpen(const char *filename, const char *mode) {
+  FILE *file = fopen(filename, mode);
+  if (!file) {
+    fprintf(stderr, "Can't open %s\n", filename);
+    exit(EXIT_FAILURE);
+  }
+  return file;
+}
+
+/* Queues value for the guest to read before console_input */
+bool consoleQueue(const char *value) {
+  int length = strlen(value) + 1;
+  if (length > CONSOLE_VALUE || console_queued + length > CONSOLE_SIZE)
+    return false;
+  memcpy(console_queue + console_queued, value, length);
+  console_queued += length;
+  return true;
+}
+
+/*
+ A write to DMA_CONTROL runs the whole transfer at once, a copy of length
+ bytes from source to destination as one memmove, so the regions may
+ overlap, or a fill of length bytes at destination with the low byte of
+ DMA_FILL as one memset. DMA_STATUS then reads DMA_DONE, or DMA_ERROR if a
+ region leaves memory or the mode is unknown, and memory is left as is.
+ Either way the transfer raises IRQ_DMA. The stores show in the memory sss
+ compares like those of str.
+ */
+void dmaStart(proc_state_t *pState) {
+  uint8_t *bytes = (uint8_t *) pState->memory;
+  int limit = MEM_SIZE_WORDS * 4 - dma.length;
+  bool copy = dma.control == DMA_COPY_MODE;
+  dma.status = DMA_ERROR;
+  irq.pending |= IRQ_DMA; // done or failed, the transfer is over on return
+  if ((!copy && dma.control != DMA_FILL_MODE) || dma.length < 0 ||
+      dma.destination < 0 || dma.destination > limit ||
+      (copy && (dma.source < 0 || dma.source > limit)))
+    return;
+  if (copy)
+    memmove(bytes + dma.destination, bytes + dma.source, dma.length);
+  else
+    memset(bytes + dma.destination, dma.fill & 0xff, dma.length);
+  dma.status = DMA_DONE;
+  dma.transfers++;
+  dma.bytes += dma.length;
+}
+
+void dmaWrite(proc_state_t *pState, int address, int word) {
+  switch (address) {
+    case DMA_SOURCE:      dma.source = word; break;
+    case DMA_DESTINATION: dma.destination = word; break;
+    case DMA_LENGTH:      dma.length = word; break;
+    case DMA_STATUS:      dma.status = word; break;
+    case DMA_FILL:        dma.fill = word; break;
+    case DMA_CONTROL:
+      dma.control = word;
+      dmaStart(pState);
+      break;
+  }
+}
+
+int dmaRead(int address) {
+  switch (address) {
+    case DMA_SOURCE:      return dma.source;
+    case DMA_DESTINATION: return dma.destination;
+    case DMA_LENGTH:      return dma.length;
+    case DMA_CONTROL:     return dma.control;
+    case DMA_STATUS:      return dma.status;
+    default:              return dma.fill;
+  }
+}
+
+void printDma(void) {
+  printf("source 0x%.8x destination 0x%.8x length %d\n", dma.source,
+         dma.destination, dma.length);
+  printf("control %d status %d fill 0x%.2x\n", dma.control, dma.status,
+         dma.fill & 0xff);
+  printf("%u transfers, %llu bytes\n", dma.transfers,
+         (unsigned long long) dma.bytes);
+}
+
+/*
+ Maps filename as the block device, its size is cut to whole sectors. The
+ sectors are shared with the file, what the guest writes is in the file once
+ emu exits. emu exits if the file can't be mapped.
+ */
+void blockOpen(const char *filename) {
+  struct stat st;
+  int fd = open(filename, O_RDWR);
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < SECTOR_SIZE) {
+    fprintf(stderr, "Can't use %s as a block device, it needs a sector of %d bytes\n",
+            filename, SECTOR_SIZE);
+    exit(EXIT_FAILURE);
+  }
+  off_t sectors = st.st_size / SECTOR_SIZE;
+  block.capacity = sectors > INT32_MAX ? INT32_MAX : (int) sectors;
+  block.data = mmap(NULL, (size_t) block.capacity * SECTOR_SIZE,
+                    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (block.data == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  block.filename = filename;
+}
+
+void blockClose(void) {
+  if (block.data)
+    munmap(block.data, (size_t) block.capacity * SECTOR_SIZE);
+  block.data = NULL;
+}
+
+/*
+ A write to BLOCK_COMMAND moves count sectors from sector on between the
+ device and memory at address as one memcpy. BLOCK_STATUS reads 0 while the
+ transfer runs, then BLOCK_DONE, or BLOCK_ERROR if the sectors are not on
+ the device, the bytes not in memory or the command is unknown, and raises
+ IRQ_BLOCK.
+ */
+void blockStart(proc_state_t *pState) {
+  int64_t bytes = (int64_t) block.count * SECTOR_SIZE;
+  bool read = block.command == BLOCK_READ;
+  block.status = BLOCK_ERROR;
+  irq.pending |= IRQ_BLOCK;
+  if ((!read && block.command != BLOCK_WRITE) || block.count < 0 ||
+      block.sector < 0 || (int64_t) block.sector + block.count > block.capacity ||
+      block.address < 0 || block.address > MEM_SIZE_WORDS * 4 - bytes)
+    return;
+  block.status = 0;
+  uint8_t *memory = (uint8_t *) pState->memory + block.address;
+  uint8_t *sectors = block.data + (size_t) block.sector * SECTOR_SIZE;
+  if (read) {
+    memcpy(memory, sectors, bytes);
+    block.reads += block.count;
+  } else {
+    memcpy(sectors, memory, bytes);
+    block.writes += block.count;
+  }
+  block.status = BLOCK_DONE;
+}
+
+void blockWrite(proc_state_t *pState, int address, int word) {
+  switch (address) {
+    case BLOCK_SECTOR:  block.sector = word; break;
+    case BLOCK_COUNT:   block.count = word; break;
+    case BLOCK_ADDRESS: block.address = word; break;
+    case BLOCK_STATUS:  block.status = word; break;
+    case BLOCK_COMMAND:
+      block.command = word;
+      blockStart(pState);
+      break;
+  }
+}
+
+int blockRead(int address) {
+  switch (address) {
+    case BLOCK_SECTOR:  return block.sector;
+    case BLOCK_COUNT:   return block.count;
+    case BLOCK_ADDRESS: return block.address;
+    case BLOCK_COMMAND: return block.command;
+    case BLOCK_STATUS:  return block.status;
+    default:            return block.capacity;
+  }
+}
+
+void printBlock(void) {
+  if (!block.data) {
+    printf("no block device, see emu -b\n");
+    return;
+  }
+  printf("%s: %d sectors of %d bytes\n", block.filename, block.capacity,
+         SECTOR_SIZE);
+  printf("sector %d count %d address 0x%.8x command %d status %d\n",
+         block.sector, block.count, block.address, block.command, block.status);
+  printf("%llu sectors read, %llu written\n", (unsigned long long) block.reads,
+         (unsigned long long) block.writes);
+}
+
+/*
+ Counts down one retired instruction. When the count runs out the timer
+ ticks, raising IRQ_TIMER, and starts over from load.
+ */
+void timerTick(void) {
+  if (!(timer.control & TIMER_ENABLE) || timer.load <= 0)
+    return;
+  if (--timer.value <= 0) {
+    timer.value = timer.load;
+    timer.ticks++;
+    irq.pending |= IRQ_TIMER;
+  }
+}
+
+void timerWrite(int address, int word) {
+  switch (address) {
+    case TIMER_LOAD:
+      timer.load = word;
+      timer.value = word;
+      break;
+    case TIMER_VALUE:   timer.value = word; break;
+    case TIMER_CONTROL:
+      timer.control = word;
+      if (timer.value <= 0)
+        timer.value = timer.load;
+      break;
+  }
+}
+
+int timerRead(int address) {
+  switch (address) {
+    case TIMER_LOAD:    return timer.load;
+    case TIMER_VALUE:   return timer.value;
+    case TIMER_CONTROL: return timer.control;
+    default:            return timer.ticks;
+  }
+}
+
+void irqWrite(int address, int word) {
+  switch (address) {
+    case IRQ_PENDING: irq.pending &= ~word; break;
+    case IRQ_ENABLE:  irq.enable = word; break;
+    case IRQ_VECTOR:  irq.vector = word; break;
+    case IRQ_RETURN:  irq.ret = word; break;
+    case IRQ_FLAGS:
+      irq.flags = word;
+      irq.restore = true;
+      break;
+  }
+}
+
+int irqRead(int address) {
+  switch (address) {
+    case IRQ_PENDING: return irq.pending;
+    case IRQ_ENABLE:  return irq.enable;
+    case IRQ_VECTOR:  return irq.vector;
+    case IRQ_RETURN:  return irq.ret;
+    default:          return irq.flags;
+  }
+}
+
+/*
+ An enabled source that is pending interrupts user mode once an instruction
+ retires, like svc it enters kernel mode, but at the vector the OS wrote to
+ IRQ_VECTOR and with every register kept. IRQ_RETURN holds the address the
+ interrupted code resumes at and IRQ_FLAGS its flags, the next return to
+ user mode, mov r15 or ldm with r15, puts the flags back. The OS may write
+ other ones first to resume different code. Kernel mode runs with
+ interrupts off, a source stays pending until the OS clears it. Only core 0
+ takes interrupts, and only while no other core is in kernel mode.
+ Returns true if the interrupt was taken.
+ */
+bool takeInterrupt(proc_state_t *pState, pipeline_t *pipeline) {
+  if (pState->SVC || !irq.vector || !(irq.pending & irq.enable) ||
+      !enterKernel(pState))
+    return false;
+  // a flushed pipeline fetches PC next, otherwise PC-4 is the next instruction
+  irq.ret = pipeline->fetched == -1 ? pState->PC : pState->PC - 4;
+  irq.flags = pState->regs[INDEX_CPSR] & 0xf0000000;
+  irq.restore = true;
+  irq.taken++;
+  pState->exclusive = -1;
+  pState->PC = irq.vector;
+  pState->regs[INDEX_PC] = pState->PC;
+  pState->regs[INDEX_CPSR] = pState->regs[INDEX_CPSR] | KERNEL_MODE;
+  pState->SVC = 1;
+  pipeline->decoded = -1;
+  pipeline->fetched = -1;
+  return true;
+}
+
+/*
+ Starts every core that is not running at address, with its core number in
+ r0 and r13 CORE_STACK bytes below the stack of the core before it
+ */
+void startCores(int address) {
+  if (address < 0 || address > MEM_SIZE_WORDS * 4 - 4)
+    return;
+  for (int i = 1; i < core_count; i++) {
+    proc_state_t *core = &core_states[i];
+    if (__atomic_load_n(&core->running, __ATOMIC_ACQUIRE))
+      continue;
+    core->regs[0] = i;
+    core->regs[INDEX_SP] = STACK_ADDR - i * CORE_STACK;
+    core->PC = address + 4;
+    core->regs[INDEX_PC] = core->PC;
+    core_pipelines[i].fetched = core->memory[address / 4];
+    core_pipelines[i].decoded = -1;
+    __atomic_store_n(&core->running, 1, __ATOMIC_RELEASE);
+  }
+}
+
 /*
-  This clever function (along with setByte) allows the following.
+ Replaces the bits of mask in word with those of bits, as one atomic
+ operation, so stores of other cores to the rest of the word are kept
+ */
+void storeBits(int *word, uint32_t mask, uint32_t bits) {
+  int old = __atomic_load_n(word, __ATOMIC_RELAXED), new;
+  do
+    new = (old & ~mask) | (bits & mask);
+  while (!__atomic_compare_exchange_n(word, &old, new, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+  This clever function (along with storeBits) allows the following.
    mov r6, #0x100
    orr r6, r6, #5        // r6 has addres 0x105, not multiple of 4
    mov r3, #0xaa000000
@@ -476,29 +1310,16 @@ int setByte(int word, int index, int newByte) {
 void fillByteAddress(int startByteAddress, proc_state_t *pState, int *byteArr) {
   //Starting from mem[startByteAddress], function replaces existing bytes
   //with bytes from the array referenced by byteArr
+  //Each byte is stored on its own, see storeBits
   for(int i = 0; i < 4; i++) {
-    pState->memory[startByteAddress / 4] =
-    setByte(pState->memory[startByteAddress / 4], 3-startByteAddress % 4, byteArr[i]); 
+    int shift = 8 * (startByteAddress % 4);
+    storeBits(&pState->memory[startByteAddress / 4], 0xffu << shift,
+              (uint32_t) byteArr[i] << shift);
     startByteAddress++;
   }
 }
 
 void writeToMemory(int word, int startByteAddress, proc_state_t *pState) {
-  // Declaring heap allocated arrays that hold the state of the gpio pins
-  /*gpioPhysical[0...2] is the representation of mem[0x2020 0000...0x2020 0008]
-   *and holds control bits for each pin in the intervals 0-9, 10-19, 20-29resp*/
-
-  /* gpioOutputOnOff holds two addresses:
-   * 0 |-> 0x2020 0028 OFF
-     1 |-> 0x2020 001C ON
-   */
-
-  int *gpioPhysical = (int *) malloc(3 * sizeof(int));
-  int *gpioOutputOnOff = (int *) malloc(2 * sizeof(int));
-  if(gpioPhysical == NULL || gpioOutputOnOff == NULL) {
-    perror("malloc");
-    exit(EXIT_FAILURE);
-  }
   //word written to memory starting from startByteAddress
 //int byte[4] = {getByteBigEndian(word, 3),
 //               getByteBigEndian(word, 2),
@@ -513,40 +1334,96 @@ void writeToMemory(int word, int startByteAddress, proc_state_t *pState) {
   //Got every byte of the number to be written to memory
   //  int changedPin = -1;
   //changedPin is the index of the pin that has been set as output
+  bool device = startByteAddress >= IO_INT_ADDRESS;
+  if (device)
+    deviceLock();
   switch(startByteAddress) {
     case IO_INT_ADDRESS:
       if (pState->SVC) {
-        printf("emu int printf: %d, 0x%08x\n", pState->regs[1], pState->regs[1]);
+        consoleWrite("emu int printf: %d, 0x%08x\n", pState->regs[1], pState->regs[1]);
       } else
         printf("printf int from user mode not allowed.\n");
       break;
     case IO_STR_ADDRESS:
       if (pState->SVC) {
-        //char str[100];
-        char *s = (char *)&pState->memory[pState->regs[1] / 4];
-        printf("emu str printf: %s\n", s);
+        int address = pState->regs[1];
+        if (address < 0 || address >= MEM_SIZE_WORDS * 4) {
+          printf("Error: Out of bounds memory access at address 0x%.8x\n", address);
+          break;
+        }
+        char *s = (char *) pState->memory + address;
+        char *end = memchr(s, '\0', MEM_SIZE_WORDS * 4 - address);
+        consoleWrite("emu str printf: %.*s\n",
+                     (int) (end ? end - s : MEM_SIZE_WORDS * 4 - address), s);
       } else
         printf("printf int from user mode not allowed.\n");
       break;
     case GPIO20_29_ADDRESS:
       printf("%s\n", "One GPIO pin from 20 to 29 has been accessed");
-      gpioPhysical[2] = word;
+      gpio_physical[2] = word;
       // changedPin = getChangedOutputPin(word, 2);
       break;
     case GPIO_OUTPUT_ON: 
       printf("%s\n", "PIN ON");
-      gpioOutputOnOff[0] = word;
+      gpio_output_on_off[0] = word;
       break;
     case GPIO_OUTPUT_OFF: 
       printf("%s\n", "PIN OFF");
-      gpioOutputOnOff[1] = word;
+      gpio_output_on_off[1] = word;
+      break;
+    case DMA_SOURCE: case DMA_DESTINATION: case DMA_LENGTH:
+    case DMA_CONTROL: case DMA_STATUS: case DMA_FILL:
+      dmaWrite(pState, startByteAddress, word);
+      break;
+    case BLOCK_SECTOR: case BLOCK_COUNT: case BLOCK_ADDRESS:
+    case BLOCK_COMMAND: case BLOCK_STATUS: case BLOCK_CAPACITY:
+      blockWrite(pState, startByteAddress, word);
+      break;
+    case TIMER_LOAD: case TIMER_VALUE: case TIMER_CONTROL: case TIMER_TICKS:
+      timerWrite(startByteAddress, word);
+      break;
+    case IRQ_PENDING: case IRQ_ENABLE: case IRQ_VECTOR: case IRQ_RETURN:
+    case IRQ_FLAGS:
+      irqWrite(startByteAddress, word);
+      break;
+    case CORE_START:
+      startCores(word);
+      break;
+    case PERF_CONTROL:
+      perfWrite(pState, word);
       break;
+    case PERF_INSTRUCTIONS: case PERF_CYCLES: case PERF_BRANCHES:
+    case PERF_FLUSHES: case PERF_LOADS: case PERF_STORES: case PERF_SVCS:
+      break; // read-only
     default:
-      fillByteAddress(startByteAddress, pState, byteArray);
-      //pState->memory[startByteAddres / 4] = word;
+      if (startByteAddress < 0 || startByteAddress > MEM_SIZE_WORDS * 4 - 4)
+        printf("Error: Out of bounds memory access at address 0x%.8x\n", startByteAddress);
+      else if (startByteAddress % 4 == 0) // aligned, one word store
+        __atomic_store_n(&pState->memory[startByteAddress / 4], word, __ATOMIC_RELAXED);
+      else
+        fillByteAddress(startByteAddress, pState, byteArray);
+  }
+  if (device)
+    deviceUnlock();
+}
+
+/*
+  strb/strh replace the low size bytes of value in RAM, a byte and a
+  halfword in one word are a single storeBits, a halfword that straddles two
+  words one for each byte
+ */
+void writeNarrowToMemory(int value, int address, int size, proc_state_t *pState) {
+  if (address < 0 || address > MEM_SIZE_WORDS * 4 - size) {
+    printf("Error: Out of bounds memory access at address 0x%.8x\n", address);
+  } else if (size == 1 || address % 4 != 3) {
+    int shift = 8 * (address % 4);
+    uint32_t mask = size == 1 ? 0xffu : 0xffffu;
+    storeBits(&pState->memory[address / 4], mask << shift, (uint32_t) value << shift);
+  } else {
+    for (int i = 0; i < size; i++, address++)
+      storeBits(&pState->memory[address / 4], 0xffu << 8 * (address % 4),
+                ((uint32_t) value >> 8 * i & 0xff) << 8 * (address % 4));
   }
-  free(gpioPhysical);
-  free(gpioOutputOnOff);
 }
 
 /*
@@ -583,23 +1460,26 @@ int getMemoryContentsAtAddress(proc_state_t *pState, int address) {
 */
 
 void executeLoadFromMemoryGPIO(proc_state_t *pState, int Rd, int address) {
+  bool device = address >= IO_INT_ADDRESS;
+  if (device)
+    deviceLock();
   switch (address) {
     case IO_INT_ADDRESS:
       if (pState->SVC) {
-        printf("emu int scanf - enter a number: ");
-        int value;
-        scanf("%d", &value);
-        pState->regs[Rd] = value;
+        pState->regs[Rd] = consoleReadInt();
         //pState->regs[Rd] = IO_INT_ADDRESS;
       } else
         printf("scanf str from user mode not allowed.\n");
       break;
     case IO_STR_ADDRESS:
       if (pState->SVC) {
-        //char str[100];
-        printf("emu str scanf - enter a string: ");
-        char *s = (char *)&pState->memory[pState->regs[1] / 4];
-        scanf("%s", s);
+        char value[CONSOLE_VALUE] = "";
+        int address = pState->regs[1];
+        consoleRead("emu str scanf - enter a string: ", value, sizeof(value));
+        if (address < 0 || address > MEM_SIZE_WORDS * 4 - (int) strlen(value) - 1)
+          printf("Error: Out of bounds memory access at address 0x%.8x\n", address);
+        else
+          strcpy((char *) pState->memory + address, value);
       } else
         printf("scanf str from user mode not allowed.\n");
       break;
@@ -607,11 +1487,37 @@ void executeLoadFromMemoryGPIO(proc_state_t *pState, int Rd, int address) {
       printf("%s\n", "One GPIO pin from 20 to 29 has been accessed");
       pState->regs[Rd] = GPIO20_29_ADDRESS;
       break;
+    case DMA_SOURCE: case DMA_DESTINATION: case DMA_LENGTH:
+    case DMA_CONTROL: case DMA_STATUS: case DMA_FILL:
+      pState->regs[Rd] = dmaRead(address);
+      break;
+    case BLOCK_SECTOR: case BLOCK_COUNT: case BLOCK_ADDRESS:
+    case BLOCK_COMMAND: case BLOCK_STATUS: case BLOCK_CAPACITY:
+      pState->regs[Rd] = blockRead(address);
+      break;
+    case TIMER_LOAD: case TIMER_VALUE: case TIMER_CONTROL: case TIMER_TICKS:
+      pState->regs[Rd] = timerRead(address);
+      break;
+    case IRQ_PENDING: case IRQ_ENABLE: case IRQ_VECTOR: case IRQ_RETURN:
+    case IRQ_FLAGS:
+      pState->regs[Rd] = irqRead(address);
+      break;
+    case CORE_ID:
+      pState->regs[Rd] = pState->core;
+      break;
+    case CORE_COUNT:
+      pState->regs[Rd] = core_count;
+      break;
+    case PERF_CONTROL: case PERF_INSTRUCTIONS: case PERF_CYCLES:
+    case PERF_BRANCHES: case PERF_FLUSHES: case PERF_LOADS: case PERF_STORES:
+    case PERF_SVCS:
+      pState->regs[Rd] = perfRead(pState, address);
+      break;
     default:
-      if(address > (MEM_SIZE_WORDS - 4)) {
+      if (address < 0 || address > MEM_SIZE_WORDS * 4 - 4) {
         printf("Error: Out of bounds memory access at address 0x%.8x\n", address);
       } else {
-        pState->regs[Rd] = pState->memory[address / 4];
+        pState->regs[Rd] = __atomic_load_n(&pState->memory[address / 4], __ATOMIC_RELAXED);
         //original code, which I thought converted big Endian to little Endian
         //pState->regs[Rd] = getMemoryContentsAtAddress(pState, address);
         //Simplified big Endian to little Endian
@@ -623,6 +1529,38 @@ void executeLoadFromMemoryGPIO(proc_state_t *pState, int Rd, int address) {
         //pState->regs[Rd] = byte0 | byte1 << 8 | byte2 << 16 | byte3 << 24;
       }
   }
+  if (device)
+    deviceUnlock();
+}
+
+/* ldrb/ldrh zero extend the byte or halfword at address into rd */
+void executeNarrowLoad(proc_state_t *pState, int Rd, int address, int size) {
+  if (address < 0 || address > MEM_SIZE_WORDS * 4 - size) {
+    printf("Error: Out of bounds memory access at address 0x%.8x\n", address);
+  } else if (size == 1 || address % 4 != 3) {
+    uint32_t word = __atomic_load_n(&pState->memory[address / 4], __ATOMIC_RELAXED);
+    pState->regs[Rd] = word >> 8 * (address % 4) & (size == 1 ? 0xff : 0xffff);
+  } else { // the halfword straddles two words
+    uint32_t low = __atomic_load_n(&pState->memory[address / 4], __ATOMIC_RELAXED);
+    uint32_t high = __atomic_load_n(&pState->memory[address / 4 + 1], __ATOMIC_RELAXED);
+    pState->regs[Rd] = low >> 24 | (high & 0xff) << 8;
+  }
+}
+
+/* Loads or stores size bytes, words go through the memory mapped I/O */
+void transferMemory(proc_state_t *pState, int L, int Rd, int address, int size) {
+  if (perfCounting(pState)) {
+    pState->perf.loads += L != 0;
+    pState->perf.stores += L == 0;
+  }
+  if (size == 4 && L)
+    executeLoadFromMemoryGPIO(pState, Rd, address);
+  else if (size == 4)
+    writeToMemory(pState->regs[Rd], address, pState);
+  else if (L)
+    executeNarrowLoad(pState, Rd, address, size);
+  else
+    writeNarrowToMemory(pState->regs[Rd], address, size, pState);
 }
 
 int getEffectiveAddress(int Rn, int offset, int U, proc_state_t *pState) {
@@ -635,6 +1573,7 @@ int getEffectiveAddress(int Rn, int offset, int U, proc_state_t *pState) {
 
 /*
   I Bit - 0 is imm, 1 is reg with shift
+  B Bit - 0 is word, 1 is byte
   L Bit - 0 is str, 1 is ldr
   P Bit - 0 is post inc/dec, 1 is pre inc/dec
   U Bit - 0 is sub from rn, 1 is add to rn
@@ -642,8 +1581,14 @@ int getEffectiveAddress(int Rn, int offset, int U, proc_state_t *pState) {
   Rn - base register
   Rd - source/destination register
   Rm - shift register
+  ldrh/strh have bits 7-4 1011, bit 22 is 1 for an 8-bit immediate in bits
+  8-11 and 0-3, 0 for an unshifted Rm
+  ldr r15 branches to the loaded address, such as an entry of a jump table,
+  unlike mov r15 and ldm it stays in kernel mode
  */
-void executeSDataTransfer(int instruction, proc_state_t *pState) {
+void executeSDataTransfer(int instruction, proc_state_t *pState, pipeline_t *pipeline) {
+  int half = (instruction & 0x0e0000f0) == 0xb0;
+  int size = half ? 2 : instruction >> 22 & 1 ? 1 : 4;
   int I = instruction >> 25 & 1;
   int L = instruction >> 20 & 1;
   int P = instruction >> 24 & 1;
@@ -652,7 +1597,12 @@ void executeSDataTransfer(int instruction, proc_state_t *pState) {
   int Rn = instruction >> 16 & 0xf;
   int Rd = instruction >> 12 & 0xf;
   int offset = -1;
-  if (I) { // Offset is a shifted register
+  if (half) {
+    if (instruction >> 22 & 1)
+      offset = (instruction >> 4 & 0xf0) | (instruction & 0xf);
+    else
+      offset = pState->regs[instruction & 0xf];
+  } else if (I) { // Offset is a shifted register
     int shift = instruction >> 4 & 0xff;
     int Rm = instruction & 0xf;
     int shiftType = shift >> 1 & 3; //2 bits (UX to 32)
@@ -680,13 +1630,13 @@ void executeSDataTransfer(int instruction, proc_state_t *pState) {
      if (P) { //Pre-indexing
        address = getEffectiveAddress(Rn, offset, U, pState);
        address = pState->regs[Rn] + (U ? offset : -offset);
-       executeLoadFromMemoryGPIO(pState, Rd, address);
+       transferMemory(pState, L, Rd, address, size);
        if (W) { // write-back address to rn
          pState->regs[Rn] = address;
        }
      } else { //Post-indexing
        address = pState->regs[Rn];
-       executeLoadFromMemoryGPIO(pState, Rd, address);
+       transferMemory(pState, L, Rd, address, size);
        if (W) { // write-back address to rn
          pState->regs[Rn] = getEffectiveAddress(Rn,offset, U, pState);
          address = pState->regs[Rn] + (U ? offset : -offset);
@@ -696,13 +1646,13 @@ void executeSDataTransfer(int instruction, proc_state_t *pState) {
      if (P) { //Pre-indexing
        address = getEffectiveAddress(Rn, offset, U, pState);
        address = pState->regs[Rn] + (U ? offset : -offset);
-       writeToMemory(pState->regs[Rd], address, pState);
+       transferMemory(pState, L, Rd, address, size);
        if (W) { // write-back address to rn
          pState->regs[Rn] = address;
        }
      } else { //Post-indexing
        address = pState->regs[Rn];
-       writeToMemory(pState->regs[Rd], address, pState);
+       transferMemory(pState, L, Rd, address, size);
        //Then set base register
        if (W) { // write-back address to rn
          pState->regs[Rn] = getEffectiveAddress(Rn,offset, U, pState);
@@ -710,42 +1660,654 @@ void executeSDataTransfer(int instruction, proc_state_t *pState) {
        }
      }
   }
+  if (L && Rd == INDEX_PC) { // do a branch
+    pState->PC = pState->regs[INDEX_PC];
+    pipeline->decoded = -1;
+    pipeline->fetched = -1;
+  }
+}
+
+/*
+  ldm/stm move the registers of the list, lowest register at the lowest
+  address, in one pass from the lowest address up
+  L Bit - 0 is stm, 1 is ldm
+  P Bit - 0 is after, the base address is used first, 1 is before
+  U Bit - 0 the addresses go down from rn, 1 they go up
+  W Bit - 0 dont write back to rn, 1 write back to rn
+  ldm that loads r15 branches like mov r15, and returns from kernel mode
+ */
+void executeBlockTransfer(int instruction, proc_state_t *pState, pipeline_t *pipeline) {
+  int L = instruction >> 20 & 1;
+  int P = instruction >> 24 & 1;
+  int U = instruction >> 23 & 1;
+  int W = instruction >> 21 & 1;
+  int Rn = instruction >> 16 & 0xf;
+  int list = instruction & 0xffff;
+  int count = 0;
+  for (int reg = 0; reg < 16; reg++)
+    count += list >> reg & 1;
+  if (perfCounting(pState)) {
+    pState->perf.loads += L ? count : 0;
+    pState->perf.stores += L ? 0 : count;
+  }
+  int base = pState->regs[Rn];
+  int address = U ? base + (P ? 4 : 0) : base - 4 * count + (P ? 0 : 4);
+  for (int reg = 0; reg < 16; reg++) {
+    if (!(list >> reg & 1))
+      continue;
+    if (L)
+      executeLoadFromMemoryGPIO(pState, reg, address);
+    else
+      writeToMemory(pState->regs[reg], address, pState);
+    address += 4;
+  }
+  if (W && !(L && (list >> Rn & 1))) // a loaded base wins over write back
+    pState->regs[Rn] = U ? base + 4 * count : base - 4 * count;
+  if (L && (list >> INDEX_PC & 1)) { // do a branch
+    if (pState->SVC) // returned from kernel mode
+      leaveKernel(pState);
+    pState->PC = pState->regs[INDEX_PC];
+    pState->regs[INDEX_PC] = pState->PC;
+    pipeline->decoded = -1;
+    pipeline->fetched = -1;
+  }
+}
+
+void executeMultiply(int instruction, proc_state_t *pState) {
+  int A = instruction >> 21 & 1;
+  int S = instruction >> 20 & 1;
+  int Rd = instruction >> 16 & 0xf;
+  int Rn = instruction >> 12 & 0xf;
+  int Rs = instruction >> 8 & 0xf;
+  int Rm = instruction & 0xf;
+  int auxResultMult = -1;
+  assert(Rd != Rm);
+  // the low 32 bits of the product are the same signed or unsigned
+  uint32_t product = (uint32_t) pState->regs[Rm] * (uint32_t) pState->regs[Rs];
+  if(A) {
+    pState->regs[Rd] = (int) (product + (uint32_t) pState->regs[Rn]);
+  } else {
+    pState->regs[Rd] = (int) product;
+  }
+  auxResultMult = pState->regs[Rd];
+  if(S) {
+    //Set NEG and ZER flags, C and V are left alone
+    pState->NEG = (uint32_t) auxResultMult >> 31;
+    pState->ZER = auxResultMult ? 0 : 1;
+    int modebits = pState->regs[INDEX_CPSR] & 0x1f;
+    pState->regs[INDEX_CPSR] = (pState->NEG << 31) | (pState->ZER << 30) |
+                               (pState->CRY << 29) | (pState->OVF << 28) | modebits;
+  }
+}
+
+/*
+  umull/smull rdlo, rdhi, rm, rs put the 64-bit product in rdhi:rdlo,
+  umlal/smlal add it to rdhi:rdlo. With the S bit N and Z are set from the
+  64-bit result, C and V are left alone.
+ */
+void executeMultiplyLong(int instruction, proc_state_t *pState) {
+  int U = instruction >> 22 & 1; // 1 is signed
+  int A = instruction >> 21 & 1;
+  int S = instruction >> 20 & 1;
+  int RdHi = instruction >> 16 & 0xf;
+  int RdLo = instruction >> 12 & 0xf;
+  int Rs = instruction >> 8 & 0xf;
+  int Rm = instruction & 0xf;
+  uint64_t result;
+  if (U)
+    result = (uint64_t) ((int64_t) pState->regs[Rm] * (int64_t) pState->regs[Rs]);
+  else
+    result = (uint64_t) (uint32_t) pState->regs[Rm] * (uint32_t) pState->regs[Rs];
+  if (A)
+    result += (uint64_t) (uint32_t) pState->regs[RdHi] << 32 | (uint32_t) pState->regs[RdLo];
+  pState->regs[RdLo] = (int) (uint32_t) result;
+  pState->regs[RdHi] = (int) (uint32_t) (result >> 32);
+  if (S) {
+    pState->NEG = result >> 63;
+    pState->ZER = result ? 0 : 1;
+    int modebits = pState->regs[INDEX_CPSR] & 0x1f;
+    pState->regs[INDEX_CPSR] = (pState->NEG << 31) | (pState->ZER << 30) |
+                               (pState->CRY << 29) | (pState->OVF << 28) | modebits;
+  }
+}
+
+/*
+  sdiv/udiv rd, rn, rm - rd = rn / rm rounded toward zero, flags are left
+  alone. Dividing by zero gives 0 and sdiv of INT_MIN by -1 gives INT_MIN,
+  as on ARMv7 without the divide by zero trap.
+ */
+void executeDivide(int instruction, proc_state_t *pState) {
+  int unsign = instruction >> 21 & 1;
+  int Rd = instruction >> 16 & 0xf;
+  int Rm = instruction >> 8 & 0xf;
+  int Rn = instruction & 0xf;
+  int n = pState->regs[Rn];
+  int m = pState->regs[Rm];
+  if (m == 0)
+    pState->regs[Rd] = 0;
+  else if (unsign)
+    pState->regs[Rd] = (int) ((uint32_t) n / (uint32_t) m);
+  else if (n == INT32_MIN && m == -1)
+    pState->regs[Rd] = INT32_MIN;
+  else
+    pState->regs[Rd] = n / m;
+}
+
+/*
+ swp/swpb rd, rm, [rn] exchange the word or byte at rn with rm. ldrex rd,
+ [rn] loads the word at rn and monitors it, strex rd, rm, [rn] then stores
+ rm there if memory still holds the value ldrex loaded, with rd 0, else rd
+ is 1 and memory is left as is. A strex, svc or interrupt ends the monitor.
+ Memory model of the cores: each is one atomic operation of the host and a
+ full barrier, the loads and stores a core made before it are seen by every
+ core before the ones it makes after it. Aligned word loads and stores, ldm
+ and stm one word at a time, and byte and halfword ones within a word are
+ single-copy atomic too but unordered, another core may see them late or in
+ a different order. A narrow store changes only its bytes of the word, so
+ cores storing neighbouring bytes keep each other's stores. An unaligned
+ word, or a halfword straddling two words, is a byte at a time. emu -d runs
+ the cores a QUANTUM at a time in order, so a run is the same every time.
+ */
+void executeAtomic(int instruction, proc_state_t *pState) {
+  int byte = instruction >> 22 & 1;
+  int exclusive = instruction >> 23 & 1;
+  int L = instruction >> 20 & 1;
+  int Rn = instruction >> 16 & 0xf;
+  int Rd = instruction >> 12 & 0xf;
+  int Rm = instruction & 0xf;
+  int address = pState->regs[Rn];
+  if (address < 0 || address > MEM_SIZE_WORDS * 4 - 4 || (!byte && address % 4)) {
+    printf("Error: Out of bounds or unaligned atomic access at address 0x%.8x\n", address);
+    return;
+  }
+  if (perfCounting(pState)) { // swp loads and stores, a failed strex stores too
+    pState->perf.loads += !exclusive || L;
+    pState->perf.stores += !exclusive || !L;
+  }
+  int *word = &pState->memory[address / 4];
+  if (exclusive && L) {
+    pState->exclusiveValue = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+    pState->exclusive = address;
+    pState->regs[Rd] = pState->exclusiveValue;
+  } else if (exclusive) {
+    int expected = pState->exclusiveValue;
+    bool stored = pState->exclusive == address &&
+                  __atomic_compare_exchange_n(word, &expected, pState->regs[Rm], false,
+                                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    pState->exclusive = -1;
+    pState->regs[Rd] = !stored;
+  } else { // swpb changes one byte of the word
+    int shift = byte ? 8 * (address % 4) : 0;
+    uint32_t mask = byte ? 0xffu << shift : 0xffffffffu;
+    int old = __atomic_load_n(word, __ATOMIC_SEQ_CST), new;
+    do
+      new = (old & ~mask) | ((uint32_t) pState->regs[Rm] << shift & mask);
+    while (!__atomic_compare_exchange_n(word, &old, new, true,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    pState->regs[Rd] = ((uint32_t) old & mask) >> shift;
+  }
+}
+
+/*
+ Handlers of the services os.s provides, they take their arguments from r1-r3
+ like the guest routines and leave their results in r0 (and r1 for divide and atoi).
+ Unlike the guest routines they don't clobber r1-r3, r12 or the flags.
+ */
+bool hleRange(int address, int length) {
+  if (address >= 0 && length >= 0 && address <= MEM_SIZE_WORDS * 4 - length)
+    return true;
+  printf("Error: Out of bounds memory access at address 0x%.8x\n", address);
+  return false;
+}
+
+void hleReadInt(proc_state_t *pState) {
+  pState->regs[0] = consoleReadInt();
+}
+
+void hlePrintInt(proc_state_t *pState) {
+  consoleWrite("emu int printf: %d, 0x%08x\n", pState->regs[1], pState->regs[1]);
+}
+
+/*
+ The heap functions follow the guest allocator of os.s block for block, so a
+ program sees the same addresses with hle on and off. Addresses are bytes,
+ blocks are passed by the address of their header.
+ */
+int *heapWord(proc_state_t *pState, int address) { // stays inside memory
+  return &pState->memory[((uint32_t) address / 4) % MEM_SIZE_WORDS];
+}
+
+int heapList(int size) {
+  int list = size > HEAP_SMALL ? HEAP_LISTS - 1 : size / 8 - 2;
+  return HEAP_ADDR + 4 + list * 4;
+}
+
+/* true iff block lies in the heap below top and its tags agree */
+bool heapBlock(proc_state_t *pState, int block) {
+  int top = *heapWord(pState, HEAP_ADDR);
+  if (block < HEAP_START || block >= top || block % 8 != HEAP_START % 8)
+    return false;
+  int size = *heapWord(pState, block) & ~1;
+  return size >= 16 && size % 8 == 0 && size <= top - block &&
+         *heapWord(pState, block + size - 4) == *heapWord(pState, block);
+}
+
+void heapUnlink(proc_state_t *pState, int block, int size) {
+  int next = *heapWord(pState, block + 4), prev = *heapWord(pState, block + 8);
+  if (next)
+    *heapWord(pState, next + 8) = prev;
+  if (prev)
+    *heapWord(pState, prev + 4) = next;
+  else
+    *heapWord(pState, heapList(size)) = next;
+}
+
+void heapInsert(proc_state_t *pState, int block, int size) {
+  int head = *heapWord(pState, heapList(size));
+  *heapWord(pState, block) = size;
+  *heapWord(pState, block + size - 4) = size;
+  *heapWord(pState, block + 4) = head;
+  *heapWord(pState, block + 8) = 0;
+  if (head)
+    *heapWord(pState, head + 8) = block;
+  *heapWord(pState, heapList(size)) = block;
+}
+
+/* Returns the payload of a new block of size bytes, -1 if there is no room */
+int heapAlloc(proc_state_t *pState, int size) {
+  int block = size <= HEAP_SMALL ? *heapWord(pState, heapList(size)) : 0;
+  if (block) {
+    heapUnlink(pState, block, size);
+  } else {
+    for (block = *heapWord(pState, heapList(HEAP_SMALL + 8)); block;
+         block = *heapWord(pState, block + 4))
+      if (*heapWord(pState, block) >= size)
+        break;
+    if (block) {
+      int rest = *heapWord(pState, block) - size;
+      heapUnlink(pState, block, rest + size);
+      if (rest < 16)
+        size += rest;
+      else
+        heapInsert(pState, block + size, rest);
+    } else {
+      block = *heapWord(pState, HEAP_ADDR);
+      if (block < HEAP_START)
+        block = HEAP_START;
+      if (block + size > HEAP_END)
+        return -1;
+      *heapWord(pState, HEAP_ADDR) = block + size;
+    }
+  }
+  *heapWord(pState, block) = size | 1;
+  *heapWord(pState, block + size - 4) = size | 1;
+  return block + 4;
+}
+
+void heapFree(proc_state_t *pState, int payload) {
+  int block = payload - 4;
+  if (payload == 0)
+    return;
+  if (!heapBlock(pState, block) || !(*heapWord(pState, block) & 1)) {
+    printf("Error: free of 0x%.8x, not an allocated block\n", payload);
+    return;
+  }
+  int size = *heapWord(pState, block) & ~1;
+  int top = *heapWord(pState, HEAP_ADDR);
+  int next = block + size;
+  if (next < top && !(*heapWord(pState, next) & 1)) {
+    heapUnlink(pState, next, *heapWord(pState, next));
+    size += *heapWord(pState, next);
+  }
+  if (block > HEAP_START && !(*heapWord(pState, block - 4) & 1)) {
+    int prev = *heapWord(pState, block - 4);
+    block -= prev;
+    heapUnlink(pState, block, prev);
+    size += prev;
+  }
+  if (block + size == top)
+    *heapWord(pState, HEAP_ADDR) = block;
+  else
+    heapInsert(pState, block, size);
+}
+
+int heapSize(int bytes) {
+  return (bytes + 15) & ~7;
+}
+
+void hleMalloc(proc_state_t *pState) {
+  int bytes = pState->regs[1];
+  if (bytes <= 0 || bytes >= HEAP_END)
+    pState->regs[0] = -1;
+  else
+    pState->regs[0] = heapAlloc(pState, heapSize(bytes));
+}
+
+void hleFree(proc_state_t *pState) {
+  heapFree(pState, pState->regs[1]);
+  pState->regs[0] = 0;
+}
+
+void hleRealloc(proc_state_t *pState) {
+  int payload = pState->regs[1], bytes = pState->regs[2];
+  if (payload == 0) {
+    pState->regs[1] = bytes;
+    hleMalloc(pState);
+    pState->regs[1] = payload;
+    return;
+  }
+  if (bytes <= 0) {
+    hleFree(pState);
+    return;
+  }
+  int block = payload - 4;
+  pState->regs[0] = -1;
+  if (bytes >= HEAP_END)
+    return;
+  if (!heapBlock(pState, block) || !(*heapWord(pState, block) & 1)) {
+    printf("Error: realloc of 0x%.8x, not an allocated block\n", payload);
+    return;
+  }
+  int size = heapSize(bytes), old = *heapWord(pState, block) & ~1;
+  if (size <= old) {
+    pState->regs[0] = payload;
+  } else if (block + old == *heapWord(pState, HEAP_ADDR) &&
+             block + size <= HEAP_END) { // the last block grows into top
+    *heapWord(pState, HEAP_ADDR) = block + size;
+    *heapWord(pState, block) = size | 1;
+    *heapWord(pState, block + size - 4) = size | 1;
+    pState->regs[0] = payload;
+  } else {
+    int moved = heapAlloc(pState, size);
+    if (moved < 0)
+      return;
+    memmove(heapWord(pState, moved), heapWord(pState, payload), old - 8);
+    heapFree(pState, payload);
+    pState->regs[0] = moved;
+  }
+}
+
+/*
+ Walks the blocks from HEAP_START to top and prints the heap, with l every
+ block. Fragmentation is the share of the free space, top included, outside
+ the largest free region. Tags that don't agree and free blocks missing from
+ their list are reported, the walk stops at the first bad tag.
+ */
+void printHeap(proc_state_t *pState, bool blocks) {
+  int top = *heapWord(pState, HEAP_ADDR);
+  int used = 0, used_bytes = 0, free_blocks = 0, free_bytes = 0, largest = 0;
+  int listed = 0;
+  if (top < HEAP_START)
+    top = HEAP_START;
+  if (top > HEAP_END) {
+    printf("heap top 0x%.8x is beyond the heap end 0x%.8x\n", top, HEAP_END);
+    return;
+  }
+  for (int list = 0; list < HEAP_LISTS; list++) {
+    int prev = 0;
+    for (int block = *heapWord(pState, HEAP_ADDR + 4 + list * 4); block;
+         block = *heapWord(pState, block + 4)) {
+      if (!heapBlock(pState, block) || *heapWord(pState, block) & 1 ||
+          heapList(*heapWord(pState, block)) != HEAP_ADDR + 4 + list * 4 ||
+          *heapWord(pState, block + 8) != prev || ++listed > HEAP_END / 16) {
+        printf("free list %d is broken at 0x%.8x\n", list, block);
+        break;
+      }
+      prev = block;
+    }
+  }
+  int block = HEAP_START;
+  for (; block < top; block += *heapWord(pState, block) & ~1) {
+    if (!heapBlock(pState, block)) {
+      printf("bad tags at 0x%.8x: header 0x%.8x\n", block,
+             *heapWord(pState, block));
+      break;
+    }
+    int size = *heapWord(pState, block) & ~1;
+    bool allocated = *heapWord(pState, block) & 1;
+    if (blocks)
+      printf("0x%.8x %6d %s\n", block + 4, size - 8,
+             allocated ? "allocated" : "free");
+    if (allocated) {
+      used++;
+      used_bytes += size - 8;
+    } else {
+      free_blocks++;
+      free_bytes += size;
+      if (size > largest)
+        largest = size;
+    }
+  }
+  if (listed != free_blocks)
+    printf("%d free blocks are on the free lists, %d in the heap\n",
+           listed, free_blocks);
+  int above = HEAP_END - top;
+  int all_free = free_bytes + above;
+  if (above > largest)
+    largest = above;
+  printf("heap 0x%.8x - 0x%.8x, top 0x%.8x\n", HEAP_START, HEAP_END, top);
+  printf("%d allocated blocks, %d bytes\n", used, used_bytes);
+  printf("%d free blocks, %d bytes, largest %d\n", free_blocks, free_bytes,
+         largest);
+  printf("%d bytes above top, fragmentation %.1f%%\n", above,
+         all_free ? 100.0 * (all_free - largest) / all_free : 0.0);
+}
+
+void hleDivide(proc_state_t *pState) { // by 0 gives 0, remainder the dividend
+  int n = pState->regs[1], m = pState->regs[2];
+  int q = m == 0 ? 0 : n == INT32_MIN && m == -1 ? INT32_MIN : n / m;
+  pState->regs[0] = q;
+  pState->regs[1] = (int) ((uint32_t) n - (uint32_t) q * (uint32_t) m);
+}
+
+void hleMemcpy(proc_state_t *pState) { // the regions must not overlap
+  int dst = pState->regs[1], src = pState->regs[2], n = pState->regs[3];
+  uint8_t *bytes = (uint8_t *) pState->memory;
+  pState->regs[0] = dst;
+  if (n > 0 && hleRange(dst, n) && hleRange(src, n))
+    for (int i = 0; i < n; i++)
+      bytes[dst + i] = bytes[src + i];
 }
 
+void hleMemset(proc_state_t *pState) {
+  int dst = pState->regs[1], n = pState->regs[3];
+  pState->regs[0] = dst;
+  if (n > 0 && hleRange(dst, n))
+    memset((uint8_t *) pState->memory + dst, pState->regs[2] & 0xff, n);
+}
 
-void executeMultiply(int instruction, proc_state_t *pState) {
-  int A = instruction >> 21 & 1;
-  int S = instruction >> 20 & 1;
-  int Rd = instruction >> 16 & 0xf;
-  int Rn = instruction >> 12 & 0xf;
-  int Rs = instruction >> 8 & 0xf;
-  int Rm = instruction & 0xf;
-  int auxResultMult = -1;
-  assert(Rd != Rm);
-  if(A) {
-    pState->regs[Rd] = (int) (pState->regs[Rm] * pState->regs[Rs]) + pState->regs[Rn];
-  } else {
-    pState->regs[Rd] = (int) pState->regs[Rm] * pState->regs[Rs];
-  }
-  auxResultMult = pState->regs[Rd];
-  if(S) {
-    //Set NEG and ZER flags
-    pState->NEG = auxResultMult >> 31;
-    pState->ZER = auxResultMult ? 0 : 1;
-    pState->regs[INDEX_CPSR] = (pState->NEG << 31) | (pState->ZER << 30) |
-                               (pState->CRY << 29) | (pState->OVF << 28);
+/* the length of the string at address, which ends with memory if it has no null */
+int hleStringLength(proc_state_t *pState, int address) {
+  if (!hleRange(address, 1))
+    return -1;
+  char *str = (char *) pState->memory + address;
+  char *end = memchr(str, '\0', MEM_SIZE_WORDS * 4 - address);
+  return end ? end - str : MEM_SIZE_WORDS * 4 - address;
+}
+
+void hleStrlen(proc_state_t *pState) {
+  int length = hleStringLength(pState, pState->regs[1]);
+  if (length >= 0)
+    pState->regs[0] = length;
+}
+
+void hleMemcmp(proc_state_t *pState) {
+  int s1 = pState->regs[1], s2 = pState->regs[2], n = pState->regs[3];
+  uint8_t *bytes = (uint8_t *) pState->memory;
+  pState->regs[0] = 0;
+  if (n > 0 && hleRange(s1, n) && hleRange(s2, n))
+    for (int i = 0; i < n && !pState->regs[0]; i++)
+      pState->regs[0] = bytes[s1 + i] - bytes[s2 + i];
+}
+
+void hleStrcpy(proc_state_t *pState) {
+  int dst = pState->regs[1], src = pState->regs[2];
+  int length = hleStringLength(pState, src);
+  uint8_t *bytes = (uint8_t *) pState->memory;
+  pState->regs[0] = dst;
+  if (length >= 0 && hleRange(src, length + 1) && hleRange(dst, length + 1))
+    memmove(bytes + dst, bytes + src, length + 1);
+}
+
+void hleItoa(proc_state_t *pState) {
+  char text[12];
+  int length = sprintf(text, "%d", pState->regs[1]);
+  pState->regs[0] = length;
+  if (hleRange(pState->regs[2], length + 1))
+    memcpy((uint8_t *) pState->memory + pState->regs[2], text, length + 1);
+}
+
+void hleAtoi(proc_state_t *pState) { // r1 is left after the digits
+  int s = pState->regs[1];
+  uint8_t *bytes = (uint8_t *) pState->memory;
+  if (!hleRange(s, 1))
+    return;
+  int sign = bytes[s];
+  if (sign == '-' || sign == '+')
+    s++;
+  uint32_t value = 0;
+  for (; s < MEM_SIZE_WORDS * 4 && (unsigned) (bytes[s] - '0') <= 9; s++)
+    value = value * 10 + bytes[s] - '0';
+  pState->regs[0] = sign == '-' ? -value : value;
+  pState->regs[1] = s;
+}
+
+void hlePrintf(proc_state_t *pState) {
+  char text[PRINTF_SIZE + 12];
+  int format = pState->regs[1], args = pState->regs[2], length = 0;
+  uint8_t *bytes = (uint8_t *) pState->memory;
+  while (length < PRINTF_SIZE && hleRange(format, 1) && bytes[format]) {
+    int c = bytes[format++];
+    if (c == '%') {
+      c = hleRange(format, 1) ? bytes[format++] : 0;
+      if (strchr("dxsc", c) && c) {
+        if (!hleRange(args, 4))
+          break;
+        int arg = pState->memory[args / 4];
+        args += 4;
+        if (c == 'd' || c == 'x') {
+          length += sprintf(text + length, c == 'd' ? "%d" : "%x", arg);
+          continue;
+        } else if (c == 's') {
+          while (length < PRINTF_SIZE && hleRange(arg, 1) && bytes[arg])
+            text[length++] = bytes[arg++];
+          continue;
+        }
+        c = arg & 0xff;
+      } else if (c == 0) { // a % ending the format is printed as is
+        format--;
+        c = '%';
+      }
+    }
+    text[length++] = c;
   }
+  text[length] = '\0';
+  consoleWrite("emu str printf: %s\n", text);
+  pState->regs[0] = length;
+}
+
+void hleSectors(proc_state_t *pState, int command) {
+  block.sector = pState->regs[1];
+  block.address = pState->regs[2];
+  block.count = pState->regs[3];
+  block.command = command;
+  blockStart(pState);
+  pState->regs[0] = block.status == BLOCK_DONE ? 0 : -1;
+}
+
+void hleReadSectors(proc_state_t *pState) {
+  hleSectors(pState, BLOCK_READ);
+}
+
+void hleWriteSectors(proc_state_t *pState) {
+  hleSectors(pState, BLOCK_WRITE);
+}
+
+void hlePerfCounters(proc_state_t *pState) { // in the order of the registers
+  int address = pState->regs[1];
+  int counters = (PERF_SVCS - PERF_INSTRUCTIONS) / 4 + 1;
+  pState->regs[0] = 0;
+  if (address && address % 4 == 0 && hleRange(address, 4 * counters))
+    for (int i = 0; i < counters; i++)
+      pState->memory[address / 4 + i] = perfRead(pState, PERF_INSTRUCTIONS + 4 * i);
+  perfWrite(pState, pState->regs[2]);
+}
+
+/*
+ The services hle handles, by the svc numbers of os.s
+ */
+static hle_service_t hle_services[] = {
+  {1, "readint",  hleReadInt,  0},
+  {2, "printint", hlePrintInt, 0},
+  {3, "malloc",   hleMalloc,   0},
+  {4, "divide",   hleDivide,   0},
+  {5, "memcpy",   hleMemcpy,   0},
+  {6, "memset",   hleMemset,   0},
+  {7, "strlen",   hleStrlen,   0},
+  {9, "free",     hleFree,     0},
+  {10, "realloc", hleRealloc,  0},
+  {11, "memcmp",  hleMemcmp,   0},
+  {12, "strcpy",  hleStrcpy,   0},
+  {13, "itoa",    hleItoa,     0},
+  {14, "atoi",    hleAtoi,     0},
+  {15, "printf",  hlePrintf,   0},
+  {16, "readsectors",  hleReadSectors,  0},
+  {17, "writesectors", hleWriteSectors, 0},
+  {21, "perfcounters", hlePerfCounters, 0},
+};
+
+#define HLE_SERVICES (int)(sizeof(hle_services) / sizeof(hle_services[0]))
+
+hle_service_t *hleService(int service) {
+  for (int i = 0; i < HLE_SERVICES; i++)
+    if (hle_services[i].service == service)
+      return &hle_services[i];
+  return NULL;
+}
+
+void printHle(void) {
+  printf("hle %s\n", hle_enabled ? "on" : "off");
+  for (int i = 0; i < HLE_SERVICES; i++)
+    printf("svc %-3d %-12s %u calls\n", hle_services[i].service,
+           hle_services[i].name, hle_services[i].calls);
 }
 
 /**
-  SVC saves return address in LR and branches to OS at address OS_ADDR
+  SVC saves return address in LR and branches to OS at address os_entry
+  With hle on, a service of hle_services runs natively instead, and the svc
+  completes as if the OS had returned to the next instruction: LR holds the
+  return address, the processor is back in user mode and the pipeline is
+  kept. Other services still enter the OS.
+  Kernel mode is one core at a time, the svc of a core that finds another
+  core in kernel mode waits, it is fetched again until that core returns.
  */
 void executeSvc(int instruction, proc_state_t *pState, pipeline_t *pipeline){
     if (pState->SVC)
       printf("Already in kernel mode.\n");
+    if (!enterKernel(pState)) { // another core is in kernel mode, retry the svc
+      pState->PC -= 8;
+      pState->regs[INDEX_PC] = pState->PC;
+      pipeline->decoded = -1;
+      pipeline->fetched = -1;
+      return;
+    }
     int service = instruction & 0xffffff;
-    pState->regs[INDEX_LR] = pState->PC;
-    pState->PC = OS_ADDR;
+    if (perfCounting(pState))
+      pState->perf.svcs++;
+    pState->regs[INDEX_LR] = pState->PC - 4; // the instruction after the svc
+    pState->exclusive = -1;
+    hle_service_t *hle = hle_enabled ? hleService(service) : NULL;
+    if (hle) {
+      deviceLock();
+      hle->calls++;
+      hle->handler(pState);
+      deviceUnlock();
+      pState->SVC = 0;
+      pState->regs[INDEX_CPSR] = pState->regs[INDEX_CPSR] & ~KERNEL_MODE;
+      __atomic_store_n(&kernel_core, -1, __ATOMIC_SEQ_CST);
+      return;
+    }
+    pState->PC = os_entry;
     pState->regs[INDEX_PC] = pState->PC;
     pState->regs[INDEX_CPSR] = pState->regs[INDEX_CPSR] | KERNEL_MODE;
     pState->SVC = 1;
@@ -768,8 +2330,10 @@ void executeBranch(int instruction, proc_state_t *pState, pipeline_t *pipeline){
     }
     // otherwise the offset is unchanged
     int PCvalue = pState->PC;
-    if (instruction & 1<<24) // bl instructin
-      pState->regs[INDEX_LR] = PCvalue;
+    if (instruction & 1<<24) // bl instructin, returns after the bl
+      pState->regs[INDEX_LR] = PCvalue - 4;
+    if (perfCounting(pState))
+      pState->perf.branches++;
     pState->PC = PCvalue + offset;
     pState->regs[INDEX_PC] = pState->PC;
     pipeline->decoded = -1;
@@ -780,10 +2344,19 @@ bool shouldExecute(int instruction, proc_state_t *pState) {
    uint8_t cond = (uint8_t)(instruction >> 28 & 0xf);
    int N = pState->NEG;
    int Z = pState->ZER;
+   int C = pState->CRY;
    int V = pState->OVF;
    switch(cond) {
      case 0:  return Z == 1;
      case 1:  return Z == 0;
+     case 2:  return C == 1;
+     case 3:  return C == 0;
+     case 4:  return N == 1;
+     case 5:  return N == 0;
+     case 6:  return V == 1;
+     case 7:  return V == 0;
+     case 8:  return C == 1 && Z == 0;
+     case 9:  return C == 0 || Z == 1;
      case 10: return N == V;
      case 11: return N != V;
      case 12: return ((Z == 0) && (N == V));
@@ -797,15 +2370,31 @@ bool shouldExecute(int instruction, proc_state_t *pState) {
  Bits 26 and 27 distinguish three instructions
  00 - Data Processing Instructions
  01 - LDR/STR instructions - Single Data Transfer
- 10 - Branch instructions
- Multiply requires bits 22-27 to be 0 and bits 4-7 to be 9
+ 10 - Branch instructions when bit 25 is set, LDM/STM when it is clear
+ Multiply requires bits 22-27 to be 0 and bits 4-7 to be 9, long multiply
+ bits 23-27 to be 1 and bits 4-7 to be 9
+ sdiv/udiv are the 01 instructions with bits 20-27 0x71/0x73 and bits 4-7 1
+ swp, ldrex and strex have bits 24-27 1 and bits 4-7 9
+ LDRH/STRH have bits 25-27 0 and bits 4-7 0xb
  */
 void executeInst(int instruction, proc_state_t *pState, pipeline_t *pipeline){
    int idBits = instruction >> 26 & 3;
-   if(idBits == 1) {
+   if((instruction & 0x0fd0f0f0) == 0x0710f010) {
+       if(shouldExecute(instruction, pState)) {
+        executeDivide(instruction, pState);
+       }
+   } else if((instruction & 0x0f0000f0) == 0x01000090) {
+       if(shouldExecute(instruction, pState)) {
+        executeAtomic(instruction, pState);
+       }
+   } else if(idBits == 1 || (instruction & 0x0e0000f0) == 0xb0) {
        if(shouldExecute(instruction, pState)) {
-        executeSDataTransfer(instruction, pState);
+        executeSDataTransfer(instruction, pState, pipeline);
        }
+   } else if(idBits == 2 && !(instruction >> 25 & 1)) {
+      if(shouldExecute(instruction, pState)) {
+        executeBlockTransfer(instruction, pState, pipeline);
+      }
    } else if(idBits == 2) {
       if(shouldExecute(instruction, pState)) {
         executeBranch(instruction, pState, pipeline);
@@ -820,6 +2409,10 @@ void executeInst(int instruction, proc_state_t *pState, pipeline_t *pipeline){
         if(shouldExecute(instruction, pState)) {
           executeMultiply(instruction, pState);
         }
+      } else if (mulop1 >> 1 == 1 && mulop2 == 9) { // umull, smull...
+        if(shouldExecute(instruction, pState)) {
+          executeMultiplyLong(instruction, pState);
+        }
       } else {
         if(shouldExecute(instruction, pState)) {
          executeDataProcessing(instruction, pState, pipeline);
@@ -841,6 +2434,239 @@ void memoryLoader(FILE *file, proc_state_t *pState, int addr) {
   fclose(file);
 }
 
+/*
+ Returns true if filename starts with the ELF magic number
+ */
+bool isElf(const char *filename) {
+  FILE *file = fopen(filename, "rb");
+  unsigned char magic[SELFMAG];
+  bool elf = file != NULL && fread(magic, 1, SELFMAG, file) == SELFMAG &&
+             memcmp(magic, ELFMAG, SELFMAG) == 0;
+  if (file != NULL)
+    fclose(file);
+  return elf;
+}
+
+/*
+ Adds the named symbols of the .symtab of the mapped ELF image of size bytes
+ to symbols
+ */
+void elfSymbols(uint8_t *image, size_t size) {
+  Elf32_Ehdr *header = (Elf32_Ehdr *) image;
+  if (header->e_shoff == 0 || header->e_shentsize != sizeof(Elf32_Shdr) ||
+      header->e_shoff + (size_t) header->e_shnum * sizeof(Elf32_Shdr) > size)
+    return;
+  Elf32_Shdr *sections = (Elf32_Shdr *) (image + header->e_shoff);
+  for (int i = 0; i < header->e_shnum; i++) {
+    Elf32_Shdr *table = &sections[i];
+    if (table->sh_type != SHT_SYMTAB || table->sh_link >= header->e_shnum ||
+        (size_t) table->sh_offset + table->sh_size > size)
+      continue;
+    Elf32_Shdr *strings = &sections[table->sh_link];
+    if ((size_t) strings->sh_offset + strings->sh_size > size)
+      continue;
+    Elf32_Sym *syms = (Elf32_Sym *) (image + table->sh_offset);
+    char *names = (char *) (image + strings->sh_offset);
+    for (int j = 0; j < table->sh_size / sizeof(Elf32_Sym); j++)
+      if (syms[j].st_name && syms[j].st_name < strings->sh_size &&
+          syms[j].st_shndx != SHN_UNDEF &&
+          memchr(names + syms[j].st_name, '\0',
+                 strings->sh_size - syms[j].st_name))
+        put(&symbols, names + syms[j].st_name, syms[j].st_value);
+  }
+}
+
+/*
+ Loads the ELF32 image filename written by asm -e. The file is mapped and
+ each PT_LOAD segment copied to its address, the rest of its memory size is
+ cleared. Its symbols are added to symbols, the lowest segment address is
+ returned through base. Returns the entry point, -1 if the image does not fit.
+ */
+int elfLoader(const char *filename, proc_state_t *pState, int *base) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < sizeof(Elf32_Ehdr)) {
+    fprintf(stderr, "Can't read %s\n", filename);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  uint8_t *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  Elf32_Ehdr *header = (Elf32_Ehdr *) image;
+  size_t size = st.st_size;
+  uint32_t limit = MEM_SIZE_WORDS * 4;
+  int entry = header->e_entry;
+  if (header->e_ident[EI_CLASS] != ELFCLASS32 ||
+      header->e_ident[EI_DATA] != ELFDATA2LSB || header->e_machine != EM_ARM ||
+      header->e_phentsize != sizeof(Elf32_Phdr) ||
+      header->e_phoff + (size_t) header->e_phnum * sizeof(Elf32_Phdr) > size ||
+      header->e_entry >= limit || header->e_entry % 4) {
+    fprintf(stderr, "%s is not an ELF32 ARM executable\n", filename);
+    entry = -1;
+  }
+  Elf32_Phdr *segments = (Elf32_Phdr *) (image + header->e_phoff);
+  *base = limit;
+  for (int i = 0; entry != -1 && i < header->e_phnum; i++) {
+    Elf32_Phdr *segment = &segments[i];
+    if (segment->p_type != PT_LOAD)
+      continue;
+    if (segment->p_vaddr % 4 || segment->p_filesz > segment->p_memsz ||
+        segment->p_memsz > limit || segment->p_vaddr > limit - segment->p_memsz ||
+        (size_t) segment->p_offset + segment->p_filesz > size) {
+      fprintf(stderr, "Segment %d of %s does not fit memory\n", i, filename);
+      entry = -1;
+      break;
+    }
+    uint8_t *memory = (uint8_t *) pState->memory + segment->p_vaddr;
+    memcpy(memory, image + segment->p_offset, segment->p_filesz);
+    memset(memory + segment->p_filesz, 0, segment->p_memsz - segment->p_filesz);
+    if (segment->p_vaddr < *base)
+      *base = segment->p_vaddr;
+  }
+  if (entry != -1)
+    elfSymbols(image, size);
+  munmap(image, size);
+  return entry;
+}
+
+/*
+ Returns the index of the source file name in debug_sources, adding it if it
+ is new. Returns -1 if there is no room for it.
+ */
+int debugSource(const char *name) {
+  for (int i = 0; i < debug_source_count; i++)
+    if (strcmp(debug_sources[i], name) == 0)
+      return i;
+  if (debug_source_count == MAX_DEBUG_SOURCES)
+    return -1;
+  debug_sources[debug_source_count] = copy(name);
+  return debug_source_count++;
+}
+
+/*
+ Reads the .dbg sidecar asm -g writes for an image loaded at byte address
+ addr. Its symbols are added to those the as command can use and its lines
+ to debug_lines. Returns false if the file can't be read.
+ */
+bool loadDebugInfo(const char *filename, int addr) {
+  FILE *in = fopen(filename, "r");
+  if (in == NULL)
+    return false;
+  char line[256], name[200];
+  unsigned int offset, number;
+  int source = -1;
+  while (fgets(line, sizeof(line), in)) {
+    if (sscanf(line, "source %199s", name) == 1)
+      source = debugSource(name);
+    else if (sscanf(line, "symbol %x %199s", &offset, name) == 2)
+      put(&symbols, name, addr + offset);
+    else if (sscanf(line, "line %x %u", &offset, &number) == 2 && source != -1 &&
+             (addr + offset) / 4 < MEM_SIZE_WORDS) {
+      debug_lines[(addr + offset) / 4] = number;
+      debug_files[(addr + offset) / 4] = source;
+    }
+  }
+  fclose(in);
+  return true;
+}
+
+/*
+ Loads the sidecar of the image filename loaded at addr, code.dbg for code.o,
+ when asm -g wrote one
+ */
+void loadDebugFor(const char *filename, int addr) {
+  char dbgfilename[256];
+  strncpy(dbgfilename, filename, sizeof(dbgfilename) - 5);
+  dbgfilename[sizeof(dbgfilename) - 5] = '\0';
+  char *ext = strrchr(dbgfilename, '.');
+  if (ext != NULL && strcmp(ext, ".o") == 0)
+    *ext = '\0';
+  strcat(dbgfilename, ".dbg");
+  if (loadDebugInfo(dbgfilename, addr))
+    printf("debug info: %s\n", dbgfilename);
+}
+
+/*
+ Loads the image filename with its debug info. An ELF image goes to the
+ addresses of its segments, a flat image to byte address addr. Returns the
+ address execution starts at, -1 if the image can't be loaded.
+ */
+int loadImage(const char *filename, proc_state_t *pState, int addr) {
+  if (isElf(filename)) {
+    int base;
+    int entry = elfLoader(filename, pState, &base);
+    if (entry != -1)
+      loadDebugFor(filename, base);
+    return entry;
+  }
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "File not found: %s\n", filename);
+    return -1;
+  }
+  if (addr < 0) {
+    fprintf(stderr, "%s is not an ELF image, give the address to load it at\n", filename);
+    fclose(file);
+    return -1;
+  }
+  memoryLoader(file, pState, addr/4);
+  loadDebugFor(filename, addr);
+  return addr;
+}
+
+void clearDebugInfo(void) {
+  for (int i = 0; i < debug_source_count; i++)
+    free(debug_sources[i]);
+  debug_source_count = 0;
+  memset(debug_lines, 0, sizeof(debug_lines));
+  clearMap(&symbols);
+}
+
+/*
+ Returns the symbol at or closest below byte address addr, NULL if none
+ */
+mapNode *findSymbol(int addr) {
+  mapNode *best = NULL;
+  for (mapNode *node = symbols.head; node; node = node->next)
+    if ((int)node->value <= addr && (best == NULL || node->value > best->value))
+      best = node;
+  return best;
+}
+
+/*
+ Prints " @ main+0x4 code.s:12" for byte address addr, as far as it is known.
+ The symbol is left out unless named is set.
+ */
+void printLocation(FILE *out, int addr, bool named) {
+  mapNode *symbol = named ? findSymbol(addr) : NULL;
+  bool known = addr >= 0 && addr / 4 < MEM_SIZE_WORDS && debug_lines[addr / 4];
+  if (symbol == NULL && !known)
+    return;
+  fprintf(out, " @");
+  if (symbol != NULL) {
+    fprintf(out, " %s", symbol->key);
+    if (addr != symbol->value)
+      fprintf(out, "+0x%x", addr - symbol->value);
+  }
+  if (known)
+    fprintf(out, " %s:%u", debug_sources[debug_files[addr / 4]], debug_lines[addr / 4]);
+}
+
+void printIrq(void) {
+  printf("timer load %d value %d control %d, %u ticks\n", timer.load,
+         timer.value, timer.control, timer.ticks);
+  printf("irq pending 0x%x enable 0x%x vector 0x%.8x", irq.pending, irq.enable,
+         irq.vector);
+  printLocation(stdout, irq.vector, true);
+  printf("\nreturn 0x%.8x flags 0x%.8x%s, %u taken\n", irq.ret, irq.flags,
+         irq.restore ? " to restore" : "", irq.taken);
+}
+
 /*
  pState->memory[] - array of int stored in big Endian
  */
@@ -864,8 +2690,12 @@ void memory_dump(proc_state_t *pState, int start_address, int num_words) {
  */
 void memory_list(proc_state_t *pState, int start_address, int num_words) {
     for (int i = start_address; i < start_address+num_words; i++) {
+        for (mapNode *node = symbols.head; node; node = node->next)
+          if (node->value == i << 2)
+            printf("%s:\n", node->key);
         printf("0x%08x:  ", i<<2);
         disassemble(pState->memory[i]);
+        printLocation(stdout, i << 2, false);
         printf("\n");
     }
 }
@@ -873,9 +2703,10 @@ void memory_list(proc_state_t *pState, int start_address, int num_words) {
 void printPipeline(pipeline_t *pl, proc_state_t *pState) {
   printf("executed: ");
   printf("0x%08x: ", pState->PC - 8);
-  if (pl->decoded != 0 && pl->decoded != -1)
+  if (pl->decoded != 0 && pl->decoded != -1) {
     disassemble(pl->decoded);
-  else
+    printLocation(stdout, pState->PC - 8, true);
+  } else
     printf("pl flushed");
   printf("   fetched: ");
   printf("0x%08x: ", pState->PC - 4);
@@ -897,6 +2728,112 @@ void printPipeline(pipeline_t *pl, proc_state_t *pState) {
     
 }
 
+/*
+ Counts one transfer of control from byte address from to byte address to
+ */
+void profileEdge(int from, int to) {
+  for (int i = 0; i < profile_edge_count; i++)
+    if (profile_edges[i].from == from && profile_edges[i].to == to) {
+      profile_edges[i].count++;
+      return;
+    }
+  if (profile_edge_count == profile_edge_capacity) {
+    profile_edge_capacity = profile_edge_capacity ? 2 * profile_edge_capacity : 16;
+    profile_edges = realloc(profile_edges, profile_edge_capacity * sizeof(profile_edge_t));
+    if (!profile_edges) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  profile_edge_t edge = {from, to, 1};
+  profile_edges[profile_edge_count++] = edge;
+}
+
+/*
+ Returns true if control was transferred to or from byte address addr
+ */
+bool isProfileEdge(int addr, bool to) {
+  for (int i = 0; i < profile_edge_count; i++)
+    if ((to ? profile_edges[i].to : profile_edges[i].from) == addr)
+      return true;
+  return false;
+}
+
+/*
+ Writes the profile as basic blocks and taken edges, numbers are hex
+   block first last count - words first to last, inclusive, ran count times
+   edge from to count     - control went from from to to count times
+   source file:line count - instructions of the line ran count times
+ Blocks and edges end with the symbol and source line of first or from when
+ debug info is loaded.
+ A block ends at a branch, at the source of an edge or before the target of
+ one. asm -p reads this to lay out the hot blocks of the profiled source.
+ */
+void writeProfile(FILE *out, proc_state_t *pState) {
+  fprintf(out, "# emu profile\n");
+  int first = -1;
+  for (int i = 0; i < MEM_SIZE_WORDS; i++) {
+    if (first != -1 && (profile_counts[i] != profile_counts[first] ||
+                        isProfileEdge(i * 4, true))) {
+      fprintf(out, "block 0x%08x 0x%08x %x", first * 4, (i - 1) * 4, profile_counts[first]);
+      printLocation(out, first * 4, true);
+      fprintf(out, "\n");
+      first = -1;
+    }
+    if (first == -1 && profile_counts[i])
+      first = i;
+    if (first != -1 && ((pState->memory[i] >> 26 & 3) == 2 || isProfileEdge(i * 4, false))) {
+      fprintf(out, "block 0x%08x 0x%08x %x", first * 4, i * 4, profile_counts[first]);
+      printLocation(out, first * 4, true);
+      fprintf(out, "\n");
+      first = -1;
+    }
+  }
+  if (first != -1)
+    fprintf(out, "block 0x%08x 0x%08x %x\n", first * 4, (MEM_SIZE_WORDS - 1) * 4, profile_counts[first]);
+  for (int i = 0; i < profile_edge_count; i++) {
+    fprintf(out, "edge 0x%08x 0x%08x %x", profile_edges[i].from, profile_edges[i].to, profile_edges[i].count);
+    printLocation(out, profile_edges[i].from, true);
+    fprintf(out, "\n");
+  }
+  // the instructions executed per source line
+  map lines = constructMap();
+  for (int i = 0; i < MEM_SIZE_WORDS; i++)
+    if (profile_counts[i] && debug_lines[i]) {
+      char key[256];
+      snprintf(key, sizeof(key), "%s:%u", debug_sources[debug_files[i]], debug_lines[i]);
+      uint32_t *count = get(lines, key);
+      put(&lines, key, profile_counts[i] + (count ? *count : 0));
+    }
+  for (mapNode *node = lines.head; node; node = node->next)
+    fprintf(out, "source %s %x\n", node->key, node->value);
+  clearMap(&lines);
+}
+
+void clearProfile(void) {
+  memset(profile_counts, 0, sizeof(profile_counts));
+  free(profile_edges);
+  profile_edges = NULL;
+  profile_edge_count = 0;
+  profile_edge_capacity = 0;
+}
+
+/*
+ Counts an instruction core pState retired. The timer and the interrupts
+ belong to core 0, returns true if an interrupt was taken.
+ */
+bool retired(proc_state_t *pState, pipeline_t *pl) {
+  if (pState->core)
+    return false;
+  deviceLock();
+  timerTick();
+  bool taken = takeInterrupt(pState, pl);
+  deviceUnlock();
+  if (taken && perfCounting(pState))
+    pState->perf.flushes++;
+  return taken;
+}
+
 /*
  Execute the pl->fetched instruction
  Updates pipeline
@@ -916,10 +2853,21 @@ int step(proc_state_t *pState, pipeline_t *pl, int ss, int printpl) {
   pState->regs[INDEX_PC] = pState->PC;
   pl->decoded = pl->fetched;
   pl->fetched = pState->memory[pState->PC / 4 - 1];
+  if (ss || printpl) // the trace follows the output of the step before
+    consoleFlush();
   if (printpl)
     printPipeline(pl, pState);
   if (pl->decoded != -1) {
-    executeInst(pl->decoded, pState, pl);
+    int executedAddr = pState->PC - 8;
+    if (executedAddr >= 0 && executedAddr / 4 < MEM_SIZE_WORDS)
+      profile_counts[executedAddr / 4]++;
+    int executed = pl->decoded;
+    executeInst(executed, pState, pl);
+    perfRetired(pState, executedAddr, executed, pl->decoded == -1);
+    if (pl->decoded == -1) // pipeline flushed, PC is the next fetch
+      profileEdge(executedAddr, pState->PC);
+    if (retired(pState, pl) && ss)
+      printf("Interrupt: 0x%.8x resumes at 0x%.8x\n", irq.pending, irq.ret);
     if (ss) {
       for (int reg = 0; reg < NUMBER_REGS; reg++)
         if (pState->prev_regs[reg] != pState->regs[reg]) {
@@ -945,8 +2893,10 @@ int step(proc_state_t *pState, pipeline_t *pl, int ss, int printpl) {
   }
   // PC-4 is addr of fetched. BP hit when pl->breakpoiont == PC-4
   if (pl->breakpoint != -1 && (pState->PC - 4) == pl->breakpoint) {
+    consoleFlush();
     printf("Breakpoint hit: %08x: ", pState->PC - 4);
     disassemble(pl->fetched);
+    printLocation(stdout, pState->PC - 4, true);
     printf("\n");
     status = 1;
   }
@@ -954,6 +2904,148 @@ int step(proc_state_t *pState, pipeline_t *pl, int ss, int printpl) {
   return status;
 }
 
+/*
+ The part of go one core runs, steps counts down the instructions left
+ */
+struct core_run {
+  int core;
+  int steps;
+  bool breakpoint;
+  pthread_t thread;
+};
+
+typedef struct core_run core_run_t;
+
+/*
+ run_stop is set once a core of go reaches its breakpoint, run_active counts
+ the threads of go running a started core
+ */
+static int run_stop = 0;
+static int run_active = 0;
+
+/*
+ Steps a core like step, without its trace and profile
+ */
+void runStep(proc_state_t *pState, pipeline_t *pl) {
+  pState->PC += 4;
+  pState->regs[INDEX_PC] = pState->PC;
+  pl->decoded = pl->fetched;
+  pl->fetched = pState->memory[pState->PC / 4 - 1];
+  if (pl->decoded != -1) {
+    int executed = pl->decoded, executedAddr = pState->PC - 8;
+    executeInst(executed, pState, pl);
+    perfRetired(pState, executedAddr, executed, pl->decoded == -1);
+    retired(pState, pl);
+  }
+}
+
+/*
+ Runs a QUANTUM, or the steps left if fewer, of the core of run. Returns
+ true if the core reached its breakpoint.
+ */
+bool runQuantum(core_run_t *run) {
+  proc_state_t *pState = &core_states[run->core];
+  pipeline_t *pl = &core_pipelines[run->core];
+  int steps = run->steps < QUANTUM ? run->steps : QUANTUM;
+  for (int i = 0; i < steps; i++) {
+    runStep(pState, pl);
+    if (pl->breakpoint != -1 && pState->PC - 4 == pl->breakpoint) {
+      run->steps -= i + 1;
+      run->breakpoint = true;
+      return true;
+    }
+  }
+  run->steps -= steps;
+  return false;
+}
+
+/*
+ The thread of a core, it waits for CORE_START while any other core runs
+ */
+void *runCore(void *arg) {
+  core_run_t *run = arg;
+  int *running = &core_states[run->core].running;
+  bool active = __atomic_load_n(running, __ATOMIC_SEQ_CST);
+  while (run->steps > 0 && !__atomic_load_n(&run_stop, __ATOMIC_SEQ_CST)) {
+    if (!active) {
+      if (!__atomic_load_n(running, __ATOMIC_SEQ_CST)) {
+        // a core that stopped running may have started this one last
+        if (!__atomic_load_n(&run_active, __ATOMIC_SEQ_CST) &&
+            !__atomic_load_n(running, __ATOMIC_SEQ_CST))
+          break;
+        sched_yield();
+        continue;
+      }
+      active = true;
+      __atomic_add_fetch(&run_active, 1, __ATOMIC_SEQ_CST);
+    }
+    if (runQuantum(run))
+      __atomic_store_n(&run_stop, 1, __ATOMIC_SEQ_CST);
+  }
+  if (active)
+    __atomic_sub_fetch(&run_active, 1, __ATOMIC_SEQ_CST);
+  return NULL;
+}
+
+/*
+ Runs every core for steps instructions, or until one of them reaches its
+ breakpoint. Each core runs on a host thread of its own, unless there is
+ only one or deterministic is set: then the cores take turns, a QUANTUM
+ each, in the order of their numbers. A core waiting for CORE_START starts
+ with the steps it has left.
+ */
+void go(int steps) {
+  core_run_t runs[MAX_CORES];
+  for (int i = 0; i < core_count; i++) {
+    runs[i].core = i;
+    runs[i].steps = steps;
+    runs[i].breakpoint = false;
+  }
+  run_stop = 0;
+  if (core_count == 1 || deterministic) {
+    bool more = true;
+    while (more && !run_stop) {
+      more = false;
+      for (int i = 0; i < core_count && !run_stop; i++)
+        if (core_states[i].running && runs[i].steps > 0) {
+          run_stop = runQuantum(&runs[i]);
+          more = true;
+        }
+    }
+  } else {
+    run_active = 0;
+    for (int i = 0; i < core_count; i++)
+      run_active += core_states[i].running;
+    for (int i = 0; i < core_count; i++)
+      if (pthread_create(&runs[i].thread, NULL, runCore, &runs[i])) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+      }
+    for (int i = 0; i < core_count; i++)
+      pthread_join(runs[i].thread, NULL);
+  }
+  consoleFlush();
+  for (int i = 0; i < core_count; i++)
+    if (runs[i].breakpoint) {
+      pipeline_t *pl = &core_pipelines[i];
+      printf("Breakpoint hit on core %d: %08x: ", i, pl->breakpoint);
+      disassemble(pl->fetched);
+      printLocation(stdout, pl->breakpoint, true);
+      printf("\n");
+    }
+}
+
+void printCores(void) {
+  for (int i = 0; i < core_count; i++) {
+    proc_state_t *core = &core_states[i];
+    printf("core %d%s %s PC 0x%.8x%s", i, i == current_core ? "*" : " ",
+           core->running ? "running" : "stopped", core->PC - 4,
+           core->SVC ? " kernel" : "");
+    printLocation(stdout, core->PC - 4, true);
+    printf("\n");
+  }
+}
+
 /*
   Prints non-zero memory in Big and Little Endian
  */
@@ -1042,6 +3134,14 @@ int number(char *s) {
   return positive ? ans : -ans;
 }
 
+/*
+  Converts s, a symbol or a hex number, to a byte address
+ */
+int address(char *s) {
+  uint32_t *value = get(symbols, s);
+  return value ? (int)*value : number(s);
+}
+
 static char whitespace[] = " \t\r\n\v";
 
 int getstr(char **ps, char *es, char **str) {
@@ -1091,6 +3191,42 @@ static int mem_dump_len = MEM_DUMP_LEN;
 static int mem_list_addr = 0;
 static int mem_list_len = MEM_DUMP_LEN;
 
+/*
+ Assembles source for byte address addr and copies the image into memory.
+ Labels loaded by earlier as commands can be referenced, the labels of source
+ are added to them, as are its lines when it was read from file filename
+ (may be NULL). A fetched instruction that was overwritten is refetched.
+ Returns the number of words written, -1 if source has errors
+ */
+int assembleToMemory(proc_state_t *pState, pipeline_t *pipeline, int addr, char *source,
+                     const char *filename) {
+  asmResult result;
+  if (!assembleSource(source, addr, &symbols, NULL, &result)) {
+    printAsmErrors(stderr, &result);
+    clearAsmResult(&result);
+    return -1;
+  }
+  if (addr / 4 + result.size > MEM_SIZE_WORDS) {
+    fprintf(stderr, "%s\n", "assembled code does not fit in memory.");
+    clearAsmResult(&result);
+    return -1;
+  }
+  memcpy(&pState->memory[addr / 4], result.words, result.size * sizeof(uint32_t));
+  for (mapNode *node = result.symbols.head; node; node = node->next)
+    put(&symbols, node->key, node->value);
+  int source_index = filename != NULL ? debugSource(filename) : -1;
+  for (int i = 0; i < (int)result.size; i++) {
+    debug_lines[addr / 4 + i] = source_index != -1 ? result.lines[i] : 0;
+    debug_files[addr / 4 + i] = source_index != -1 ? source_index : 0;
+  }
+  int fetchedAddr = pState->PC - 4;
+  if (fetchedAddr >= addr && fetchedAddr < addr + (int)result.size * 4)
+    pipeline->fetched = pState->memory[fetchedAddr / 4];
+  int size = result.size;
+  clearAsmResult(&result);
+  return size;
+}
+
 int do_cmd(int argc, char **cmdargv, proc_state_t *pState, pipeline_t *pipeline) {
   bool finished = false;
   int retval = 1;
@@ -1147,10 +3283,12 @@ int do_cmd(int argc, char **cmdargv, proc_state_t *pState, pipeline_t *pipeline)
     }
     else
       finished = step(pState, pipeline, ss, 1);
+  } else if (cmdargv[0][0] == 'd' && cmdargv[0][1] == 'm') {
+    printDma();
   } else if (cmdargv[0][0] == 'd') {
     int t = 0;
     if (argc > 1) { // at least d addr
-      t = number(cmdargv[1]);
+      t = address(cmdargv[1]);
       mem_dump_addr = t >= 0 ? t/4 : mem_dump_addr;
     }
     if (argc > 2) { // we have d addr len
@@ -1160,21 +3298,19 @@ int do_cmd(int argc, char **cmdargv, proc_state_t *pState, pipeline_t *pipeline)
     memory_dump(pState, mem_dump_addr, mem_dump_len);
     mem_dump_addr += mem_dump_len;
   } else if (cmdargv[0][0] == 'l' && cmdargv[0][1] == 'd') {
-    if (argc != 3) { // must issue ld filename addr
+    if (argc != 2 && argc != 3) { // must issue ld filename addr
       fprintf(stderr, "%s\n", "format is ld filename addr");
     } else {
-      int addr  = number(cmdargv[2]);
-      if (addr < 0)
+      int addr  = argc == 3 ? number(cmdargv[2]) : -1;
+      if (argc == 3 && addr < 0)
         fprintf(stderr, "%s\n", "invalid address on ld command.");
-      else {
-        FILE *file = fopen(cmdargv[1], "rb");
-        memoryLoader(file, pState, addr/4);
-      }
+      else
+        loadImage(cmdargv[1], pState, addr);
     }
   } else if (cmdargv[0][0] == 'l') {
     int t = 0;
     if (argc > 1) { // at least l addr
-      t = number(cmdargv[1]);
+      t = address(cmdargv[1]);
       mem_list_addr = t >= 0 ? t/4 : mem_list_addr;
     }
     if (argc > 2) { // we have l addr len
@@ -1208,9 +3344,28 @@ int do_cmd(int argc, char **cmdargv, proc_state_t *pState, pipeline_t *pipeline)
     }
     else
       fprintf(stderr, "%s\n", "format is m addr value");
+  } else if (cmdargv[0][0] == 'p' && cmdargv[0][1] == 'e') {
+    if (argc == 2 && !strcmp(cmdargv[1], "c"))
+      perfWrite(pState, PERF_RESET | (pState->perf.control & PERF_FREEZE));
+    else if (argc != 1)
+      fprintf(stderr, "%s\n", "invalid argument on perf command.");
+    printPerf(pState);
+  } else if (cmdargv[0][0] == 'p' && cmdargv[0][1] == 'r') {
+    if (cmdargv[0][2] == 'c') { // prc - clear the profile
+      clearProfile();
+    } else if (argc > 1) { // pr file.prof - write the profile to a file
+      FILE *out = fopen(cmdargv[1], "w");
+      if (out == NULL)
+        fprintf(stderr, "Can't write %s\n", cmdargv[1]);
+      else {
+        writeProfile(out, pState);
+        fclose(out);
+      }
+    } else
+      writeProfile(stdout, pState);
   } else if (cmdargv[0][0] == 'p' && cmdargv[0][1] == 'l') {
     if (argc > 1) { // pl 300 - set state to begin execution at addr 300
-      int addr = number(cmdargv[1]);
+      int addr = address(cmdargv[1]);
       if (addr == -1 || addr > MEM_SIZE_WORDS-mem_list_len) {
         fprintf(stderr, "%s\n", "invalid addr on pl command.");
       }
@@ -1222,15 +3377,35 @@ int do_cmd(int argc, char **cmdargv, proc_state_t *pState, pipeline_t *pipeline)
       }
     } else
       printPipeline(pipeline, pState);
+  } else if (cmdargv[0][0] == 'b' && cmdargv[0][1] == 'l') {
+    printBlock();
   } else if (cmdargv[0][0] == 'b') {
-    if (argc > 1) { // b addr - set a break point
-      int addr = number(cmdargv[1]);
+    if (argc > 1) { // b addr - set a break point, addr may be a symbol
+      int addr = address(cmdargv[1]);
       if (addr < 0)
         pipeline->breakpoint = -1;
       else
         pipeline->breakpoint = addr;
-    } else
-      printf("breakpoint: 0x%08x\n", pipeline->breakpoint);
+    } else {
+      printf("breakpoint: 0x%08x", pipeline->breakpoint);
+      printLocation(stdout, pipeline->breakpoint, true);
+      printf("\n");
+    }
+  } else if (cmdargv[0][0] == 'c' && cmdargv[0][1] == 'o') {
+    if (argc > 1) { // core 1 - the commands act on core 1
+      int core = number(cmdargv[1]);
+      if (core < 0 || core >= core_count)
+        fprintf(stderr, "%s\n", "invalid core on core command.");
+      else
+        current_core = core;
+    }
+    printCores();
+  } else if (cmdargv[0][0] == 'g') {
+    int steps = argc == 2 ? number(cmdargv[1]) : -1;
+    if (steps < 0)
+      fprintf(stderr, "%s\n", "format is go steps");
+    else
+      go(steps);
   } else if (cmdargv[0][0] == 'c' && cmdargv[0][1] == 'p') {
     if (argc != 3) {
       fprintf(stderr, "%s\n", "format is cp addr string");
@@ -1250,6 +3425,69 @@ int do_cmd(int argc, char **cmdargv, proc_state_t *pState, pipeline_t *pipeline)
         }
       }
     } 
+  } else if (cmdargv[0][0] == 'a' && cmdargv[0][1] == 's') {
+    if (argc != 3) { // must issue as addr file.s
+      fprintf(stderr, "%s\n", "format is as addr file.s");
+    } else {
+      int addr = number(cmdargv[1]);
+      char *source = readSourceFile(cmdargv[2]);
+      if (addr < 0 || addr % 4)
+        fprintf(stderr, "%s\n", "invalid address on as command.");
+      else if (source == NULL)
+        fprintf(stderr, "File not found: %s\n", cmdargv[2]);
+      else {
+        int words = assembleToMemory(pState, pipeline, addr, source, cmdargv[2]);
+        if (words >= 0)
+          printf("assembled %s: %d words at 0x%08x\n", cmdargv[2], words, addr);
+      }
+      free(source);
+    }
+  } else if (cmdargv[0][0] == 'a') {
+    if (argc < 3) { // must issue a addr instruction
+      fprintf(stderr, "%s\n", "format is a addr instruction");
+    } else {
+      int addr = number(cmdargv[1]);
+      if (addr < 0 || addr % 4)
+        fprintf(stderr, "%s\n", "invalid address on a command.");
+      else {
+        char line[200] = "";
+        for (int i = 2; i < argc; i++) {
+          strncat(line, cmdargv[i], sizeof(line) - strlen(line) - 2);
+          strcat(line, " ");
+        }
+        int words = assembleToMemory(pState, pipeline, addr, line, NULL);
+        if (words > 0)
+          memory_list(pState, addr / 4, words);
+      }
+    }
+  } else if (cmdargv[0][0] == 'h' && cmdargv[0][1] == 'e') {
+    if (argc == 2 && !strcmp(cmdargv[1], "l"))
+      printHeap(pState, true);
+    else if (argc == 1)
+      printHeap(pState, false);
+    else
+      fprintf(stderr, "%s\n", "invalid argument on heap command.");
+  } else if (cmdargv[0][0] == 'h') {
+    if (argc == 2 && !strcmp(cmdargv[1], "on"))
+      hle_enabled = true;
+    else if (argc == 2 && !strcmp(cmdargv[1], "off"))
+      hle_enabled = false;
+    else if (argc == 2 && !strcmp(cmdargv[1], "c"))
+      for (int i = 0; i < HLE_SERVICES; i++)
+        hle_services[i].calls = 0;
+    else if (argc != 1)
+      fprintf(stderr, "%s\n", "invalid argument on hle command.");
+    printHle();
+  } else if (cmdargv[0][0] == 'i' && cmdargv[0][1] == 'r') {
+    printIrq();
+  } else if (cmdargv[0][0] == 'i') {
+    for (int i = 1; i < argc; i++)
+      if (!consoleQueue(cmdargv[i]))
+        fprintf(stderr, "%s\n", "input queue full on in command.");
+    printf("input queued:");
+    for (int i = console_next; i < console_queued; i += strlen(console_queue + i) + 1)
+      printf(" %s", console_queue + i);
+    printf("\n");
   } else if (cmdargv[0][0] == '.') {
     for (int i = 0; i < strlen(cmdargv[0]); i++) // cp the null char also
       cmdargv[0][i] = cmdargv[0][i+1];
@@ -1262,10 +3500,11 @@ int do_cmd(int argc, char **cmdargv, proc_state_t *pState, pipeline_t *pipeline)
   else {
     fprintf(stderr, "%s\n", "Invalid command.");
   }
+  consoleFlush();
   return retval;
 }
 
-void do_script(char *scriptfilename, proc_state_t *pState, pipeline_t *pipeline) {
+void do_script(char *scriptfilename) {
   printf("< redirect from script. file: %s\n", scriptfilename);
   cmdargv[0] = ""; // prevent seg fault when first cmd is empty line
   FILE *fp = fopen(scriptfilename, "r");
@@ -1277,7 +3516,7 @@ void do_script(char *scriptfilename, proc_state_t *pState, pipeline_t *pipeline)
       char *es = s + strlen(s);
       int argc = 0;
       cmdargv[0] = "";
-      while (getstr(&s, es, &str) != 0) {
+      while (argc < MAXARGS - 1 && getstr(&s, es, &str) != 0) {
         cmdargv[argc] = str;
         //printf("%s\n", cmdargv[argc]);
         argc++;
@@ -1285,7 +3524,8 @@ void do_script(char *scriptfilename, proc_state_t *pState, pipeline_t *pipeline)
       cmdargv[argc] = 0;
       if (argc > 0) {
         if (cmdargv[0][0] != '<') {
-          if (do_cmd(argc, cmdargv, pState, pipeline) == 0)
+          if (do_cmd(argc, cmdargv, &core_states[current_core],
+                     &core_pipelines[current_core]) == 0)
             break;
         }
       }
@@ -1298,6 +3538,10 @@ void do_script(char *scriptfilename, proc_state_t *pState, pipeline_t *pipeline)
 /*
  Commands - all numbers are hex regardless of prefix. You can omit 0x or prepend with 0x, either way > hex 
  Addresses are truncated to previous addr that is a multiple of 4. E.g., 105 becomes 104
+ The addresses of d, l, pl and b can also be symbols, such as b main, when the
+ code was loaded with as or with the code.dbg sidecar asm -g writes for code.o.
+ Listings, breakpoints, pipeline traces and profiles then show symbols and
+ source lines.
  r - show regs
  r 1 - show reg 1
  r 1 10 - modify reg 1, put 16 into r1
@@ -1316,6 +3560,13 @@ void do_script(char *scriptfilename, proc_state_t *pState, pipeline_t *pipeline)
  d - dump 8 words of memory, starting at where last dump ended
  d 500 - dump 8 words of memory starting at 500
  d 500 20 - dump 20 words of memory starting at 500
+ dma - show the registers of the DMA engine and the bytes it moved
+ blk - show the block device, its registers and the sectors it moved
+ irq - show the timer and the interrupt controller, see takeInterrupt
+ core - show the cores of emu -n, the commands act on the one marked *
+ core 1 - the commands act on core 1
+ go 100000 - run every core 0x100000 steps or until one reaches its breakpoint,
+             see go
  l - list 8 words of memory, starting at where last list ended, list disassembles 32-bits
  l 500 - list 8 words of memory starting at 500
  l 500 20 - list 20 words of memory starting at 500
@@ -1327,13 +3578,31 @@ void do_script(char *scriptfilename, proc_state_t *pState, pipeline_t *pipeline)
           - N=-1, negative random number between 0 and 100
           - N=-2, negative random number between 0 and 200
  pl - show pipeline
+ pr - show the execution profile, block counts and taken branches
+ pr prog.prof - write the execution profile for asm -p
+ prc - clear the execution profile
+ perf - show the performance counters of the core, see perfWrite
+ perf c - clear them
  pl 400 - set pipeline to begin execution at address 400
  cp 500 abc - copy abc to address 500, null terminated
- ld file.o 100 - load file.o into memory beginning at addres 100
+ ld file.o 100 - load file.o into memory beginning at addres 100, with file.dbg
+                if there is one
+ ld file.o - load the ELF image file.o (asm -e) at the addresses of its segments
+ as 100 file.s - assemble file.s for address 100 and load it there, labels of
+                 earlier as commands can be used by later ones
+ a 100 mov r0, #1 - assemble one instruction and patch it in at address 100
+ hle - show whether svc services are emulated natively and their call counts
+ hle on - emulate the services of os.s natively, see executeSvc
+ hle off - enter the OS on every svc
+ hle c - clear the call counts
+ heap - show the blocks and free space of the os.s heap, with its fragmentation
+ heap l - also list every block with its payload address and size
+ in 42 abc - queue 42 and abc for the guest to read, before any -i file or
+             stdin, in alone shows the queue
  .ls - run the ls command as a child process, . prefixes Linux commands
  < file.emu - run the script file.emu
  */
-void gustyCycle(proc_state_t *pState, pipeline_t *pipeline) {
+void gustyCycle(void) {
   //pipeline_t pipeline = {-1, -1, -1};
   //bool finished = false;
   // Initialisation
@@ -1348,7 +3617,7 @@ void gustyCycle(proc_state_t *pState, pipeline_t *pipeline) {
     char *str;
     int argc = 0;
     cmdargv[0] = ""; // prevent seg fault when first cmd is empty line
-    while (getstr(&s, es, &str) != 0) {
+    while (argc < MAXARGS - 1 && getstr(&s, es, &str) != 0) {
       cmdargv[argc] = str;
       //printf("%s\n", cmdargv[argc]);
       argc++;
@@ -1356,11 +3625,12 @@ void gustyCycle(proc_state_t *pState, pipeline_t *pipeline) {
     cmdargv[argc] = 0;
     if (argc > 0) {
       if (cmdargv[0][0] != '<') {
-        if (do_cmd(argc, cmdargv, pState, pipeline) == 0)
+        if (do_cmd(argc, cmdargv, &core_states[current_core],
+                   &core_pipelines[current_core]) == 0)
           break;
       }
       else {
-        do_script(cmdargv[1], pState, pipeline);
+        do_script(cmdargv[1]);
       }
     }
   }
@@ -1371,9 +3641,33 @@ void gustyCycle(proc_state_t *pState, pipeline_t *pipeline) {
   $ emu -o code.o : run emu, load OS, load code.o at address 0, SP is set 
   $ emu -o code.o arg1 arg2 : run emu, load os, load code.o at address 0, arg1/2 passed on stack
   $ emu --OS newos.o code.o arg1 arg2 : like prev, but newos.o is loaded
-  -o or --os : load OS as part of emu, os is in os.o
+  -o or --os : load OS as part of emu, os is in os.o, assembled for its load
+  address with asm -b 1000 os.s
   -f file.o or --OS file.o : load OS as part of emu. OS in file.o
-  The proc_state_t member memory[] is an array of 16384 words, 65K bytes of memory.
+  -H or --hle : run the os.s services natively instead of in the OS, as the
+  hle on command does, SP and the heap are set up even without an OS
+  -i file or --input file : the guest reads its input from file instead of
+  stdin, without prompts
+  -R file or --record file : log every value the guest reads to file, -i file
+  replays the run with the same input
+  -c file or --console file : write the guest output to file instead of stdout
+  -b file or --block file : map file as the block device, sectors of 512 bytes
+  the guest reads and writes with the readsectors and writesectors services
+  -n N or --cores N : emulate N cores sharing memory, core 0 starts at the
+  entry point and the others once a store to CORE_START starts them, see
+  startCores. go runs the cores on host threads of their own
+  -d or --deterministic : go runs the cores in turns on one thread instead,
+  the same way every time
+  $ emu -o -R run.in code.o   // interactive run, the input is kept in run.in
+  $ emu -o -i run.in -c run.out -s batch.emu code.o // the same run in batch
+  $ emu -n 4 -H -s go.emu sum.o // sum.o sums in parallel on 4 cores
+  $ emu -o -s jobs.emu main.o // jobs.emu loads job.o, asm -b 400 job.s, with
+                              // ld job.o 400, main runs it beside itself with
+                              // the spawn service of os.s
+  Images written by asm -e are ELF32 executables. They are loaded at the
+  addresses of their segments and start at their entry point, svc enters an
+  ELF OS at its entry point. Flat images go to USER_ADDR and OS_ADDR.
+  The proc_state_t member memory is an array of 16384 words, 65K bytes of memory.
   65K is loads of memory. For now, we keep everything below 8192.
   Memory Layout
   0 - 4095 : user space
@@ -1383,12 +3677,19 @@ void gustyCycle(proc_state_t *pState, pipeline_t *pipeline) {
   16384 : Start of Stack, grows down (toward 0)
   0x4000 : Start of Stack, grows down (toward 0)
   8192 : Start of Heap, grows up (toward 65K-1)
-  0x2000 : Start of Heap, grows up (toward 65K-1)
+  0x2000 : Start of Heap, grows up (toward 0x3000), the stack below it
  */
 static struct option long_options[] = {
   {"os",     no_argument,       0,  'o' },
   {"OS",     required_argument, 0,  'f' },
   {"script", required_argument, 0,  's' },
+  {"hle",    no_argument,       0,  'H' },
+  {"input",  required_argument, 0,  'i' },
+  {"record", required_argument, 0,  'R' },
+  {"console", required_argument, 0, 'c' },
+  {"block",  required_argument, 0,  'b' },
+  {"cores",  required_argument, 0,  'n' },
+  {"deterministic", no_argument, 0, 'd' },
   {0,        0,                 0,   0  }
 };
 
@@ -1398,7 +3699,7 @@ static char *scriptfilename = "no script";
 int main(int argc, char **argv) {
   int load_os = 0, use_script = 0;
   int opt, long_index;
-  while ((opt = getopt_long(argc, argv, "of:s:", long_options, &long_index )) != -1) {
+  while ((opt = getopt_long(argc, argv, "of:s:Hi:R:c:b:n:d", long_options, &long_index )) != -1) {
     switch (opt) {
       case 'o': 
         load_os = 1;
@@ -1412,6 +3713,31 @@ int main(int argc, char **argv) {
          use_script = 1;
          scriptfilename = optarg;
          break;
+      case 'H':
+         hle_enabled = true;
+         break;
+      case 'i':
+         console_input = consoleOpen(optarg, "r");
+         break;
+      case 'R':
+         console_record = consoleOpen(optarg, "w");
+         break;
+      case 'c':
+         console_file = consoleOpen(optarg, "w");
+         break;
+      case 'b':
+         blockOpen(optarg);
+         break;
+      case 'n':
+         core_count = atoi(optarg);
+         if (core_count < 1 || core_count > MAX_CORES) {
+           fprintf(stderr, "emu runs 1 to %d cores\n", MAX_CORES);
+           exit(EXIT_FAILURE);
+         }
+         break;
+      case 'd':
+         deterministic = true;
+         break;
       default: 
         printf("Invalid invocation.\n");
         exit(EXIT_FAILURE);
@@ -1425,50 +3751,57 @@ int main(int argc, char **argv) {
     return EXIT_FAILURE;
   }
   //fprintf(stdout, "optind: %d argc: %d\n", optind, argc);
-  proc_state_t *pStatePtr = (proc_state_t *) malloc(sizeof(proc_state_t));
-  // Initialize state to 0
-  pStatePtr->NEG = 0;
-  pStatePtr->ZER = 0;
-  pStatePtr->CRY = 0;
-  pStatePtr->OVF = 0;
-  pStatePtr->PC = 0;
-  for(int i = 0; i < MEM_SIZE_WORDS; i++) {
-    pStatePtr->memory[i] = 0;
-  }
-  for(int i = 0; i < NUMBER_REGS; i++) {
-    pStatePtr->regs[i] = 0;
-  }
-  //End Initialisation
-  if(!pStatePtr) {
+  // Initialize state to 0, the cores share the memory
+  core_states = (proc_state_t *) calloc(core_count, sizeof(proc_state_t));
+  core_pipelines = (pipeline_t *) calloc(core_count, sizeof(pipeline_t));
+  int *memory = (int *) calloc(MEM_SIZE_WORDS, sizeof(int));
+  if (!core_states || !core_pipelines || !memory) {
     perror("calloc");
     exit(EXIT_FAILURE);
   }
+  for (int i = 0; i < core_count; i++) {
+    core_states[i].core = i;
+    core_states[i].running = i == 0;
+    core_states[i].exclusive = -1;
+    core_states[i].memory = memory;
+    core_pipelines[i] = (pipeline_t) {-1, -1, -1};
+  }
+  proc_state_t *pStatePtr = &core_states[0];
+  estimateCycles(0); // sets up the cost model before the cores share it
+  //End Initialisation
   if (load_os) {
-    FILE *osf = fopen(osfilename, "rb");
-    if (osf == NULL) {
-      fprintf(stderr, "File not found: %s\n", osfilename==NULL ? "os filename" : osfilename);
+    os_entry = loadImage(osfilename, pStatePtr, OS_ADDR);
+    if (os_entry < 0)
       return EXIT_FAILURE;
-    }
-    memoryLoader(osf, pStatePtr, OS_ADDR/4);
+  }
+  if (load_os || hle_enabled) {
     pStatePtr->regs[13] = STACK_ADDR;
-    pStatePtr->memory[0x2000/4] = 0x2004; // heap free memory pointer
+    pStatePtr->memory[HEAP_ADDR/4] = HEAP_START; // heap top
   }
-  FILE *file = fopen(argv[0], "rb");
-  if (file == NULL) {
-    fprintf(stderr, "File not found: %s\n", argv[0]);
+  int entry = loadImage(argv[0], pStatePtr, USER_ADDR);
+  if (entry < 0)
     return EXIT_FAILURE;
-  }
-  memoryLoader(file, pStatePtr, 0);
-  pipeline_t pipeline = {-1, -1, -1};
   // Initialize pipeline
-  pStatePtr->PC = 4;
+  pStatePtr->PC = entry + 4;
   pStatePtr->regs[INDEX_PC] = pStatePtr->PC;
-  pipeline.fetched = pStatePtr->memory[0];
+  core_pipelines[0].fetched = pStatePtr->memory[entry/4];
   if (use_script) {
-    do_script(scriptfilename, pStatePtr, &pipeline);
+    do_script(scriptfilename);
   }
   srand(time(0)); // initialize for rand() to work
-  gustyCycle(pStatePtr, &pipeline);
-  free(pStatePtr);
+  gustyCycle();
+  consoleFlush();
+  if (console_input)
+    fclose(console_input);
+  if (console_record)
+    fclose(console_record);
+  if (console_file)
+    fclose(console_file);
+  blockClose();
+  clearProfile();
+  clearDebugInfo();
+  free(memory);
+  free(core_pipelines);
+  free(core_states);
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <getopt.h>
+#include "adts.h"
+#include "object.h"
+
+#define NDEBUG
+
+#define MEMORY_SIZE 4
+#define PC_OFFSET 2
+#define BRANCH_RANGE (1 << 23)
+#define MAX_MODULES 64
+
+/**
+ * A relocatable object read from disk together with the word offsets its
+ * text and data sections are given in the linked image
+ */
+typedef struct {
+  char      *filename;
+  objHeader header;
+  uint32_t  *words;
+  objSymbol *symbols;
+  objReloc  *relocs;
+  uint32_t  textBase;
+  uint32_t  dataBase;
+} module;
+
+/**
+* Reads the relocatable object filename into mod
+* Returns false and appends an error if the file is missing or malformed
+**/
+bool readModule(char *filename, module *mod, vector *errorVector);
+
+/* Frees everything read by readModule */
+void clearModule(module *mod);
+
+/**
+* Returns the byte address in the image of a value of the module, values
+* past the end of the text section lie in the data section
+**/
+uint32_t placeValue(module *mod, uint32_t value);
+
+/**
+* Adds every global symbol of the module to globalSymbols
+* Throws an error if the symbol is already defined by another module
+**/
+void collectGlobals(module *mod, map *globalSymbols, vector *errorVector);
+
+/**
+* Copies the sections of the module into the image and patches every
+* relocation, externs are looked up in globalSymbols
+**/
+void relocate(module *mod, uint32_t image[], uint32_t base,
+              map globalSymbols, vector *errorVector);
+
+/* Appends "file: message name." to the errorVector */
+void throwLinkError(char *filename, char *message, char *name,
+                    vector *errorVector);
+
+/* Reads a hex number with an optional 0x prefix */
+uint32_t getAddress(char *s);
+
+/*
+  $ lnk a.o b.o                  // links into a.out.o and a.txt
+  $ lnk -o prog.o main.o lib.o   // links into prog.o and a.txt
+  $ lnk -o os.o -b 1000 os.o     // image that is loaded at address 0x1000
+  $ lnk -t prog.txt main.o lib.o // writes the hex listing to prog.txt
+  Objects are created with asm -r. The text sections of all objects are
+  placed first, in command line order, followed by all data sections.
+  The output is a flat image that can be loaded with emu or ld.
+ */
+static struct option long_options[] = {
+  {"obj",    required_argument, 0,  'o' },
+  {"txt",    required_argument, 0,  't' },
+  {"base",   required_argument, 0,  'b' },
+  {0,        0,                 0,   0  }
+};
+
+int main(int argc, char **argv) {
+  char *objfilenameptr = "a.out.o", *txtfilenameptr = "a.txt";
+  uint32_t base = 0;
+  int opt, long_index;
+
+  while ((opt = getopt_long(argc, argv, "o:t:b:", long_options, &long_index )) != -1) {
+    switch (opt) {
+      case 'o':
+        objfilenameptr = optarg;
+        break;
+      case 't':
+        txtfilenameptr = optarg;
+        break;
+      case 'b':
+        base = getAddress(optarg);
+        break;
+      default:
+        printf("Invalid invocation.\n");
+        exit(EXIT_FAILURE);
+    }
+  }
+  argc -= optind;
+  argv += optind;
+  if (argc < 1 || argc > MAX_MODULES) {
+    fprintf(stderr, "%s optind: %d argc: %d\n", "Wrong number of arguments", optind, argc);
+    return EXIT_FAILURE;
+  }
+  if (base % MEMORY_SIZE) {
+    fprintf(stderr, "The base address 0x%x is not word aligned\n", base);
+    return EXIT_FAILURE;
+  }
+
+  vector errorVector = constructVector();
+  module modules[MAX_MODULES];
+  int moduleCount = 0;
+  for (int i = 0; i < argc; i++) {
+    if (readModule(argv[i], &modules[moduleCount], &errorVector)) {
+      moduleCount++;
+    }
+  }
+
+  // lay out all text sections followed by all data sections
+  uint32_t location = base / MEMORY_SIZE;
+  for (int i = 0; i < moduleCount; i++) {
+    modules[i].textBase = location;
+    location += modules[i].header.textSize;
+  }
+  for (int i = 0; i < moduleCount; i++) {
+    modules[i].dataBase = location;
+    location += modules[i].header.dataSize;
+  }
+  uint32_t imageSize = location - base / MEMORY_SIZE;
+
+  map globalSymbols = constructMap();
+  for (int i = 0; i < moduleCount; i++) {
+    collectGlobals(&modules[i], &globalSymbols, &errorVector);
+  }
+
+  uint32_t *image = calloc(imageSize ? imageSize : 1, sizeof(uint32_t));
+  if (!image) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < moduleCount; i++) {
+    relocate(&modules[i], image, base, globalSymbols, &errorVector);
+  }
+
+  for (int i = 0; i < moduleCount; i++) {
+    clearModule(&modules[i]);
+  }
+  clearMap(&globalSymbols);
+
+  // if we have link errors stop and print errors
+  if (!isEmptyVector(errorVector)) {
+    while (!isEmptyVector(errorVector)) {
+      char *error = getFront(&errorVector);
+      fprintf(stderr, "%s\n", error);
+      free(error);
+    }
+
+    clearVector(&errorVector);
+    free(image);
+    exit(EXIT_FAILURE);
+  }
+
+  printf(".o: %s, .txt: %s, base: 0x%x, words: %d\n", objfilenameptr,
+         txtfilenameptr, base, imageSize);
+  FILE *output = fopen(objfilenameptr, "wb");
+  fwrite(image, sizeof(uint32_t), imageSize, output);
+  fclose(output);
+  FILE *hex = fopen(txtfilenameptr, "w");
+  for (int i = 0; i < imageSize; i++)
+    fprintf(hex, "0x%08x\n", image[i]);
+  fclose(hex);
+  free(image);
+  clearVector(&errorVector);
+  exit(EXIT_SUCCESS);
+}
+
+bool readModule(char *filename, module *mod, vector *errorVector) {
+  FILE *input = fopen(filename, "rb");
+  if (!input) {
+    throwLinkError(filename, "The file was not found", "", errorVector);
+    return false;
+  }
+
+  mod->filename = filename;
+  mod->words    = NULL;
+  mod->symbols  = NULL;
+  mod->relocs   = NULL;
+  if (fread(&mod->header, sizeof(objHeader), 1, input) != 1 ||
+      mod->header.magic != OBJ_MAGIC) {
+    throwLinkError(filename, "Not a relocatable object, assemble with asm -r",
+                   "", errorVector);
+    fclose(input);
+    return false;
+  }
+
+  uint32_t words = mod->header.textSize + mod->header.dataSize;
+  mod->words   = malloc((words ? words : 1) * sizeof(uint32_t));
+  mod->symbols = malloc((mod->header.symbolCount ? mod->header.symbolCount : 1)
+                        * sizeof(objSymbol));
+  mod->relocs  = malloc((mod->header.relocCount ? mod->header.relocCount : 1)
+                        * sizeof(objReloc));
+  if (!mod->words || !mod->symbols || !mod->relocs) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  if (fread(mod->words, sizeof(uint32_t), words, input) != words ||
+      fread(mod->symbols, sizeof(objSymbol), mod->header.symbolCount, input)
+        != mod->header.symbolCount ||
+      fread(mod->relocs, sizeof(objReloc), mod->header.relocCount, input)
+        != mod->header.relocCount) {
+    throwLinkError(filename, "The object is truncated", "", errorVector);
+    clearModule(mod);
+    fclose(input);
+    return false;
+  }
+
+  fclose(input);
+  return true;
+}
+
+void clearModule(module *mod) {
+  free(mod->words);
+  free(mod->symbols);
+  free(mod->relocs);
+  mod->words   = NULL;
+  mod->symbols = NULL;
+  mod->relocs  = NULL;
+}
+
+uint32_t placeValue(module *mod, uint32_t value) {
+  uint32_t textBytes = mod->header.textSize * MEMORY_SIZE;
+  if (value < textBytes) {
+    return mod->textBase * MEMORY_SIZE + value;
+  }
+
+  return mod->dataBase * MEMORY_SIZE + value - textBytes;
+}
+
+void collectGlobals(module *mod, map *globalSymbols, vector *errorVector) {
+  for (uint32_t i = 0; i < mod->header.symbolCount; i++) {
+    objSymbol *symbol = &mod->symbols[i];
+    symbol->name[OBJ_NAME_LENGTH - 1] = '\0';
+    if (symbol->binding != OBJ_GLOBAL) {
+      continue;
+    }
+
+    if (get(*globalSymbols, symbol->name)) {
+      throwLinkError(mod->filename, "Multiple definitions of the global symbol",
+                     symbol->name, errorVector);
+    } else {
+      put(globalSymbols, symbol->name, placeValue(mod, symbol->value));
+    }
+  }
+}
+
+void relocate(module *mod, uint32_t image[], uint32_t base,
+              map globalSymbols, vector *errorVector) {
+  uint32_t first = base / MEMORY_SIZE;
+  memcpy(image + mod->textBase - first, mod->words,
+         mod->header.textSize * sizeof(uint32_t));
+  memcpy(image + mod->dataBase - first, mod->words + mod->header.textSize,
+         mod->header.dataSize * sizeof(uint32_t));
+
+  for (uint32_t i = 0; i < mod->header.relocCount; i++) {
+    objReloc *reloc = &mod->relocs[i];
+    if (reloc->symbol >= mod->header.symbolCount ||
+        reloc->offset % MEMORY_SIZE ||
+        reloc->offset >= (mod->header.textSize + mod->header.dataSize)
+                         * MEMORY_SIZE) {
+      throwLinkError(mod->filename, "Invalid relocation", "", errorVector);
+      continue;
+    }
+
+    objSymbol *symbol = &mod->symbols[reloc->symbol];
+    uint32_t target;
+    if (symbol->binding == OBJ_EXTERN) {
+      uint32_t *address = get(globalSymbols, symbol->name);
+      if (!address) {
+        throwLinkError(mod->filename, "Undefined reference to", symbol->name,
+                       errorVector);
+        continue;
+      }
+      target = *address;
+    } else {
+      target = placeValue(mod, symbol->value);
+    }
+
+    uint32_t site = placeValue(mod, reloc->offset);
+    uint32_t *word = &image[site / MEMORY_SIZE - first];
+    switch (reloc->type) {
+      case RELOC_BRANCH24: {
+        int32_t offset = (int32_t) (target / MEMORY_SIZE)
+                         - (int32_t) (site / MEMORY_SIZE) - PC_OFFSET;
+        if (offset >= BRANCH_RANGE || offset < -BRANCH_RANGE) {
+          throwLinkError(mod->filename, "Branch out of range to", symbol->name,
+                         errorVector);
+        }
+        *word = (*word & 0xFF000000) | (offset & 0x00FFFFFF);
+        break;
+      }
+      case RELOC_ABS32:
+        // the assembler left the symbol's own value plus the addend of
+        // label + constant in the word, externs had the value zero
+        *word = target + *word -
+                (symbol->binding == OBJ_EXTERN ? 0 : symbol->value);
+        break;
+      default:
+        throwLinkError(mod->filename, "Unknown relocation type for",
+                       symbol->name, errorVector);
+    }
+  }
+}
+
+void throwLinkError(char *filename, char *message, char *name,
+                    vector *errorVector) {
+  char *error = malloc(strlen(filename) + strlen(message) + strlen(name) + 8);
+  strcpy(error, filename);
+  strcat(error, ": ");
+  strcat(error, message);
+  if (strlen(name)) {
+    strcat(error, " ");
+    strcat(error, name);
+  }
+  strcat(error, ".");
+  putBack(errorVector, error);
+  free(error);
+}
+
+uint32_t getAddress(char *s) {
+  return (uint32_t) strtoul(s, NULL, 16);
+}
@@ -0,0 +1,59 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+/**
+ * Relocatable object format written by asm -r and read by lnk
+ *
+ * +-----------+
+ * | objHeader |
+ * +-----------+
+ * | text      | textSize words, instructions followed by the literal pool
+ * +-----------+
+ * | data      | dataSize words
+ * +-----------+
+ * | symbols   | symbolCount objSymbol records
+ * +-----------+
+ * | relocs    | relocCount objReloc records
+ * +-----------+
+ *
+ * All offsets and symbol values are byte offsets from the start of the
+ * object's text, data follows text directly.
+ */
+#define OBJ_MAGIC 0x4a424f54 // "TOBJ" when read as little endian bytes
+#define OBJ_NAME_LENGTH 64
+
+/* Symbol bindings */
+#define OBJ_LOCAL  0 // label only visible inside the object
+#define OBJ_GLOBAL 1 // label exported with .global
+#define OBJ_EXTERN 2 // symbol imported with .extern, value is unused
+
+/* Relocation types */
+#define RELOC_BRANCH24 0 // b/bl 24-bit PC relative word offset
+#define RELOC_ABS32    1 // 32-bit absolute byte address (ldr literal, .word),
+                         // the word holds the symbol value plus an addend
+
+typedef struct objHeader objHeader;
+typedef struct objSymbol objSymbol;
+typedef struct objReloc objReloc;
+
+struct objHeader {
+  uint32_t magic;
+  uint32_t textSize;
+  uint32_t dataSize;
+  uint32_t symbolCount;
+  uint32_t relocCount;
+};
+
+struct objSymbol {
+  char     name[OBJ_NAME_LENGTH];
+  uint32_t value;
+  uint32_t binding;
+};
+
+struct objReloc {
+  uint32_t offset;
+  uint32_t type;
+  uint32_t symbol; // index into the symbol table
+};
+
+#endif
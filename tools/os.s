@@ -1,9 +1,63 @@
-cmp r0, #1
-beq scanfintfunc
-cmp r0, #2
-beq printfintfunc
-cmp r0, #3
-beq malloc
+// Routines other objects may link against, assemble with asm -r
+// The service table holds absolute addresses, so the OS must be assembled
+// for the address it is loaded at: asm -b 1000 os.s for emu -o,
+// asm -e -b 1000 os.s, or asm -r and lnk -b 1000
+// A service takes its arguments in r1-r3 and returns its result in r0. It
+// may change r1-r3, r12 and the flags and keeps the other registers. Linked
+// programs can also bl the global labels directly, except the ones using the
+// memory mapped I/O, which only works in kernel mode.
+.global scanfintfunc, printfintfunc, malloc, divide, memcpy, memset, strlen
+.global addservice, free, realloc, memcmp, strcpy, itoa, atoi, printf
+.global readsectors, writesectors, spawn, yield, exit, perfcounters
+.equ SERVICE_SLOTS, 24
+.equ HEAP_TOP, 0x2000
+.equ HEAP_LISTS, 0x2004
+.equ HEAP_START, 0x2028
+.equ HEAP_END, 0x3000
+.equ HEAP_SMALL, 72
+.equ PRINTF_SIZE, 128
+.equ DMA_BASE, 0x20200040
+.equ DMA_MIN, 64
+.equ BLOCK_BASE, 0x20200060
+.equ TIMER_BASE, 0x20200080
+.equ IRQ_BASE, 0x20200090
+.equ TIME_SLICE, 200
+.equ TASK_MAX, 4
+.equ CORE_ID, 0x202000A4
+.equ PERF_BASE, 0x202000C0
+.equ PERF_COUNTERS, 7
+// svc enters here with the service number in r0, numbers outside the table
+// (and negative ones, the compare is unsigned) return -1
+cmp r0, #SERVICE_SLOTS
+ldrlo r15, [r15, r0, lsl #2] // r15 reads 8 ahead, the start of the table
+b retminusone
+// the service table, svc n jumps to the address in word n
+services:
+.word retminusone   // 0
+.word scanfintfunc  // 1
+.word printfintfunc // 2
+.word malloc        // 3
+.word divide        // 4
+.word memcpy        // 5
+.word memset        // 6
+.word strlen        // 7
+.word addservice    // 8
+.word free          // 9
+.word realloc       // 10
+.word memcmp        // 11
+.word strcpy        // 12
+.word itoa          // 13
+.word atoi          // 14
+.word printf        // 15
+.word readsectors   // 16
+.word writesectors  // 17
+.word spawn         // 18
+.word yield         // 19
+.word exit          // 20
+.word perfcounters  // 21
+.rept SERVICE_SLOTS - 22
+.word retminusone   // free, see addservice
+.endr
 // return -1
 retminusone:
 mov r0, #0
@@ -22,35 +76,752 @@ printfintfunc:
 ldr r0, =0x20200000
 str r1, [r0]
 mov r15, r14
+// The heap is a boundary tag allocator between HEAP_START and HEAP_END.
+// HEAP_TOP holds top, the start of the space never handed out, and the 9
+// words at HEAP_LISTS the heads of the free lists. Lists 0-7 hold the free
+// blocks of 16, 24, ... 72 bytes, list 8 all larger free blocks.
+// A block is a header word, the payload and a footer word. Both tags hold
+// the block size in bytes, a multiple of 8, with bit 0 set while the block
+// is allocated. A free block keeps the next and the previous block of its
+// list in its first two payload words, 0 ends the list.
+// The heap helpers are called with bl and return with ldr r15, which stays
+// in kernel mode where mov r15 and pop {r15} would leave it.
 // malloc function, r0=3, r1=num_of_bytes
-// return address in r0
-// mallocs num_of_bytes rounded up to a multiple of 4
-// ask for 10, get 12
-// Heap memory begins at 0x2004 and grows up
-// pStatePtr->memory[0x2000/4] has the next available address
-// pStatePtr->memory[0x2000/4] = 0x2004; is the intial value
+// returns the address of num_of_bytes in r0, -1 for 0 or a negative number
+// of bytes and when the heap is full
 malloc:
-cmp r1, #0       // must ask for a positive number of bytes
-ble retminusone  // return -1 for 0 or negative number of bytes
-and r2, r1, #3   // examine bottom two bits of number of bytes
-cmp r2, #3       // asking for 3 bytes
-bne try2
-add r1, r1, #1   // add 1 to make a multiple of 4
-b mallocmem
-try2:
-cmp r2, #2       // asking for 2 bytes
-bne try1
-add r1, r1, #2   // add 2 to make a multiple of 4
-bne mallocmem
-try1:
-cmp r2, #1       // asking for 1 byte
-bne mallocmem
-add r1, r1, #3   // add 3 to make a multiple of 4
-// At this point r1 has a multiple of 4 bytes
-mallocmem:
-ldr r2, =0x2000  // put heap address in r2
-ldr r3, [r2]     // get next free address from heap pointer
-mov r0, r3       // ret value, address of malloced memory
-add r3, r3, r1   // update next free address, add num of bytes requested
-str r3, [r2]     // store next free address in heap pointer
+cmp r1, #0
+ble retminusone
+cmp r1, #HEAP_END
+bhs retminusone
+push {r4, r14}
+add r4, r1, #15
+bic r4, r4, #7       // the payload rounded up to 8 and the two tags
+bl heapalloc
+pop {r4, r15}
+// free function, r0=9, r1=address returned by malloc or realloc
+// returns 0 in r0, freeing 0 does nothing
+free:
+push {r4, r14}
+bl heapfree
+mov r0, #0
+pop {r4, r15}
+// realloc function, r0=10, r1=address returned by malloc or realloc,
+// r2=num_of_bytes
+// returns the address of the resized block in r0, its bytes are kept up to
+// the smaller of the sizes. An address of 0 mallocs, a size of 0 or less
+// frees and returns 0, -1 if there is no room and the block is left as is
+realloc:
+cmp r1, #0
+moveq r1, r2
+beq malloc
+cmp r2, #0
+ble free
+cmp r2, #HEAP_END
+bhs retminusone
+push {r4, r5, r6, r14}
+add r4, r2, #15
+bic r4, r4, #7       // r4 the new block size
+sub r5, r1, #4       // r5 the block
+ldr r6, [r5]
+bic r6, r6, #1       // r6 its size
+cmp r4, r6
+bls reallocsame      // a smaller size keeps the block
+ldr r3, =HEAP_TOP
+ldr r2, [r3]
+add r0, r5, r6
+cmp r0, r2
+bne reallocmove
+add r0, r5, r4       // the last block grows into top
+cmp r0, #HEAP_END
+bhi reallocmove
+str r0, [r3]
+orr r0, r4, #1
+str r0, [r5]
+add r2, r5, r4
+str r0, [r2, #-4]
+reallocsame:
+add r0, r5, #4
+pop {r4, r5, r6, r15}
+reallocmove:         // copy the payload to a new block, free the old one
+bl heapalloc
+mvn r1, #0
+cmp r0, r1
+beq reallocdone
+add r1, r5, #4
+sub r2, r6, #8
+mov r3, r0
+reallocloop:
+cmp r2, #0
+beq reallocfree
+ldr r12, [r1], #4
+str r12, [r3], #4
+sub r2, r2, #4
+b reallocloop
+reallocfree:
+push {r0}
+add r1, r5, #4
+bl heapfree
+pop {r0}
+reallocdone:
+pop {r4, r5, r6, r15}
+// heapalloc, returns in r0 the payload of a new block of r4 bytes, -1 if
+// there is no room. Blocks of up to 72 bytes come off their list in O(1),
+// larger ones are the first fit of list 8, split if the rest is a block,
+// or are cut from top.
+heapalloc:
+push {r14}
+mov r1, r4
+cmp r4, #HEAP_SMALL
+bhi heapfit
+bl heaplist
+ldr r0, [r3]
+cmp r0, #0
+beq heapfit
+bl heapunlink
+b heaptake
+heapfit:
+ldr r3, =HEAP_LISTS
+ldr r0, [r3, #32]
+heapfitloop:
+cmp r0, #0
+beq heapbump
+ldr r1, [r0]
+cmp r1, r4
+bhs heapsplit
+ldr r0, [r0, #4]
+b heapfitloop
+heapsplit:
+bl heapunlink
+sub r1, r1, r4
+cmp r1, #16
+addlo r4, r4, r1     // the rest can't be a block, hand out all of it
+blo heaptake
+push {r0}
+add r0, r0, r4
+bl heapinsert
+pop {r0}
+b heaptake
+heapbump:
+ldr r3, =HEAP_TOP
+ldr r0, [r3]
+ldr r1, =HEAP_START
+cmp r0, r1
+movlo r0, r1         // top is set up by the first allocation
+add r1, r0, r4
+cmp r1, #HEAP_END
+mvnhi r0, #0
+bhi heapdone
+str r1, [r3]
+heaptake:            // marks the block r0 of r4 bytes allocated
+orr r1, r4, #1
+str r1, [r0]
+add r2, r0, r4
+str r1, [r2, #-4]
+add r0, r0, #4
+heapdone:
+ldr r15, [r13], #4
+// heapfree, frees the payload r1, merging the block with free neighbours
+// and giving it back to top if it ends there
+heapfree:
+push {r14}
+cmp r1, #0
+beq heapfreedone
+sub r0, r1, #4
+ldr r4, [r0]
+bic r4, r4, #1       // r4 the size of the block r0
+ldr r3, =HEAP_TOP
+ldr r3, [r3]
+add r2, r0, r4
+cmp r2, r3
+bhs heapfreeprev
+ldr r1, [r2]
+tst r1, #1
+bne heapfreeprev
+push {r0}
+mov r0, r2
+bl heapunlink        // the next block is free
+pop {r0}
+add r4, r4, r1
+heapfreeprev:
+ldr r1, =HEAP_START
+cmp r0, r1
+bls heapfreetop
+ldr r1, [r0, #-4]
+tst r1, #1
+bne heapfreetop
+sub r0, r0, r1
+bl heapunlink        // the previous block is free
+add r4, r4, r1
+heapfreetop:
+ldr r3, =HEAP_TOP
+ldr r2, [r3]
+add r1, r0, r4
+cmp r1, r2
+streq r0, [r3]
+beq heapfreedone
+mov r1, r4
+bl heapinsert
+heapfreedone:
+ldr r15, [r13], #4
+// heaplist, returns in r3 the address of the head of the list of the free
+// blocks of r1 bytes
+heaplist:
+push {r14}
+ldr r3, =HEAP_LISTS
+cmp r1, #HEAP_SMALL
+addhi r3, r3, #32
+movls r12, r1, lsr #3
+subls r12, r12, #2
+addls r3, r3, r12, lsl #2
+ldr r15, [r13], #4
+// heapunlink, takes the free block r0 of r1 bytes off its list
+heapunlink:
+push {r14}
+ldr r2, [r0, #4]     // next
+ldr r12, [r0, #8]    // previous
+cmp r2, #0
+strne r12, [r2, #8]
+cmp r12, #0
+strne r2, [r12, #4]
+bne heapunlinked
+bl heaplist
+str r2, [r3]
+heapunlinked:
+ldr r15, [r13], #4
+// heapinsert, writes the tags of the free block r0 of r1 bytes and puts it
+// at the head of its list
+heapinsert:
+push {r14}
+str r1, [r0]
+add r2, r0, r1
+str r1, [r2, #-4]
+bl heaplist
+ldr r2, [r3]
+str r2, [r0, #4]
+mov r12, #0
+str r12, [r0, #8]
+cmp r2, #0
+strne r0, [r2, #8]
+str r0, [r3]
+ldr r15, [r13], #4
+// divide function, r0=4, r1=dividend, r2=divisor
+// returns the signed quotient in r0 and the remainder in r1
+// dividing by 0 returns 0 and leaves the dividend as the remainder
+divide:
+sdiv r0, r1, r2
+mul r3, r0, r2
+sub r1, r1, r3
+mov r15, r14
+// memcpy function, r0=5, r1=destination, r2=source, r3=num_of_bytes
+// returns the destination in r0, the regions must not overlap. DMA_MIN
+// bytes and more go to the DMA engine at DMA_BASE. Otherwise, when both
+// addresses are word aligned, 16 bytes go per ldm/stm pair, then single
+// words, only the last bytes are copied one at a time
+memcpy:
+mov r0, r1
+cmp r3, #DMA_MIN
+bge memcpydma
+orr r12, r1, r2
+tst r12, #3
+bne memcpybytes
+cmp r3, #16
+blt memcpywords
+push {r4, r5, r6, r7}
+memcpyblocks:
+ldmia r2!, {r4-r7}
+stmia r1!, {r4-r7}
+sub r3, r3, #16
+cmp r3, #16
+bge memcpyblocks
+pop {r4, r5, r6, r7}
+memcpywords:
+cmp r3, #4
+ldrge r12, [r2], #4
+strge r12, [r1], #4
+subge r3, r3, #4
+bge memcpywords
+memcpybytes:
+subs r3, r3, #1
+ldrbge r12, [r2], #1
+strbge r12, [r1], #1
+bgt memcpybytes
+mov r15, r14
+memcpydma:
+ldr r12, =DMA_BASE
+str r2, [r12]       // source
+str r1, [r12, #4]   // destination
+str r3, [r12, #8]   // length
+mov r3, #1
+str r3, [r12, #12]  // copy, done once the store completes
+mov r15, r14
+// memset function, r0=6, r1=destination, r2=byte, r3=num_of_bytes
+// returns the destination in r0. DMA_MIN bytes and more are filled by the
+// DMA engine. Otherwise the bytes up to the first word boundary are stored
+// singly, then 16 bytes per stm and single words
+memset:
+mov r0, r1
+cmp r3, #DMA_MIN
+bge memsetdma
+and r2, r2, #0xff
+orr r2, r2, r2, lsl #8
+orr r2, r2, r2, lsl #16 // the byte in all four lanes
+memsetalign:
+tst r1, #3
+beq memsetwords
+subs r3, r3, #1
+strbge r2, [r1], #1
+bgt memsetalign
+mov r15, r14
+memsetwords:
+cmp r3, #16
+blt memsettail
+push {r4, r5}
+mov r4, r2
+mov r5, r2
+mov r12, r2
+memsetblocks:
+stmia r1!, {r2, r4, r5, r12}
+sub r3, r3, #16
+cmp r3, #16
+bge memsetblocks
+pop {r4, r5}
+memsettail:
+cmp r3, #4
+strge r2, [r1], #4
+subge r3, r3, #4
+bge memsettail
+memsetbytes:
+subs r3, r3, #1
+strbge r2, [r1], #1
+bgt memsetbytes
+mov r15, r14
+memsetdma:
+ldr r12, =DMA_BASE
+str r1, [r12, #4]   // destination
+str r3, [r12, #8]   // length
+str r2, [r12, #20]  // fill byte
+mov r3, #2
+str r3, [r12, #12]  // fill
+mov r15, r14
+// strlen function, r0=7, r1=address of a null terminated string
+// returns the number of bytes before the null in r0. From the first word
+// boundary on a word is tested at a time, (w - 0x01010101) & ~w & 0x80808080
+// is not 0 exactly when one of the bytes of w is 0
+strlen:
+mov r0, r1
+strlenalign:
+tst r0, #3
+beq strlenwords
+ldrb r12, [r0], #1
+cmp r12, #0
+bne strlenalign
+b strlenfound
+strlenwords:
+ldr r2, =0x01010101
+strlenloop:
+ldr r12, [r0], #4
+sub r3, r12, r2
+bic r3, r3, r12
+tst r3, r2, lsl #7
+beq strlenloop
+sub r0, r0, #4      // the word holds the null, find its byte
+strlenbyte:
+ldrb r12, [r0], #1
+cmp r12, #0
+bne strlenbyte
+strlenfound:
+sub r0, r0, #1
+sub r0, r0, r1
+mov r15, r14
+// memcmp function, r0=11, r1=address1, r2=address2, r3=num_of_bytes
+// returns in r0 the first differing byte of address1 less the one of
+// address2, 0 if the bytes are equal. Equal words are skipped 4 bytes at a
+// time when both addresses are word aligned
+memcmp:
+orr r12, r1, r2
+tst r12, #3
+bne memcmpbytes
+memcmpwords:
+cmp r3, #4
+blt memcmpbytes
+ldr r0, [r1], #4
+ldr r12, [r2], #4
+cmp r0, r12
+subeq r3, r3, #4
+beq memcmpwords
+sub r1, r1, #4      // the word differs, find its byte
+sub r2, r2, #4
+memcmpbytes:
+subs r3, r3, #1
+movlt r0, #0
+movlt r15, r14
+ldrb r0, [r1], #1
+ldrb r12, [r2], #1
+subs r0, r0, r12
+beq memcmpbytes
+mov r15, r14
+// strcpy function, r0=12, r1=destination, r2=null terminated source
+// copies the string with its null, returns the destination in r0. When both
+// addresses are word aligned the words without a null go whole, tested as
+// in strlen
+strcpy:
+mov r0, r1
+orr r12, r1, r2
+tst r12, #3
+bne strcpybytes
+push {r4}
+ldr r4, =0x01010101
+strcpywords:
+ldr r12, [r2]
+sub r3, r12, r4
+bic r3, r3, r12
+tst r3, r4, lsl #7
+streq r12, [r1], #4
+addeq r2, r2, #4
+beq strcpywords
+pop {r4}
+strcpybytes:
+ldrb r12, [r2], #1
+strb r12, [r1], #1
+cmp r12, #0
+bne strcpybytes
+mov r15, r14
+// itoa function, r0=13, r1=value, r2=buffer of at least 12 bytes
+// writes the value in decimal, with a leading - if it is negative, and a
+// null to the buffer, returns the number of characters in r0
+itoa:
+push {r14}
+bl decimal
+pop {r15}
+// decimal, the itoa of r1 into the buffer r2 for printf, it returns with
+// ldr r15 like the heap helpers
+decimal:
+push {r4, r5, r14}
+mov r0, r2          // r0 the next free byte
+cmp r1, #0
+movlt r12, #45      // -
+strblt r12, [r0], #1
+rsblt r1, r1, #0    // the most negative value stays, unsigned it is right
+mov r3, r0          // r3 the first digit
+mov r4, #10
+decimalloop:        // the digits come last first
+udiv r5, r1, r4
+mul r12, r5, r4
+sub r12, r1, r12
+add r12, r12, #48
+strb r12, [r0], #1
+movs r1, r5
+bne decimalloop
+strb r1, [r0]
+sub r5, r0, r2      // r5 the length
+sub r0, r0, #1
+decimalreverse:
+cmp r3, r0
+bhs decimaldone
+ldrb r12, [r3]
+ldrb r4, [r0]
+strb r4, [r3], #1
+strb r12, [r0], #-1
+b decimalreverse
+decimaldone:
+mov r0, r5
+pop {r4, r5}
+ldr r15, [r13], #4
+// atoi function, r0=14, r1=address of a string
+// returns in r0 the value of the decimal digits at the address, after an
+// optional + or -, and in r1 the address of the first byte after them
+atoi:
+mov r0, #0
+ldrb r3, [r1]       // r3 the sign
+cmp r3, #45
+cmpne r3, #43
+addeq r1, r1, #1
+atoiloop:
+ldrb r12, [r1], #1
+sub r12, r12, #48
+cmp r12, #9
+bhi atoidone
+add r0, r0, r0, lsl #2
+add r0, r12, r0, lsl #1 // r0 * 10 + the digit
+b atoiloop
+atoidone:
+sub r1, r1, #1
+cmp r3, #45
+rsbeq r0, r0, #0
+mov r15, r14
+// printf function, r0=15, r1=format, r2=address of the argument words
+// formats like C printf and prints the text through 0x20200004, the memory
+// mapped I/O for strings. %d, %x, %c and %s each take the next argument
+// word, any other character after % is copied, so %% gives %. The text is
+// cut after PRINTF_SIZE bytes, returns its length in r0
+printf:
+push {r4, r5, r6, r7, r14}
+mov r4, r1          // r4 the format
+mov r5, r2          // r5 the next argument
+ldr r6, =printfbuffer // r6 the next free byte
+add r7, r6, #PRINTF_SIZE
+printfloop:
+cmp r6, r7
+bhs printfend
+ldrb r12, [r4], #1
+cmp r12, #0
+beq printfend
+cmp r12, #37        // %
+bne printfchar
+ldrb r12, [r4], #1
+cmp r12, #100       // d
+beq printfint
+cmp r12, #120       // x
+beq printfhex
+cmp r12, #115       // s
+beq printfstr
+cmp r12, #99        // c
+ldreq r12, [r5], #4
+beq printfchar
+cmp r12, #0
+subeq r4, r4, #1    // a % ending the format is printed as is
+moveq r12, #37
+printfchar:
+strb r12, [r6], #1
+b printfloop
+printfint:          // the buffer has room for 11 more bytes
+ldr r1, [r5], #4
+mov r2, r6
+bl decimal
+add r6, r6, r0
+b printfloop
+printfhex:
+ldr r1, [r5], #4
+mov r3, #8          // r3 the digits left
+printfhexskip:      // leading zeros are dropped, the last digit is kept
+cmp r3, #1
+beq printfhexdigit
+tst r1, #0xf0000000
+moveq r1, r1, lsl #4
+subeq r3, r3, #1
+beq printfhexskip
+printfhexdigit:
+mov r12, r1, lsr #28
+cmp r12, #10
+addlo r12, r12, #48
+addhs r12, r12, #87 // a less 10
+strb r12, [r6], #1
+mov r1, r1, lsl #4
+subs r3, r3, #1
+bne printfhexdigit
+b printfloop
+printfstr:
+ldr r1, [r5], #4
+printfstrloop:
+cmp r6, r7
+bhs printfend
+ldrb r12, [r1], #1
+cmp r12, #0
+strbne r12, [r6], #1
+bne printfstrloop
+b printfloop
+printfend:
+mov r12, #0
+strb r12, [r6]
+ldr r1, =printfbuffer
+ldr r12, =0x20200004
+str r1, [r12]
+sub r0, r6, r1
+pop {r4, r5, r6, r7, r15}
+// readsectors function, r0=16, r1=first sector, r2=address,
+// r3=number_of_sectors
+// reads the sectors of 512 bytes of the block device into memory, returns
+// 0 in r0, -1 if they are not on the device or don't fit memory
+readsectors:
+mov r0, #1
+b sectors
+// writesectors function, r0=17, r1=first sector, r2=address,
+// r3=number_of_sectors
+// writes memory to the sectors of the block device, returns as readsectors
+writesectors:
+mov r0, #2
+sectors:
+ldr r12, =BLOCK_BASE
+str r1, [r12]       // sector
+str r3, [r12, #4]   // count
+str r2, [r12, #8]   // address
+str r0, [r12, #12]  // command
+sectorswait:        // the status is 0 until the transfer completes
+ldr r0, [r12, #16]
+cmp r0, #0
+beq sectorswait
+cmp r0, #1
+moveq r0, #0
+mvnne r0, #0
+mov r15, r14
+// perfcounters function, r0=21, r1=address of PERF_COUNTERS words or 0,
+// r2=control
+// copies the performance counters of the core to r1, instructions, cycles,
+// branches, flushes, loads, stores and svcs, then writes r2 to their control,
+// 1 zeroes them and 2 freezes them. Returns 0 in r0. The counts include the
+// svc and the few instructions of the service before it freezes them.
+perfcounters:
+ldr r12, =PERF_BASE
+mov r0, #2
+str r0, [r12]       // freeze, the copy is not counted
+cmp r1, #0
+beq perfcontrol
+mov r3, #PERF_COUNTERS
+perfcopy:
+ldr r0, [r12, #4]!
+str r0, [r1], #4
+subs r3, r3, #1
+bne perfcopy
+ldr r12, =PERF_BASE
+perfcontrol:
+str r2, [r12]
+mov r0, #0
+mov r15, r14
+// The scheduler runs up to TASK_MAX tasks round robin, a time slice of
+// TIME_SLICE instructions each. Task 0 is the program emu started, spawn
+// adds the others. A task that is not running keeps its registers in a
+// frame on its own stack, r0-r12, r14 and the address it resumes at, and
+// the tasks table its stack pointer and flags, a stack pointer of 0 marks
+// a free slot. The timer interrupt and yield save the frame of the running
+// task and schedule pops the one of the next task.
+// The tasks all run on core 0, which takes the timer interrupt, spawn,
+// yield and exit return -1 on the other cores of emu -n.
+// spawn function, r0=18, r1=address of the program, r2=top of its stack
+// starts the program as a new task with its registers 0 and returns the
+// task number in r0, -1 if TASK_MAX tasks run. The first spawn starts the
+// timer.
+spawn:
+ldr r12, =CORE_ID
+ldr r12, [r12]
+cmp r12, #0
+bne retminusone
+ldr r12, =tasks
+mov r0, #1
+spawnslot:
+cmp r0, #TASK_MAX
+bhs retminusone
+ldr r3, [r12, r0, lsl #3]
+cmp r3, #0
+addne r0, r0, #1
+bne spawnslot
+str r1, [r2, #-4]!  // the frame, where the task starts
+mov r1, #0
+mov r3, #14
+spawnframe:         // and its registers
+str r1, [r2, #-4]!
+subs r3, r3, #1
+bne spawnframe
+add r12, r12, r0, lsl #3
+str r2, [r12]
+str r1, [r12, #4]   // flags
+ldr r12, =IRQ_BASE
+ldr r1, =irqhandler
+str r1, [r12, #8]   // vector
+mov r1, #1
+str r1, [r12, #4]   // enable the timer interrupt
+ldr r12, =TIMER_BASE
+ldr r1, [r12, #8]   // control
+cmp r1, #0
+moveq r1, #TIME_SLICE
+streq r1, [r12]     // load
+moveq r1, #1
+streq r1, [r12, #8]
+mov r15, r14
+// yield function, r0=19
+// gives the rest of the time slice to the next task, returns 0 in r0
+yield:
+ldr r12, =CORE_ID
+ldr r12, [r12]
+cmp r12, #0
+bne retminusone
+sub r13, r13, #4
+push {r0-r12, r14}
+str r14, [r13, #56] // the task resumes after the svc
+mov r0, #0
+str r0, [r13]       // with r0 0
+mov r2, #0          // a service may change the flags
+b schedule
+// exit function, r0=20
+// ends the running task and never returns, exit of the last task returns
+// -1 and it keeps running, the scheduler would spin in kernel mode
+exit:
+ldr r12, =CORE_ID
+ldr r12, [r12]
+cmp r12, #0
+bne retminusone
+ldr r12, =tasks
+ldr r3, =taskcurrent
+ldr r0, [r3]
+mov r1, #0
+exitother:          // a task other than the running one is left
+cmp r1, #TASK_MAX
+bhs retminusone
+cmp r1, r0
+ldrne r2, [r12, r1, lsl #3]
+cmpne r2, #0
+addeq r1, r1, #1
+beq exitother
+mov r1, #0
+str r1, [r12, r0, lsl #3]
+b schedulenext
+// the timer interrupt enters here, the registers are those of the task
+irqhandler:
+sub r13, r13, #4
+push {r0-r12, r14}
+ldr r0, =IRQ_BASE
+ldr r1, [r0, #12]   // where the task was interrupted
+str r1, [r13, #56]
+ldr r2, [r0, #16]   // its flags
+mov r1, #1
+str r1, [r0]        // clear the timer interrupt
+// saves r13, the frame of the running task, and r2, its flags, then pops
+// the frame of the next task
+schedule:
+ldr r12, =tasks
+ldr r3, =taskcurrent
+ldr r0, [r3]
+add r1, r12, r0, lsl #3
+str r13, [r1]
+str r2, [r1, #4]
+schedulenext:
+add r0, r0, #1
+cmp r0, #TASK_MAX
+movhs r0, #0
+ldr r13, [r12, r0, lsl #3]
+cmp r13, #0
+beq schedulenext
+str r0, [r3]
+add r1, r12, r0, lsl #3
+ldr r2, [r1, #4]
+ldr r1, =IRQ_BASE
+str r2, [r1, #16]   // flags, back on the return to user mode
+ldr r1, =TIMER_BASE
+ldr r2, [r1]
+str r2, [r1]        // a full time slice
+pop {r0-r12, r14, r15}
+// addservice function, r0=8, r1=service number, r2=address of the routine
+// registers the routine in a free slot of the service table, returns 0 in r0
+// returns -1 if the number is outside the table or already taken
+addservice:
+cmp r1, #SERVICE_SLOTS
+bhs retminusone
+ldr r3, =services
+ldr r0, =retminusone
+ldr r12, [r3, r1, lsl #2]
+cmp r12, r0
+bne retminusone
+str r2, [r3, r1, lsl #2]
+mov r0, #0
 mov r15, r14
+.data
+// the text printf formats, 12 bytes more than PRINTF_SIZE leave room for
+// the last number and the null
+printfbuffer:
+.space PRINTF_SIZE + 12
+// the stack pointer and flags of every task, task 0 runs from the start
+tasks:
+.word -1, 0
+.space (TASK_MAX - 1) * 8
+taskcurrent:
+.word 0